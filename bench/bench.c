@@ -0,0 +1,393 @@
+/*
+ * File: bench.c
+ * Desc: Layer and model microbenchmarks with synthetic weights.
+ *
+ * Every case is timed with a monotonic wall clock until it has run at
+ * least MIN_ITERATIONS times and for MIN_SECONDS. The p50 of each case
+ * can be saved as a baseline and later compared against, in which case
+ * the run fails when a case is slower than the baseline by more than the
+ * threshold. The FIG_BENCH_BASELINE and FIG_BENCH_THRESHOLD environment
+ * variables do the same for `meson benchmark`.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <buffer.h>
+#include <cost.h>
+#include <layer.h>
+#include <model.h>
+
+#define MIN_ITERATIONS 5
+#define MAX_ITERATIONS 10000
+#define MIN_SECONDS    0.5
+#define MAX_CASES      64
+
+struct Case
+{
+    const char *name;
+    const char *suite;
+    FigModel *(*build) (FigBuffer *input);
+    uint32_t width,
+             height,
+             channels;
+    uint32_t batch;
+};
+
+struct Result
+{
+    const char *name;
+    double p50, p90, p99;
+    double flops, bytes;
+};
+
+static FigModel *build_conv3x3s1(FigBuffer *input);
+static FigModel *build_conv3x3s2(FigBuffer *input);
+static FigModel *build_conv1x1(FigBuffer *input);
+static FigModel *build_maxpool2x2(FigBuffer *input);
+static FigModel *build_fc(FigBuffer *input);
+static FigModel *build_detector(FigBuffer *input);
+static FigModel *build_classifier(FigBuffer *input);
+
+static const struct Case cases[] = {
+    { "conv3x3s1/40x40x32-32", "layers", &build_conv3x3s1, 40, 40, 32, 1 },
+    { "conv3x3s2/80x80x16-32", "layers", &build_conv3x3s2, 80, 80, 16, 1 },
+    { "conv1x1/40x40x64-64",   "layers", &build_conv1x1,   40, 40, 64, 1 },
+    { "maxpool2x2/80x80x32",   "layers", &build_maxpool2x2, 80, 80, 32, 1 },
+    { "fc/1024-1000",          "layers", &build_fc,        1, 1, 1024, 1 },
+    { "fc/8x1024-1000",        "layers", &build_fc,        1, 1, 1024, 8 },
+    { "detector/160x160x3",    "models", &build_detector,  160, 160, 3, 1 },
+    { "classifier/64x64x3",    "models", &build_classifier, 64, 64, 3, 1 },
+    { "classifier/8x64x64x3",  "models", &build_classifier, 64, 64, 3, 8 },
+};
+
+static float *
+random_array(size_t length)
+{
+    float *array = malloc(length * sizeof(float));
+
+    if (!array) {
+        fprintf(stderr, "failed allocating memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < length; i++)
+        array[i] = rand() / (float) RAND_MAX - 0.5f;
+
+    return array;
+}
+
+static void
+add_conv(FigModel *model, uint32_t kernel, uint32_t stride, uint32_t channels)
+{
+    FigBuffer *in = fig_model_output(model);
+    uint32_t pad = kernel / 2;
+    struct ConvDesc desc = {
+        .channels = channels,
+        .kernel_w = kernel,
+        .kernel_h = kernel,
+        .stride_x = stride,
+        .stride_y = stride,
+        .padding_top = pad,
+        .padding_left = pad,
+        .padding_bottom = pad,
+        .padding_right = pad,
+    };
+
+    desc.weight = random_array((size_t) kernel * kernel * in->channels * channels);
+    desc.bias = random_array(channels);
+
+    fig_model_add_layer(model, fig_layer_conv_new(in, FIG_ACT_RELU, false, &desc, NULL));
+}
+
+static void
+add_maxpool(FigModel *model, uint32_t kernel)
+{
+    struct MaxPoolDesc desc = {
+        .kernel_w = kernel,
+        .kernel_h = kernel,
+    };
+
+    fig_model_add_layer(model, fig_layer_maxpool_new(fig_model_output(model), &desc));
+}
+
+static void
+add_fc(FigModel *model, uint32_t units)
+{
+    FigBuffer *in = fig_model_output(model);
+    struct FCDesc desc = { .units = units };
+
+    desc.weight = random_array((size_t) fig_buffer_image_len(in) * units);
+    desc.bias = random_array(units);
+
+    fig_model_add_layer(model, fig_layer_fc_new(in, FIG_ACT_NOACT, &desc));
+}
+
+static FigModel *
+build_conv3x3s1(FigBuffer *input)
+{
+    FigModel *model = fig_model_new(input);
+
+    add_conv(model, 3, 1, 32);
+    return model;
+}
+
+static FigModel *
+build_conv3x3s2(FigBuffer *input)
+{
+    FigModel *model = fig_model_new(input);
+
+    add_conv(model, 3, 2, 32);
+    return model;
+}
+
+static FigModel *
+build_conv1x1(FigBuffer *input)
+{
+    FigModel *model = fig_model_new(input);
+
+    add_conv(model, 1, 1, 64);
+    return model;
+}
+
+static FigModel *
+build_maxpool2x2(FigBuffer *input)
+{
+    FigModel *model = fig_model_new(input);
+
+    add_maxpool(model, 2);
+    return model;
+}
+
+static FigModel *
+build_fc(FigBuffer *input)
+{
+    FigModel *model = fig_model_new(input);
+
+    add_fc(model, 1000);
+    return model;
+}
+
+/* Same shape classes as the 320x320 detection models, scaled down */
+
+static FigModel *
+build_detector(FigBuffer *input)
+{
+    FigModel *model = fig_model_new(input);
+
+    add_conv(model, 3, 2, 16);
+    add_conv(model, 3, 1, 16);
+    add_maxpool(model, 2);
+    add_conv(model, 3, 1, 32);
+    add_maxpool(model, 2);
+    add_conv(model, 1, 1, 32);
+    add_conv(model, 3, 1, 6);
+    return model;
+}
+
+static FigModel *
+build_classifier(FigBuffer *input)
+{
+    FigModel *model = fig_model_new(input);
+    struct SoftmaxDesc softmax_desc = { 0, 0 };
+
+    add_conv(model, 3, 2, 16);
+    add_conv(model, 3, 2, 32);
+    add_conv(model, 1, 1, 64);
+    fig_model_add_layer(model, fig_layer_global_avgpool_new(fig_model_output(model)));
+    add_fc(model, 100);
+    fig_model_add_layer(model, fig_layer_softmax_new(fig_model_output(model), &softmax_desc));
+    return model;
+}
+
+static double
+now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int
+compare_double(const void *p, const void *q)
+{
+    double a = *(const double *) p, b = *(const double *) q;
+
+    return a < b ? -1 : a > b;
+}
+
+static double
+percentile(double *sorted, int n, double p)
+{
+    int rank = (int) (p * n + 0.999999) - 1;
+
+    return sorted[rank < 0 ? 0 : rank >= n ? n - 1 : rank];
+}
+
+static void
+run_case(const struct Case *c, struct Result *result)
+{
+    FigBuffer *input = fig_buffer_new_batch(c->batch, c->width, c->height, c->channels);
+    FigModel *model;
+    FigLayerCost *costs;
+    double *samples, start, t;
+    uint32_t n_layers;
+    int n = 0;
+
+    for (uint32_t i = 0; i < fig_buffer_len(input); i++)
+        input->data[i] = rand() / (float) RAND_MAX;
+
+    model = c->build(input);
+    samples = malloc(MAX_ITERATIONS * sizeof(double));
+    if (!samples) {
+        fprintf(stderr, "failed allocating memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* one untimed pass to fault in the output buffers */
+    fig_model_forward(model);
+
+    start = now();
+    while (n < MAX_ITERATIONS && (n < MIN_ITERATIONS || now() - start < MIN_SECONDS)) {
+        t = now();
+        fig_model_forward(model);
+        samples[n++] = now() - t;
+    }
+
+    qsort(samples, n, sizeof(double), compare_double);
+
+    result->name = c->name;
+    result->p50 = percentile(samples, n, 0.50);
+    result->p90 = percentile(samples, n, 0.90);
+    result->p99 = percentile(samples, n, 0.99);
+    result->flops = 0;
+    result->bytes = 0;
+
+    /* costs are per image, and a batch reads the weights once */
+    costs = fig_model_cost(model, NULL, &n_layers);
+    for (uint32_t i = 0; i < n_layers; i++) {
+        result->flops += (double) costs[i].flops * c->batch;
+        result->bytes += costs[i].weight_bytes + (double) c->batch *
+                         (costs[i].bytes_read + costs[i].bytes_written);
+    }
+    free(costs);
+
+    printf("%-28s %10.3f %10.3f %10.3f %10.2f %10.2f %10.2f\n", c->name,
+           result->p50 * 1e3, result->p90 * 1e3, result->p99 * 1e3,
+           result->flops / result->p50 * 1e-9, result->bytes * 1e-6,
+           result->bytes / result->p50 * 1e-9);
+    fflush(stdout);
+
+    free(samples);
+    fig_model_destroy(model);
+    fig_buffer_destroy(input);
+}
+
+static void
+save_baseline(const char *path, struct Result *results, int n)
+{
+    FILE *fp = fopen(path, "w");
+
+    if (!fp) {
+        fprintf(stderr, "failed opening %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    for (int i = 0; i < n; i++)
+        fprintf(fp, "%s %.9f\n", results[i].name, results[i].p50);
+    fclose(fp);
+}
+
+/* Returns the number of cases slower than baseline by more than threshold percent */
+
+static int
+compare_baseline(const char *path, double threshold, struct Result *results, int n)
+{
+    FILE *fp = fopen(path, "r");
+    char name[256];
+    double p50;
+    int regressions = 0;
+
+    if (!fp) {
+        fprintf(stderr, "failed opening %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+
+    while (fscanf(fp, "%255s %lf", name, &p50) == 2) {
+        for (int i = 0; i < n; i++) {
+            if (strcmp(results[i].name, name))
+                continue;
+
+            double change = (results[i].p50 / p50 - 1) * 100;
+            if (change > threshold) {
+                printf("REGRESSION %-28s %+.1f%% (%.3f ms -> %.3f ms)\n",
+                       name, change, p50 * 1e3, results[i].p50 * 1e3);
+                regressions++;
+            } else {
+                printf("ok         %-28s %+.1f%%\n", name, change);
+            }
+        }
+    }
+
+    fclose(fp);
+    return regressions;
+}
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr,
+            "usage: %s [--suite layers|models] [--filter TEXT]\n"
+            "          [--save FILE] [--compare FILE] [--threshold PERCENT]\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *suite = NULL, *filter = NULL, *save = NULL;
+    const char *baseline = getenv("FIG_BENCH_BASELINE");
+    const char *env_threshold = getenv("FIG_BENCH_THRESHOLD");
+    double threshold = env_threshold ? atof(env_threshold) : 10;
+    struct Result results[MAX_CASES];
+    int n = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (i + 1 >= argc)
+            usage(argv[0]);
+        if (!strcmp(argv[i], "--suite"))
+            suite = argv[++i];
+        else if (!strcmp(argv[i], "--filter"))
+            filter = argv[++i];
+        else if (!strcmp(argv[i], "--save"))
+            save = argv[++i];
+        else if (!strcmp(argv[i], "--compare"))
+            baseline = argv[++i];
+        else if (!strcmp(argv[i], "--threshold"))
+            threshold = atof(argv[++i]);
+        else
+            usage(argv[0]);
+    }
+
+    srand(1);
+    printf("%-28s %10s %10s %10s %10s %10s %10s\n", "case", "p50 ms", "p90 ms",
+           "p99 ms", "GFLOP/s", "MB moved", "GB/s");
+
+    for (size_t i = 0; i < sizeof cases / sizeof cases[0]; i++) {
+        if (suite && strcmp(cases[i].suite, suite))
+            continue;
+        if (filter && !strstr(cases[i].name, filter))
+            continue;
+        run_case(cases + i, results + n++);
+    }
+
+    if (save)
+        save_baseline(save, results, n);
+
+    if (baseline && compare_baseline(baseline, threshold, results, n))
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,174 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <buffer.h>
+#include <model.h>
+#include <detect.h>
+#include <pipeline.h>
+#include <stages.h>
+
+static const float anchor[2] = { 0.04f, 0.04f };
+
+/*
+ * Runs the detector over every image given on the command line. Images
+ * are decoded on worker threads while the model runs.
+ */
+
+/* Runs the images through the model split into n_stages pipelined stages */
+
+static void
+run_stages(FigModel *model, FigPipeline *pipeline, FigDetector *detector,
+           uint32_t n_stages, char *paths[], uint32_t n_paths)
+{
+    struct StagesDesc stages_desc = {
+        .n_stages = n_stages,
+        .pin = true,
+    };
+    FigStages *stages;
+    FigDetection *det;
+    FigBuffer *buffer;
+    uint64_t index;
+    uint32_t submitted = 0, n;
+
+    stages = fig_stages_new(model, &stages_desc);
+
+    for (uint32_t done = 0; done < n_paths; done++) {
+        /* keep every frame in flight while there are images left */
+        while (submitted < n_paths && submitted - done < fig_stages_depth(stages)) {
+            buffer = fig_pipeline_next(pipeline, NULL);
+            memcpy(fig_stages_input(stages)->data, buffer->data,
+                   fig_buffer_len(buffer) * sizeof(float));
+            fig_pipeline_release(pipeline, buffer);
+            fig_stages_submit(stages);
+            submitted++;
+        }
+
+        n = fig_detect(detector, fig_stages_output(stages, &index), &det);
+        printf("%s: %u detections\n", paths[index], n);
+        fig_stages_release(stages);
+    }
+
+    fig_stages_destroy(stages);
+}
+
+int
+main(int argc, char *argv[])
+{
+    FigBuffer *input;
+    FigModel *model;
+    FigPipeline *pipeline;
+    FigDetector *detector;
+    FigDetection *det;
+    struct PreprocessDesc preprocess_desc = {
+        .channel_order = FIG_CHANNELS_BGR,
+        .mean = { 0, 0, 0 },
+        .std = { 1, 1, 1 },
+    };
+    struct PipelineDesc pipeline_desc = {
+        .n_workers = 2,
+        .depth = 2,
+        .width = 320,
+        .height = 320,
+        .channels = 3,
+        .preprocess = &preprocess_desc,
+    };
+    struct DetectDesc detect_desc = {
+        .n_anchors = 1,
+        .n_classes = 2,
+        .anchors = anchor,
+        .center_scale = 0.1f,
+        .size_scale = 0.2f,
+        .score = FIG_DETECT_SOFTMAX,
+        .conf_threshold = 0.3f,
+        .nms_threshold = 0.45f,
+        .top_k = 200,
+        .max_detections = 100,
+    };
+    struct timespec start, end;
+    FigModelStats *stats, *snapshot;
+    FigContext *context = NULL;
+    const char *node = getenv("FIG_NODE");
+    const char *n_stages = getenv("FIG_STAGES");
+    FigLatencySummary summary;
+    uint32_t index, n;
+
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s MODEL IMAGE...\n", argv[0]);
+        exit(1);
+    }
+
+    input = fig_buffer_new(320, 320, 3);
+    model = fig_model_from_file(argv[1], input);
+    detector = fig_detector_new(&detect_desc);
+    stats = fig_model_enable_stats(model);
+
+    /* FIG_HUGEPAGES=1 maps the model on huge pages, prefaulted up front */
+    if (getenv("FIG_HUGEPAGES")) {
+        struct MemoryDesc memory_desc = {
+            .huge_pages = true,
+            .prefault = true,
+        };
+
+        fig_model_set_memory(model, &memory_desc);
+    }
+
+    /* FIG_NODE=n keeps the model, its threads and its memory on node n */
+    if (node) {
+        struct ContextDesc context_desc = {
+            .node = atoi(node),
+            .pin = true,
+            .local = true,
+        };
+
+        context = fig_context_new(&context_desc);
+        fig_context_enter(context);
+        fig_model_set_context(model, context);
+    }
+
+    fig_model_warmup(model, 1);
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    pipeline = fig_pipeline_new(&pipeline_desc, (const char **) argv + 2, argc - 2);
+
+    /* FIG_STAGES=n splits the layers into n stages, 0 for one per CPU */
+    if (n_stages)
+        run_stages(model, pipeline, detector, atoi(n_stages), argv + 2, argc - 2);
+
+    for (FigBuffer *buffer; !n_stages && (buffer = fig_pipeline_next(pipeline, &index));) {
+        fig_model_set_input(model, buffer);
+        fig_model_forward(model);
+        fig_pipeline_release(pipeline, buffer);
+
+        n = fig_detect(detector, fig_model_output(model), &det);
+        printf("%s: %u detections\n", argv[2 + index], n);
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Images per second: %f\n", (argc - 2) /
+           (end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) * 1e-9));
+
+    /* what a metrics exporter would scrape, without stopping inference */
+    snapshot = fig_model_stats_new(stats->n_layers);
+    fig_model_stats_snapshot(stats, snapshot, true);
+    fig_histogram_summarize(&snapshot->forward, &summary);
+    /* stages run their own plans, which do not record statistics */
+    if (!n_stages) {
+        printf("Inferences: %llu, MB processed: %.1f\n",
+               (unsigned long long) snapshot->inferences, snapshot->bytes * 1e-6);
+        printf("Forward ms p50 %.3f p99 %.3f p99.9 %.3f max %.3f\n",
+               summary.p50_ns * 1e-6, summary.p99_ns * 1e-6,
+               summary.p999_ns * 1e-6, summary.max_ns * 1e-6);
+    }
+    fig_model_stats_destroy(snapshot);
+
+    fig_pipeline_destroy(pipeline);
+    fig_detector_destroy(detector);
+    fig_model_destroy(model);
+    if (context)
+        fig_context_destroy(context);
+    fig_buffer_destroy(input);
+
+    return 0;
+}
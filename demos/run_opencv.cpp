@@ -6,51 +6,43 @@
 #include <opencv2/imgcodecs.hpp>
 #include "buffer.h"
 #include "model.h"
+#include "detect.h"
+#include "image.h"
 
 
 using namespace cv;
 
-struct Detection
-{
-    float xc, yc;
-    float height, width;
-    float conf;
-};
-
+static const float anchor[2] = { 0.04f, 0.04f };
 
-void
-preprocess(Mat *image, FigBuffer *buffer)
-{
-    int offset;
-    uint8_t *row_ptr;
-
-    for (int y = 0; y < image->rows; y++) {
-        for (int x = 0; x < image->cols; x++) {
-            offset = fig_buffer_offset_of(buffer, x, y, 0);
-            row_ptr = image->ptr(y);
-            buffer->data[offset + 0] = *(row_ptr + 3 * x + 0) / 255.0;
-            buffer->data[offset + 1] = *(row_ptr + 3 * x + 1) / 255.0;
-            buffer->data[offset + 2] = *(row_ptr + 3 * x + 2) / 255.0;
-        }
-    }
-}
+/*
+ * A raw NV12 frame as cameras deliver it, converted and resized into the
+ * input buffer in one pass without going through a BGR Mat.
+ */
 
-int
-compare(const void *p, const void *q)
+static void
+read_nv12(const char *path, uint32_t width, uint32_t height,
+          FigBuffer *input, struct PreprocessDesc *desc)
 {
-    int res;
+    size_t size = (size_t) width * height + 2 * ((width + 1) / 2) * ((height + 1) / 2);
+    uint8_t *data = (uint8_t *) malloc(size);
+    FILE *fp = fopen(path, "rb");
 
-    struct Detection *a = (struct Detection *) p;
-    struct Detection *b = (struct Detection *) q;
-
-    if (a->conf < b->conf)
-        res = -1;
-    else if (a->conf > b->conf)
-        res = 1;
-    else
-        res = 0;
-
-    return -1 * res;
+    if (!data || !fp || fread(data, 1, size, fp) != size) {
+        fprintf(stderr, "unable to read %s\n", path);
+        exit(1);
+    }
+    fclose(fp);
+
+    FigYuvFrame frame = {
+        .format = FIG_YUV_NV12,
+        .full_range = false,
+        .width = width,
+        .height = height,
+        .planes = { data, data + (size_t) width * height, NULL },
+        .strides = { width, 2 * ((width + 1) / 2), 0 },
+    };
+    fig_image_yuv_into(&frame, input, desc);
+    free(data);
 }
 
 int
@@ -59,8 +51,25 @@ main(int argc, char *argv[])
     Mat image, image_resized;
     FigBuffer *input, *output;
     FigModel *model;
-    struct Detection det[20 * 20];
-    int i = 0;
+    FigDetector *detector;
+    FigDetection *det;
+    struct DetectDesc detect_desc = {
+        .n_anchors = 1,
+        .n_classes = 2,
+        .anchors = anchor,
+        .center_scale = 0.1f,
+        .size_scale = 0.2f,
+        .score = FIG_DETECT_SOFTMAX,
+        .conf_threshold = 0.3f,
+        .nms_threshold = 0.45f,
+        .top_k = 200,
+        .max_detections = 100,
+    };
+    /* the model takes the BGR pixels as they are, scaled to [0, 1] */
+    struct PreprocessDesc preprocess_desc = {
+        .channel_order = FIG_CHANNELS_BGR,
+    };
+    uint32_t n;
 
     if (argc < 2)
         exit(1);
@@ -68,53 +77,40 @@ main(int argc, char *argv[])
     input = fig_buffer_new(320, 320, 3);
     model = fig_model_from_file(argv[1], input);
 
-    image = imread(argv[2]);
-    resize(image, image_resized, Size(320, 320));
-    preprocess(&image_resized, input);
+    /* run_opencv MODEL IMAGE, or run_opencv MODEL FRAME.nv12 WIDTH HEIGHT */
+    if (argc > 4) {
+        read_nv12(argv[2], atoi(argv[3]), atoi(argv[4]), input, &preprocess_desc);
+    } else {
+        image = imread(argv[2]);
+        resize(image, image_resized, Size(320, 320));
+        fig_model_bind_input_u8(model, image_resized.data, image_resized.step,
+                                FIG_CHANNELS_BGR, &preprocess_desc);
+    }
 
-    time_t start = clock();
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
     fig_model_forward(model);
-    time_t end = clock();
+    clock_gettime(CLOCK_MONOTONIC, &end);
 
     output = fig_model_output(model);
 
     
-    for (uint32_t x = 0; x < output->height; x++) {
-        for (uint32_t y = 0; y < output->width; y++) {
-            float conf = exp(fig_buffer_at(output, x, y, 5)) /
-                (exp(fig_buffer_at(output, x, y, 4)) + exp(fig_buffer_at(output, x, y, 5)));
-
-            if (conf < 0.3)
-                continue;
-
-            float anchor_x = (x + 0.5f) / output->width;
-            float anchor_y = (y + 0.5f) / output->height;
-            float anchor_w = 0.04f;
-            float anchor_h = 0.04f;
-
-            det[i].conf = conf;
-            det[i].xc = anchor_x + 0.1f * anchor_w * fig_buffer_at(output, x, y, 0);
-            det[i].yc = anchor_y + 0.1f * anchor_h * fig_buffer_at(output, x, y, 1);
-            det[i].width = anchor_w * exp(0.2f * fig_buffer_at(output, x, y, 2));
-            det[i].height = anchor_h * exp(0.2f * fig_buffer_at(output, x, y, 3));
-
-            printf("%f\t%f\t%f\t%f\t%e\n", det[i].xc, det[i].yc, det[i].width, det[i].height, det[i].conf);
-            
-            i++;
-
-        }
-    }
+    detector = fig_detector_new(&detect_desc);
+    n = fig_detect(detector, output, &det);
 
-    qsort(det, 20 * 20, sizeof(struct Detection), compare);
+    for (uint32_t i = 0; i < n; i++)
+        printf("%f\t%f\t%f\t%f\t%e\n", det[i].xc, det[i].yc, det[i].width, det[i].height, det[i].conf);
 
     // fig_buffer_print(input, 1);
     // fig_buffer_print(fig_model_output(model), -1);
 
-    printf("Number of detections: %d\n", i);
+    printf("Number of detections: %u\n", n);
 
-    printf("Inference time: %f\n", (end - start) / (float) CLOCKS_PER_SEC);
+    printf("Inference time: %f\n", end.tv_sec - start.tv_sec +
+           (end.tv_nsec - start.tv_nsec) * 1e-9);
 
     fig_buffer_destroy(input);
+    fig_detector_destroy(detector);
     fig_model_destroy(model);
 
     return 0;
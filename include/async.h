@@ -0,0 +1,46 @@
+/*
+ * File: async.h
+ * Desc: Non blocking fig_model_forward() with completion callbacks or an
+ *       eventfd to poll on.
+ *
+ * The first asynchronous call starts a worker thread for the model.
+ * Requests queue up in submission order and run one at a time, since a
+ * model has a single set of activation buffers. The model output of a
+ * request stays valid until its handle is released; the next request
+ * only starts after that, so release handles promptly. Callbacks run on
+ * the worker thread and may release their handle or submit more work.
+ * Do not call fig_model_forward() while asynchronous work is pending.
+ * Handles outlive fig_model_stop_async() and can still be waited on and
+ * released, though their output goes with the model.
+ */
+
+#ifndef _FIG_ASYNC_H_
+#define _FIG_ASYNC_H_
+
+#include <stdbool.h>
+#include "buffer.h"
+#include "model.h"
+
+typedef struct FigForward FigForward;
+
+typedef void (*FigForwardCallback) (FigForward *forward, void *data);
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+FigForward *fig_model_forward_async (FigModel *model, FigBuffer *input,
+                                     FigForwardCallback callback, void *data);
+int         fig_forward_fd          (FigForward *forward);
+bool        fig_forward_done        (FigForward *forward);
+void        fig_forward_wait        (FigForward *forward);
+FigBuffer  *fig_forward_output      (FigForward *forward);
+void        fig_forward_release     (FigForward *forward);
+
+void        fig_model_stop_async    (FigModel *model);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* _FIG_ASYNC_H_ */
@@ -0,0 +1,99 @@
+/*
+ * File: async.hpp
+ * Desc: C++20 awaitable over fig_model_forward_async().
+ *
+ *     fig::ForwardResult result = co_await fig::forward(model, input);
+ *     use(result.output());
+ *
+ * The coroutine resumes on the model's worker thread, so it should hand
+ * itself back to its own executor before doing more than reading the
+ * output. The result releases the output when it goes out of scope;
+ * release it before awaiting the next forward pass of the same model,
+ * which cannot start while the output is held.
+ */
+
+#ifndef _FIG_ASYNC_HPP_
+#define _FIG_ASYNC_HPP_
+
+#include <coroutine>
+#include <utility>
+#include "async.h"
+
+namespace fig {
+
+class ForwardResult
+{
+public:
+    explicit ForwardResult(FigForward *forward) : forward_(forward) {}
+    ForwardResult(ForwardResult &&other) noexcept
+        : forward_(std::exchange(other.forward_, nullptr)) {}
+    ForwardResult &operator=(ForwardResult &&other) noexcept
+    {
+        if (this != &other) {
+            release();
+            forward_ = std::exchange(other.forward_, nullptr);
+        }
+        return *this;
+    }
+    ForwardResult(const ForwardResult &) = delete;
+    ForwardResult &operator=(const ForwardResult &) = delete;
+    ~ForwardResult() { release(); }
+
+    FigBuffer *output() const { return fig_forward_output(forward_); }
+
+    void release()
+    {
+        if (forward_)
+            fig_forward_release(std::exchange(forward_, nullptr));
+    }
+
+private:
+    FigForward *forward_;
+};
+
+class ForwardAwaitable
+{
+public:
+    ForwardAwaitable(FigModel *model, FigBuffer *input)
+        : model_(model), input_(input) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    /*
+     * The callback may resume the coroutine, and so end the lifetime of
+     * this object, before fig_model_forward_async() has even returned,
+     * hence the handle only comes back through the callback.
+     */
+    void await_suspend(std::coroutine_handle<> continuation)
+    {
+        continuation_ = continuation;
+        fig_model_forward_async(model_, input_, &ForwardAwaitable::complete, this);
+    }
+
+    ForwardResult await_resume() noexcept { return ForwardResult(forward_); }
+
+private:
+    static void complete(FigForward *forward, void *data)
+    {
+        auto *self = static_cast<ForwardAwaitable *>(data);
+
+        self->forward_ = forward;
+        self->continuation_.resume();
+    }
+
+    FigModel *model_;
+    FigBuffer *input_;
+    FigForward *forward_ = nullptr;
+    std::coroutine_handle<> continuation_;
+};
+
+/* input may be nullptr to run on the model's current input buffer */
+inline ForwardAwaitable
+forward(FigModel *model, FigBuffer *input = nullptr)
+{
+    return ForwardAwaitable(model, input);
+}
+
+} /* namespace fig */
+
+#endif /* _FIG_ASYNC_HPP_ */
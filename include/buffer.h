@@ -3,19 +3,66 @@
 
 #include <stdint.h>
 
+/*
+ * Activations are stored pixel after pixel, and a batch of images one
+ * image after another. FIG_LAYOUT_HWC8 pads the channels of every pixel
+ * to a multiple of 8 so kernels load and store whole vectors; the
+ * padding always reads as zero.
+ */
+
+enum FigLayout
+{
+    FIG_LAYOUT_HWC,
+    FIG_LAYOUT_HWC8
+};
+
 typedef struct
 {
     float *data;
     uint32_t height,
              width;
     uint32_t channels;
+
+    /* floats from one pixel to the next */
+    uint32_t stride;
+    int layout;
+
+    /* images held, each width x height x channels, of capacity allocated */
+    uint32_t batch,
+             capacity;
 } FigBuffer;
 
+typedef struct
+{
+    uint32_t width,
+             height,
+             channels;
+} FigShape;
+
+/* floats held by one image and by the whole batch, with channel padding */
+#define fig_buffer_image_len(buffer) \
+    (buffer->width * buffer->height * buffer->stride)
+
 #define fig_buffer_len(buffer) \
-    (buffer->width * buffer-> height * buffer->channels)
+    (buffer->batch * fig_buffer_image_len(buffer))
+
+/* floats allocated, which fig_buffer_set_batch() does not change */
+#define fig_buffer_capacity_len(buffer) \
+    ((size_t) buffer->capacity * fig_buffer_image_len(buffer))
+
+#define fig_buffer_image(buffer, n) \
+    (buffer->data + (size_t) (n) * fig_buffer_image_len(buffer))
+
+#define fig_buffer_shape(buffer) \
+    ((FigShape) { buffer->width, buffer->height, buffer->channels })
+
+#define fig_shape_len(shape) \
+    ((uint64_t) (shape).width * (shape).height * (shape).channels)
+
+/* offsets and fig_buffer_at() are within the first image of a batch */
 
 #define fig_buffer_offset_of(buffer, x, y, c) \
-    (buffer->channels * (y * buffer->width + x) + c)  
+    (buffer->stride * (y * buffer->width + x) + c)
 
 #define fig_buffer_at(buffer, x, y, c) \
     buffer->data[fig_buffer_offset_of(buffer, x, y, c)]
@@ -26,6 +73,10 @@ extern "C" {
 
 FigBuffer *fig_buffer_new     (uint32_t width, uint32_t height,
                                uint32_t channels);
+FigBuffer *fig_buffer_new_batch (uint32_t batch, uint32_t width, uint32_t height,
+                                 uint32_t channels);
+void       fig_buffer_set_layout (FigBuffer *buffer, int layout);
+void       fig_buffer_set_batch  (FigBuffer *buffer, uint32_t batch);
 void       fig_buffer_destroy (FigBuffer *buffer);
 
 #ifndef NDEBUG
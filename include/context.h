@@ -0,0 +1,61 @@
+/*
+ * File: context.h
+ * Desc: Execution contexts tying a model to a set of CPUs and a NUMA
+ *       placement policy.
+ *
+ * A context owns a thread pool whose workers are pinned to the CPUs of
+ * one node, or of every node when node is -1. Layers of a model bound to
+ * the context run their parallel loops on that pool. In local mode the
+ * activations and weights of the model are moved onto the context's
+ * node, so a model per socket runs without crossing the interconnect.
+ * A context spanning several nodes can instead replicate weights so
+ * every thread reads a copy on its own node.
+ */
+
+#ifndef _FIG_CONTEXT_H_
+#define _FIG_CONTEXT_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "threadpool.h"
+
+struct ContextDesc
+{
+    /* NUMA node index from fig_topology(), -1 for all nodes */
+    int node;
+
+    /* 0 for one thread per CPU of the node */
+    uint32_t n_threads;
+
+    bool pin;
+    bool local;
+    bool replicate_weights;
+};
+
+typedef struct
+{
+    int node;
+
+    bool pin,
+         local,
+         replicate_weights;
+
+    uint32_t n_cpus;
+    int *cpus;
+
+    FigThreadPool *pool;
+} FigContext;
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+FigContext *fig_context_new     (const struct ContextDesc *desc);
+void        fig_context_enter   (FigContext *context);
+void        fig_context_destroy (FigContext *context);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* _FIG_CONTEXT_H_ */
@@ -0,0 +1,66 @@
+/*
+ * File: cost.h
+ * Desc: Static work and traffic estimates for layers and models, and a
+ *       roofline built from measured machine peaks.
+ *
+ * Costs are derived from layer parameters and shapes inferred from an
+ * input shape, so a model can be costed for a resolution other than the
+ * one its buffers were allocated for. Traffic counts every activation
+ * and weight byte once, the ideal a kernel with perfect reuse reaches.
+ */
+
+#ifndef _FIG_COST_H_
+#define _FIG_COST_H_
+
+#include <stdint.h>
+#include "buffer.h"
+#include "layer.h"
+#include "model.h"
+#include "threadpool.h"
+
+typedef struct
+{
+    int type;
+
+    FigShape input,
+             output;
+
+    /* multiply-accumulates, and all arithmetic with a MAC counted as two */
+    uint64_t macs;
+    uint64_t flops;
+
+    uint64_t weight_bytes,
+             bytes_read,
+             bytes_written;
+} FigLayerCost;
+
+typedef struct
+{
+    double flops;      /* FLOP/s */
+    double bandwidth;  /* bytes/s */
+} FigPeak;
+
+#define fig_cost_bytes(cost) \
+    ((cost)->weight_bytes + (cost)->bytes_read + (cost)->bytes_written)
+
+/* FLOPs per byte of memory traffic */
+#define fig_cost_intensity(cost) \
+    ((double) (cost)->flops / (double) fig_cost_bytes(cost))
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+void          fig_layer_cost     (FigLayer *layer, const FigShape *input,
+                                  FigLayerCost *cost);
+FigLayerCost *fig_model_cost     (FigModel *model, const FigShape *input,
+                                  uint32_t *n_layers);
+
+void          fig_measure_peak   (FigThreadPool *pool, FigPeak *peak);
+double        fig_cost_predict   (const FigLayerCost *cost, const FigPeak *peak);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* _FIG_COST_H_ */
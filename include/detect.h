@@ -0,0 +1,84 @@
+/*
+ * File: detect.h
+ * Desc: Decoding of anchor based detection heads and class aware
+ *       non maximum suppression.
+ */
+
+#ifndef _FIG_DETECT_H_
+#define _FIG_DETECT_H_
+
+#include <stdint.h>
+#include "buffer.h"
+
+enum FigDetectScore
+{
+    FIG_DETECT_SOFTMAX,     /* softmax over classes, class 0 is background */
+    FIG_DETECT_SIGMOID      /* independent logistic score per class */
+};
+
+typedef struct
+{
+    float xc, yc;
+    float width, height;
+    float conf;
+    uint32_t class_id;
+} FigDetection;
+
+/*
+ * The head is expected to produce, at every grid cell, n_anchors groups
+ * of (dx, dy, dw, dh, class scores...) channels. Boxes are decoded as
+ *
+ *     xc = (x + 0.5) / grid_w + center_scale * anchor_w * dx
+ *     w  = anchor_w * exp(size_scale * dw)
+ *
+ * and are relative to the model input. anchors holds n_anchors (w, h)
+ * pairs. A zero top_k or max_detections means no limit.
+ */
+
+struct DetectDesc
+{
+    uint32_t n_anchors,
+             n_classes;
+
+    const float *anchors;
+
+    float center_scale,
+          size_scale;
+
+    int score;
+
+    float conf_threshold,
+          nms_threshold;
+
+    uint32_t top_k,
+             max_detections;
+};
+
+typedef struct
+{
+    struct DetectDesc desc;
+    float *anchors;
+
+    FigDetection *detections;
+    uint32_t capacity;
+
+    float *keep;
+    uint32_t keep_capacity;
+
+    float *scores;
+} FigDetector;
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+FigDetector *fig_detector_new     (struct DetectDesc *desc);
+uint32_t     fig_detect           (FigDetector *detector, FigBuffer *output,
+                                   FigDetection **detections);
+void         fig_detector_destroy (FigDetector *detector);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* _FIG_DETECT_H_ */
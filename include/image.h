@@ -1,7 +1,10 @@
 #ifndef _FIG_IMAGE_H_
 #define _FIG_IMAGE_H_
 
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
+#include "buffer.h"
 
 typedef struct
 {
@@ -10,6 +13,52 @@ typedef struct
     unsigned char *data;
 } FigImage;
 
+enum FigChannelOrder
+{
+    FIG_CHANNELS_RGB,
+    FIG_CHANNELS_BGR
+};
+
+/*
+ * Pixels are scaled to [0, 1] and then normalized as (v - mean) / std,
+ * with mean and std given in RGB order whatever the output order is. A
+ * zero std is treated as 1, so a zeroed descriptor gives plain RGB in
+ * [0, 1].
+ */
+
+struct PreprocessDesc
+{
+    int channel_order;
+
+    float mean[3],
+          std[3];
+};
+
+enum FigYuvFormat
+{
+    FIG_YUV_NV12,
+    FIG_YUV_I420
+};
+
+/*
+ * A 4:2:0 camera frame. NV12 has the Y plane and one plane of
+ * interleaved U and V samples, I420 has separate U and V planes. Each
+ * plane has its own row stride in bytes. Colours are BT.601, with
+ * luma in [16, 235] unless full_range is set.
+ */
+
+typedef struct
+{
+    int format;
+    bool full_range;
+
+    uint32_t width,
+             height;
+
+    const uint8_t *planes[3];
+    size_t strides[3];
+} FigYuvFrame;
+
 #ifdef __cplusplus
 extern "C" {
 #endif /* __cplusplus */
@@ -21,6 +70,10 @@ FigImage *fig_image_read    (const char *file_path);
 FigImage *fig_image_resize  (FigImage *image, uint32_t width, uint32_t height);
 void      fig_image_write   (FigImage *image, const char *file_path);
 
+void      fig_image_read_into (const char *file_path, FigBuffer *buffer,
+                               struct PreprocessDesc *desc);
+void      fig_image_yuv_into  (const FigYuvFrame *frame, FigBuffer *buffer,
+                               struct PreprocessDesc *desc);
 
 
 #ifdef __cplusplus
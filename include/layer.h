@@ -9,13 +9,18 @@
 #define _FIG_LAYER_H_
 
 #include <stdbool.h>
+#include <stddef.h>
 #include "buffer.h"
+#include "threadpool.h"
 
 enum FigLayerType
 {
     FIG_LAYER_CONV,
     FIG_LAYER_MAXPOOL,
-    FIG_LAYER_INPUT
+    FIG_LAYER_INPUT,
+    FIG_LAYER_FC,
+    FIG_LAYER_GLOBAL_AVGPOOL,
+    FIG_LAYER_SOFTMAX
 };
 
 enum FigActivation
@@ -27,6 +32,10 @@ enum FigActivation
 
 typedef struct FigLayer FigLayer;
 
+struct PreprocessDesc;
+struct FigConvInput;
+struct FigConvJit;
+
 struct FigLayer
 {
     int type;
@@ -45,6 +54,15 @@ struct FigLayer
 
     void (*forward) (FigLayer *layer);
 
+    /* name of the kernel forward dispatches to, for profiles */
+    const char *kernel;
+
+    /* pool for parallel kernels, NULL to run on the calling thread */
+    FigThreadPool *pool;
+
+    /* set when the arrays live in a model arena instead of the heap */
+    bool external_memory;
+
     void (*destroy) (FigLayer *layer);
 };
 
@@ -67,6 +85,21 @@ typedef struct
 
     float *bias,
           *weight;
+
+    /* output rows [y0, y1) of an image, specialized on the shape when possible */
+    void (*rows) (FigLayer *layer, const float *in, const float *weight,
+                  const float *packed, uint32_t image, uint32_t y0, uint32_t y1);
+
+    /* generated kernel and packed weights rows runs on, or NULL */
+    struct FigConvJit *jit;
+
+    /* a copy of weight, and of the packed weights of jit, per NUMA node, or NULL */
+    float **replicas,
+          **packed_replicas;
+    uint32_t n_replicas;
+
+    /* uint8 pixels read in place of in_buffer, or NULL */
+    struct FigConvInput *input;
 } FigConv;
 
 typedef struct
@@ -85,6 +118,24 @@ typedef struct
              padding_right;
 } FigMaxPool;
 
+typedef struct
+{
+    FigLayer base;
+
+    uint32_t units;
+
+    float *bias,
+          *weight;
+} FigFullyConnected;
+
+typedef struct
+{
+    FigLayer base;
+
+    uint32_t channel_offset,
+             channel_count;
+} FigSoftmax;
+
 struct ConvDesc
 {
     uint32_t channels;
@@ -129,15 +180,65 @@ struct MaxPoolDesc
              padding_right;
 };
 
+struct FCDesc
+{
+    uint32_t units;
+
+    float *weight,
+          *bias;
+};
+
+/*
+ * Softmax runs across channels at every spatial position. A non zero
+ * channel_count restricts it to a range of channels, the remaining
+ * channels are copied through unchanged.
+ */
+
+struct SoftmaxDesc
+{
+    uint32_t channel_offset,
+             channel_count;
+};
+
+/* output data, four batchnorm arrays, weight, bias and packed weights */
+#define FIG_LAYER_MAX_ARRAYS 8
+
 #define fig_layer_output(layer) (layer->out_buffer)
 #define fig_layer_forward(layer) ((*layer->forward)(layer))
 
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
 FigLayer *fig_layer_conv_new    (FigBuffer *in_buffer, int activation,
                                  bool batchnorm, struct ConvDesc *conv_desc,
                                  struct BatchNormDesc *batchnorm_desc);
 
 FigLayer *fig_layer_maxpool_new (FigBuffer *in_buffer, struct MaxPoolDesc *maxpool_desc);
 
+FigLayer *fig_layer_fc_new      (FigBuffer *in_buffer, int activation,
+                                 struct FCDesc *fc_desc);
+
+FigLayer *fig_layer_global_avgpool_new (FigBuffer *in_buffer);
+
+FigLayer *fig_layer_softmax_new (FigBuffer *in_buffer, struct SoftmaxDesc *softmax_desc);
+
+const char *fig_layer_type_name (int type);
+
+void     fig_layer_infer_shape  (FigLayer *layer, const FigShape *in_shape,
+                                 FigShape *out_shape);
+
+uint32_t fig_layer_arrays       (FigLayer *layer, float **arrays[], size_t sizes[]);
+void     fig_layer_bind         (FigLayer *layer, int node);
+void     fig_layer_replicate_weights (FigLayer *layer);
+void     fig_layer_conv_bind_u8 (FigLayer *layer, const uint8_t *data, size_t stride,
+                                 int source_order, const struct PreprocessDesc *desc);
+int      fig_layer_assign_layout (FigLayer *producer, FigLayer *consumer);
+
 void     fig_layer_destroy      (FigLayer *layer);
 
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
 #endif /* _FIG_LAYER_H_ */
@@ -1,8 +1,30 @@
 #ifndef _FIG_MODEL_H_
 #define _FIG_MODEL_H_
 
+#include "context.h"
 #include "layer.h"
 #include "list.h"
+#include "profile.h"
+#include "scheduler.h"
+#include "stats.h"
+
+/*
+ * Memory options applied by fig_model_set_memory(). Requests the system
+ * cannot honour fall back with a warning: hugetlbfs to transparent huge
+ * pages, huge pages to normal pages, locking to unlocked memory.
+ */
+
+struct MemoryDesc
+{
+    bool huge_pages;
+    bool hugetlbfs;
+    bool prefault;
+    bool lock;
+};
+
+struct FigArena;
+struct FigAsync;
+struct FigPlan;
 
 typedef struct
 {
@@ -10,6 +32,26 @@ typedef struct
 
     FigBuffer *input_buffer,
               *output_buffer;
+
+    FigProfiler *profiler;
+    FigModelStats *stats;
+    FigContext *context;
+
+    /* holds all layer arrays after fig_model_set_memory() */
+    struct FigArena *arena;
+
+    /* worker of fig_model_forward_async(), started on first use */
+    struct FigAsync *async;
+
+    /* layers flattened for fig_model_forward(), NULL until compiled */
+    struct FigPlan *plan;
+
+    /* the last layer's own output while fig_model_set_output() binds another */
+    FigBuffer *layer_output;
+
+    /* runs the model's jobs and admits its passes instead of the context */
+    FigScheduler *scheduler;
+    int priority;
 } FigModel;
 
 #define fig_model_output(model) \
@@ -22,7 +64,20 @@ extern "C" {
 FigModel *fig_model_new       (FigBuffer *input_buffer);
 FigModel *fig_model_from_file (const char *file_path, FigBuffer *input_buffer);
 void      fig_model_add_layer (FigModel *model, FigLayer *layer);
+void      fig_model_set_input (FigModel *model, FigBuffer *input_buffer);
+void      fig_model_set_output (FigModel *model, FigBuffer *output_buffer);
+void      fig_model_set_batch (FigModel *model, uint32_t batch);
+void      fig_model_bind_input_u8 (FigModel *model, const uint8_t *data, size_t stride,
+                                   int source_order, const struct PreprocessDesc *desc);
+void      fig_model_compile   (FigModel *model);
 void      fig_model_forward   (FigModel *model);
+void      fig_model_set_profiler (FigModel *model, FigProfiler *profiler);
+FigModelStats *fig_model_enable_stats (FigModel *model);
+void      fig_model_set_context (FigModel *model, FigContext *context);
+void      fig_model_set_scheduler (FigModel *model, FigScheduler *scheduler,
+                                   int priority);
+int       fig_model_set_memory  (FigModel *model, const struct MemoryDesc *desc);
+void      fig_model_warmup      (FigModel *model, uint32_t n_runs);
 void      fig_model_destroy   (FigModel *model);
 
 #ifdef __cplusplus
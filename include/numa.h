@@ -0,0 +1,51 @@
+/*
+ * File: numa.h
+ * Desc: NUMA topology read from /sys and placement of existing memory
+ *       on a node, without libnuma.
+ *
+ * Nodes are numbered by their index in FigTopology.nodes, which skips
+ * memory only nodes; id keeps the kernel's number. Machines without
+ * /sys/devices/system/node, or kernels without NUMA support, show up as
+ * a single node holding every online CPU. Placement requests are hints:
+ * where mbind() is not available they do nothing and memory stays
+ * wherever it was first touched.
+ */
+
+#ifndef _FIG_NUMA_H_
+#define _FIG_NUMA_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FIG_NUMA_MAX_NODES 64
+
+typedef struct
+{
+    int id;
+    uint32_t n_cpus;
+    int *cpus;
+} FigNumaNode;
+
+typedef struct
+{
+    uint32_t n_nodes;
+    FigNumaNode *nodes;
+
+    /* node of every CPU id up to max_cpu, -1 for offline CPUs */
+    int max_cpu;
+    int *cpu_node;
+} FigTopology;
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+const FigTopology *fig_topology          ();
+int                fig_numa_current_node ();
+int                fig_numa_bind         (void *ptr, size_t size, int node);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* _FIG_NUMA_H_ */
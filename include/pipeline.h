@@ -0,0 +1,68 @@
+/*
+ * File: pipeline.h
+ * Desc: Decodes a list of images on worker threads ahead of inference.
+ */
+
+#ifndef _FIG_PIPELINE_H_
+#define _FIG_PIPELINE_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "buffer.h"
+#include "image.h"
+
+/* Fills buffer from the item at path, the default is fig_image_read_into() */
+typedef void (*FigDecodeFunc) (const char *path, FigBuffer *buffer, void *data);
+
+struct PipelineDesc
+{
+    uint32_t n_workers;     /* decode threads, at least 1 */
+    uint32_t depth;         /* buffers per worker, at least 2 */
+
+    uint32_t width,
+             height,
+             channels;
+
+    struct PreprocessDesc *preprocess;
+
+    FigDecodeFunc decode;
+    void *decode_data;
+};
+
+struct PipelineSlot;
+struct PipelineWorker;
+
+/*
+ * Item i is decoded by worker i % n_workers. Every worker owns depth
+ * buffers that circulate through two lock free rings: full ones to the
+ * consumer and released ones back. fig_pipeline_next() reads the workers
+ * round robin, so items come out in order.
+ */
+
+typedef struct
+{
+    struct PipelineDesc desc;
+
+    const char **paths;
+    uint32_t n_paths;
+    uint32_t consumed;
+
+    struct PipelineSlot *slots;
+    struct PipelineWorker *workers;
+} FigPipeline;
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+FigPipeline *fig_pipeline_new     (struct PipelineDesc *desc,
+                                   const char **paths, uint32_t n_paths);
+FigBuffer   *fig_pipeline_next    (FigPipeline *pipeline, uint32_t *index);
+void         fig_pipeline_release (FigPipeline *pipeline, FigBuffer *buffer);
+void         fig_pipeline_destroy (FigPipeline *pipeline);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* _FIG_PIPELINE_H_ */
@@ -0,0 +1,106 @@
+/*
+ * File: profile.h
+ * Desc: Per layer timing of fig_model_forward() with Chrome trace export.
+ *
+ * A model with a profiler attached records one event per layer and one
+ * for the whole forward pass. Events go into a buffer sized up front and
+ * are dropped once it is full, so recording never allocates. Models
+ * without a profiler run the plain loop. Building with -Dprofiling=false
+ * removes the instrumented loop entirely.
+ *
+ * fig_profiler_enable_counters() additionally reads hardware counters
+ * through perf_event_open around every layer. They count the thread that
+ * calls fig_model_forward(), in user space only. Where perf events are
+ * not permitted (perf_event_paranoid, containers, VMs without a PMU) the
+ * counters stay disabled and only timings are recorded.
+ */
+
+#ifndef _FIG_PROFILE_H_
+#define _FIG_PROFILE_H_
+
+#include <stdint.h>
+#include <stdio.h>
+#include "layer.h"
+
+/* layer_index of the event spanning a whole forward pass */
+#define FIG_PROFILE_FORWARD -1
+
+typedef enum
+{
+    FIG_COUNTER_CYCLES,
+    FIG_COUNTER_INSTRUCTIONS,
+    FIG_COUNTER_LLC_MISSES,
+    FIG_COUNTER_L1D_MISSES,
+    FIG_COUNTER_BRANCH_MISSES,
+    FIG_N_COUNTERS
+} FigCounter;
+
+typedef struct
+{
+    uint64_t ns;
+    uint64_t counters[FIG_N_COUNTERS];
+} FigProfileSample;
+
+typedef struct
+{
+    int32_t layer_index;
+    int type;
+    const char *kernel;
+
+    uint32_t in_width,
+             in_height,
+             in_channels;
+
+    uint32_t out_width,
+             out_height,
+             out_channels;
+
+    uint64_t start_ns,
+             end_ns;
+
+    uint64_t thread_id;
+
+    /* deltas over the event, zero for counters not in counter_mask */
+    uint64_t counters[FIG_N_COUNTERS];
+} FigProfileEvent;
+
+typedef struct
+{
+    FigProfileEvent *events;
+    uint32_t n_events,
+             capacity;
+
+    uint64_t dropped;
+    uint64_t runs;
+
+    /* bit i set when FigCounter i is being read */
+    uint32_t counter_mask;
+    void *perf;
+} FigProfiler;
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+FigProfiler *fig_profiler_new             (uint32_t capacity);
+uint32_t     fig_profiler_enable_counters (FigProfiler *profiler);
+uint32_t     fig_profiler_events          (FigProfiler *profiler, FigProfileEvent **events);
+void         fig_profiler_reset           (FigProfiler *profiler);
+int          fig_profiler_write_trace     (FigProfiler *profiler, const char *file_path);
+void         fig_profiler_print_summary   (FigProfiler *profiler, FILE *fp);
+void         fig_profiler_destroy         (FigProfiler *profiler);
+
+/* Used by the forward loop */
+
+uint64_t     fig_profiler_now             ();
+void         fig_profiler_sample          (FigProfiler *profiler, FigProfileSample *sample);
+void         fig_profiler_record          (FigProfiler *profiler, FigLayer *layer,
+                                           int32_t layer_index,
+                                           const FigProfileSample *start,
+                                           const FigProfileSample *end);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* _FIG_PROFILE_H_ */
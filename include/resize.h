@@ -0,0 +1,88 @@
+/*
+ * File: resize.h
+ * Desc: Fixed point image resizing with precomputed coefficient tables.
+ */
+
+#ifndef _FIG_RESIZE_H_
+#define _FIG_RESIZE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "threadpool.h"
+
+/* fractional bits of bilinear weights and of horizontally resized rows */
+#define FIG_RESIZE_BILINEAR_BITS 8
+
+enum FigResizeFilter
+{
+    FIG_RESIZE_AUTO,        /* per axis, area when it shrinks by 2 or more, else bilinear */
+    FIG_RESIZE_BILINEAR,
+    FIG_RESIZE_AREA
+};
+
+/*
+ * Coefficients for one (source, destination) shape pair. Build it once
+ * and reuse it for every frame of that shape. Bilinear weights have 8
+ * fractional bits and area weights 14, and in both cases the horizontal
+ * pass keeps 16 bit intermediate rows. A resizer runs one frame at a
+ * time, its bands keep their rows in scratch allocated with it.
+ */
+
+typedef struct
+{
+    uint32_t src_w,
+             src_h,
+             dst_w,
+             dst_h;
+    uint32_t channels;
+
+    /*
+     * FIG_RESIZE_BILINEAR when both axes are, else FIG_RESIZE_AREA and
+     * both axes run from the tap tables, where an axis that does not
+     * shrink enough for area keeps its two bilinear taps
+     */
+    int filter;
+
+    /* bilinear, x tables are per output element */
+    uint32_t *x_offset;
+    uint16_t *x_weight;
+    uint32_t *y0,
+             *y1;
+    uint16_t *y_weight;
+
+    /* area, weights are stored max_taps apart */
+    uint32_t *x_start,
+             *x_taps,
+             *y_start,
+             *y_taps;
+    uint16_t *x_tap_weight,
+             *y_tap_weight;
+    uint32_t x_max_taps,
+             y_max_taps;
+
+    /* band_scratch bytes per band, for the most bands a frame was split into */
+    uint8_t *scratch;
+    size_t band_scratch;
+    uint32_t scratch_bands;
+} FigResizer;
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+FigResizer *fig_resizer_new     (uint32_t src_w, uint32_t src_h,
+                                 uint32_t dst_w, uint32_t dst_h,
+                                 uint32_t channels, int filter);
+void        fig_resizer_run     (FigResizer *resizer,
+                                 const uint8_t *src, size_t src_stride,
+                                 uint8_t *dst, size_t dst_stride,
+                                 FigThreadPool *pool);
+void        fig_resizer_row     (FigResizer *resizer, const uint8_t *src,
+                                 uint32_t step, uint16_t *dst);
+void        fig_resizer_destroy (FigResizer *resizer);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* _FIG_RESIZE_H_ */
@@ -0,0 +1,96 @@
+/*
+ * File: scheduler.h
+ * Desc: One set of worker threads shared by every model of a process,
+ *       running the tiles of many inferences at once with latency
+ *       priority classes and a cap on concurrent inferences.
+ *
+ * Models given a scheduler with fig_model_set_scheduler() post each
+ * parallel layer as a job of tiles instead of running it on their own
+ * pool. A job's tiles are split into one range per thread up front;
+ * threads take tiles from their own range first, which keeps the same
+ * rows on the same core from layer to layer, and steal from the others
+ * when it runs dry. Workers always serve the highest priority class
+ * with tiles left, and a thread running lower priority tiles checks for
+ * higher priority jobs after every tile, so interactive inferences pre-
+ * empt bulk ones at tile boundaries without waiting for their layers.
+ * The thread of each inference takes part in its own jobs only.
+ *
+ * Admission bounds the inferences running at once, so concurrent
+ * callers queue instead of interleaving more working sets than the
+ * caches hold. Waiting interactive inferences are admitted first.
+ */
+
+#ifndef _FIG_SCHEDULER_H_
+#define _FIG_SCHEDULER_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "stats.h"
+#include "threadpool.h"
+
+enum FigPriority
+{
+    FIG_PRIORITY_INTERACTIVE,
+    FIG_PRIORITY_BULK,
+    FIG_PRIORITY_CLASSES
+};
+
+struct SchedulerDesc
+{
+    /* threads running tiles with the caller of a job, 0 for one per online CPU */
+    uint32_t n_threads;
+
+    /* worker i is pinned to cpus[(i + 1) % n_cpus] when given, as in pools */
+    const int *cpus;
+    uint32_t n_cpus;
+
+    /* inferences running at once, 0 for no limit */
+    uint32_t max_inferences;
+};
+
+struct SchedulerJob;
+
+typedef struct FigScheduler
+{
+    uint32_t n_threads,
+             max_inferences;
+    pthread_t *threads;
+    uint32_t started;
+
+    pthread_mutex_t lock;
+    /* work posted, a job finished or unlisted, an inference left */
+    pthread_cond_t wake,
+                   done,
+                   admit;
+
+    /* jobs with tiles to claim per class, oldest first */
+    struct SchedulerJob *jobs[FIG_PRIORITY_CLASSES];
+    /* their number, read between tiles without the lock */
+    uint32_t listed[FIG_PRIORITY_CLASSES];
+
+    /* admitted inferences, and those waiting per class */
+    uint32_t running,
+             waiting[FIG_PRIORITY_CLASSES];
+    int quit;
+
+    /* time inferences waited for admission, per class */
+    FigHistogram admission_wait[FIG_PRIORITY_CLASSES];
+} FigScheduler;
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+FigScheduler *fig_scheduler_new     (const struct SchedulerDesc *desc);
+uint32_t      fig_scheduler_size    (FigScheduler *scheduler);
+void          fig_scheduler_admit   (FigScheduler *scheduler, int priority);
+void          fig_scheduler_leave   (FigScheduler *scheduler);
+void          fig_scheduler_run     (FigScheduler *scheduler, int priority,
+                                     FigTaskFunc func, void *arg, uint32_t n_tasks);
+void          fig_scheduler_destroy (FigScheduler *scheduler);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* _FIG_SCHEDULER_H_ */
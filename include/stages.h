@@ -0,0 +1,71 @@
+/*
+ * File: stages.h
+ * Desc: Layer pipelined execution of a model over a stream of frames.
+ *
+ * The layers of a model are split into consecutive stages of about the
+ * same predicted cost, each run by its own thread, and its own pool when
+ * it has more than one CPU, on its own group of CPUs. Frames move from
+ * stage to stage through lock free single producer, single consumer
+ * rings, so while one stage runs frame t + 1 the next runs frame t and
+ * every core stays busy even on layers too small to split over them.
+ * Latency is that of the whole model; throughput is that of the slowest
+ * stage.
+ *
+ * Every frame in flight has its own input, output and stage boundary
+ * buffers, which the stages bind to their first and last layers as they
+ * take it. Fill the buffer of fig_stages_input() and send it with
+ * fig_stages_submit(); outputs come back from fig_stages_output() in
+ * submission order and are handed back with fig_stages_release(). One
+ * thread may submit while another collects outputs. Do not run the
+ * model by other means while it is split into stages.
+ */
+
+#ifndef _FIG_STAGES_H_
+#define _FIG_STAGES_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "buffer.h"
+#include "cost.h"
+#include "model.h"
+
+struct StagesDesc
+{
+    /* 0 for one per CPU, at most one per layer and per CPU */
+    uint32_t n_stages;
+
+    /* CPUs to divide among the stages, NULL for every online CPU */
+    const int *cpus;
+    uint32_t n_cpus;
+    bool pin;
+
+    /* frames in flight, 0 for two per stage, at least one per stage */
+    uint32_t depth;
+
+    /* peaks weighing layer costs, NULL for a ridge of 10 FLOP/byte */
+    const FigPeak *peak;
+};
+
+typedef struct FigStages FigStages;
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+FigStages *fig_stages_new         (FigModel *model, const struct StagesDesc *desc);
+uint32_t   fig_stages_count       (FigStages *stages);
+uint32_t   fig_stages_first_layer (FigStages *stages, uint32_t stage);
+uint32_t   fig_stages_depth       (FigStages *stages);
+
+FigBuffer *fig_stages_input       (FigStages *stages);
+void       fig_stages_submit      (FigStages *stages);
+FigBuffer *fig_stages_output      (FigStages *stages, uint64_t *index);
+void       fig_stages_release     (FigStages *stages);
+
+void       fig_stages_destroy     (FigStages *stages);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* _FIG_STAGES_H_ */
@@ -0,0 +1,85 @@
+/*
+ * File: stats.h
+ * Desc: Lock free latency histograms and throughput counters for
+ *       monitoring a model in production.
+ *
+ * Histograms have log-linear buckets in the style of HdrHistogram: every
+ * power of two range of nanoseconds is split into 32 buckets, so a
+ * recorded value is known to about 3%. Recording is a handful of relaxed
+ * atomic adds. Readers take a snapshot, optionally zeroing the live
+ * histogram bucket by bucket with atomic exchanges, and compute
+ * percentiles from the copy; neither side ever takes a lock.
+ */
+
+#ifndef _FIG_STATS_H_
+#define _FIG_STATS_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define FIG_HISTOGRAM_SUB_BITS 5
+/* values from 2^41 ns (about 36 minutes) up land in the last bucket */
+#define FIG_HISTOGRAM_MAX_BITS 41
+#define FIG_HISTOGRAM_BUCKETS \
+    ((FIG_HISTOGRAM_MAX_BITS - FIG_HISTOGRAM_SUB_BITS + 1) << FIG_HISTOGRAM_SUB_BITS)
+
+typedef struct
+{
+    uint64_t count,
+             sum_ns,
+             max_ns;
+
+    uint64_t buckets[FIG_HISTOGRAM_BUCKETS];
+} FigHistogram;
+
+typedef struct
+{
+    uint64_t count;
+    double mean_ns;
+
+    uint64_t p50_ns,
+             p90_ns,
+             p99_ns,
+             p999_ns,
+             max_ns;
+} FigLatencySummary;
+
+/*
+ * Per model statistics, updated by every fig_model_forward() once
+ * enabled. inferences counts images, so a batch adds its size, and
+ * bytes counts the input and output activations of each pass.
+ */
+
+typedef struct
+{
+    uint64_t inferences;
+    uint64_t bytes;
+
+    FigHistogram forward;
+
+    uint32_t n_layers;
+    FigHistogram *layers;
+} FigModelStats;
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+void     fig_histogram_init       (FigHistogram *histogram);
+void     fig_histogram_record     (FigHistogram *histogram, uint64_t ns);
+void     fig_histogram_snapshot   (FigHistogram *histogram, FigHistogram *snapshot,
+                                   bool reset);
+uint64_t fig_histogram_percentile (const FigHistogram *histogram, double p);
+void     fig_histogram_summarize  (const FigHistogram *histogram,
+                                   FigLatencySummary *summary);
+
+FigModelStats *fig_model_stats_new      (uint32_t n_layers);
+void           fig_model_stats_snapshot (FigModelStats *stats, FigModelStats *snapshot,
+                                         bool reset);
+void           fig_model_stats_destroy  (FigModelStats *stats);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* _FIG_STATS_H_ */
@@ -0,0 +1,60 @@
+/*
+ * File: threadpool.h
+ * Desc: A fixed set of worker threads running data parallel loops.
+ */
+
+#ifndef _FIG_THREADPOOL_H_
+#define _FIG_THREADPOOL_H_
+
+#include <stdint.h>
+#include <pthread.h>
+#include "stats.h"
+
+typedef void (*FigTaskFunc) (void *arg, uint32_t index);
+
+typedef struct
+{
+    pthread_t *threads;
+    uint32_t n_threads;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake,
+                   done;
+
+    pthread_mutex_t run_lock;
+
+    /* the loop being run, guarded by lock */
+    FigTaskFunc func;
+    void *arg;
+    uint32_t n_tasks;
+    uint64_t generation;
+    uint32_t active;
+    int quit;
+
+    uint32_t next,
+             finished;
+
+    /*
+     * Time parallel loops spent queued behind other callers before
+     * they started, for monitoring. Inline loops are not recorded.
+     */
+    FigHistogram queue_wait;
+} FigThreadPool;
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+FigThreadPool *fig_thread_pool_new     (uint32_t n_threads);
+FigThreadPool *fig_thread_pool_new_pinned (const int *cpus, uint32_t n_cpus);
+void           fig_thread_pool_run     (FigThreadPool *pool, FigTaskFunc func,
+                                        void *arg, uint32_t n_tasks);
+uint32_t       fig_thread_pool_size    (FigThreadPool *pool);
+FigThreadPool *fig_thread_pool_default ();
+void           fig_thread_pool_destroy (FigThreadPool *pool);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+#endif /* _FIG_THREADPOOL_H_ */
@@ -0,0 +1,121 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "misc.h"
+#include "arena.h"
+
+#define HUGE_PAGE_SIZE (2ul << 20)
+#define ALIGNMENT 64
+
+static void *map_aligned(size_t size, size_t alignment);
+
+/*
+ * Maps size bytes. Flags that cannot be honoured fall back with a
+ * warning: hugetlbfs to transparent huge pages when no pages are
+ * reserved, and locking to plain memory when RLIMIT_MEMLOCK is too low.
+ * arena->flags keeps what was actually applied.
+ */
+
+FigArena *
+fig_arena_new(size_t size, int flags)
+{
+    FigArena *arena;
+    long page = sysconf(_SC_PAGESIZE);
+
+    arena = malloc(sizeof *arena);
+    if (!arena)
+        fig_panic("failed allocating memory");
+
+    arena->flags = flags;
+    arena->used = 0;
+    arena->base = MAP_FAILED;
+
+    if (flags & (FIG_ARENA_HUGEPAGE | FIG_ARENA_HUGETLB))
+        size = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    else
+        size = (size + page - 1) & ~(page - 1);
+    arena->size = size;
+
+#ifdef MAP_HUGETLB
+    if (flags & FIG_ARENA_HUGETLB) {
+        arena->base = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (arena->base == MAP_FAILED) {
+            fig_warn("no hugetlbfs pages available, using transparent huge pages");
+            arena->flags |= FIG_ARENA_HUGEPAGE;
+        }
+    }
+#endif /* MAP_HUGETLB */
+    if (arena->base == MAP_FAILED) {
+        arena->flags &= ~FIG_ARENA_HUGETLB;
+        arena->base = map_aligned(size, arena->flags & FIG_ARENA_HUGEPAGE ?
+                                  HUGE_PAGE_SIZE : (size_t) page);
+    }
+
+#ifdef MADV_HUGEPAGE
+    if (arena->flags & FIG_ARENA_HUGEPAGE &&
+        madvise(arena->base, size, MADV_HUGEPAGE)) {
+        fig_warn("transparent huge pages unavailable");
+        arena->flags &= ~FIG_ARENA_HUGEPAGE;
+    }
+#endif /* MADV_HUGEPAGE */
+
+    if (arena->flags & FIG_ARENA_PREFAULT)
+        for (size_t i = 0; i < size; i += page)
+            arena->base[i] = 0;
+
+    if (arena->flags & FIG_ARENA_LOCK && mlock(arena->base, size)) {
+        fig_warn("failed locking model memory, check RLIMIT_MEMLOCK");
+        arena->flags &= ~FIG_ARENA_LOCK;
+    }
+
+    return arena;
+}
+
+/* Returns ALIGNMENT aligned memory, NULL once the arena is full */
+
+void *
+fig_arena_alloc(FigArena *arena, size_t size)
+{
+    size_t offset = (arena->used + ALIGNMENT - 1) & ~(size_t) (ALIGNMENT - 1);
+
+    if (offset + size > arena->size)
+        return NULL;
+
+    arena->used = offset + size;
+    return arena->base + offset;
+}
+
+void
+fig_arena_destroy(FigArena *arena)
+{
+    munmap(arena->base, arena->size);
+    free(arena);
+}
+
+/* Maps size bytes starting on an alignment boundary */
+
+static void *
+map_aligned(size_t size, size_t alignment)
+{
+    char *p, *start;
+    size_t head, tail;
+
+    p = mmap(NULL, size + alignment, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+        fig_panic("failed mapping memory");
+
+    start = (char *) (((uintptr_t) p + alignment - 1) & ~(uintptr_t) (alignment - 1));
+    head = start - p;
+    tail = alignment - head;
+
+    if (head)
+        munmap(p, head);
+    if (tail)
+        munmap(start + size, tail);
+
+    return start;
+}
@@ -0,0 +1,34 @@
+/*
+ * File: arena.h
+ * Desc: A single anonymous mapping that model arrays are carved from,
+ *       optionally backed by huge pages, prefaulted and locked.
+ */
+
+#ifndef _FIG_ARENA_H_
+#define _FIG_ARENA_H_
+
+#include <stddef.h>
+
+enum FigArenaFlags
+{
+    FIG_ARENA_HUGEPAGE = 1 << 0,  /* transparent huge pages */
+    FIG_ARENA_HUGETLB  = 1 << 1,  /* reserved hugetlbfs pages */
+    FIG_ARENA_PREFAULT = 1 << 2,
+    FIG_ARENA_LOCK     = 1 << 3
+};
+
+typedef struct FigArena
+{
+    char *base;
+    size_t size,
+           used;
+
+    /* the flags that could be honoured */
+    int flags;
+} FigArena;
+
+FigArena *fig_arena_new     (size_t size, int flags);
+void     *fig_arena_alloc   (FigArena *arena, size_t size);
+void      fig_arena_destroy (FigArena *arena);
+
+#endif /* _FIG_ARENA_H_ */
@@ -0,0 +1,328 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include "misc.h"
+#include "async.h"
+
+enum
+{
+    FORWARD_QUEUED,
+    FORWARD_RUNNING,
+    FORWARD_DONE
+};
+
+struct FigForward
+{
+    FigModel *model;
+    struct FigAsync *async;
+    FigBuffer *input;
+
+    FigForwardCallback callback;
+    void *data;
+    int event_fd;
+
+    /* guarded by the lock of the model's FigAsync */
+    int state;
+    bool released;
+
+    FigForward *next;
+};
+
+struct FigAsync
+{
+    FigModel *model;
+    pthread_t thread;
+
+    pthread_mutex_t lock;
+    pthread_cond_t wake,
+                   done;
+
+    FigForward *head,
+               *tail;
+
+    /* finished request whose output has not been released yet */
+    FigForward *outstanding;
+    int quit;
+
+    /* the model until stopped, and every handle not yet freed */
+    uint32_t refs;
+};
+
+static struct FigAsync *async_start(FigModel *model);
+static void *async_main(void *data);
+static void  forward_free(FigForward *forward);
+static void  async_unref(struct FigAsync *async);
+
+static pthread_mutex_t start_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* Set on the worker while it runs the callback of this request */
+static __thread FigForward *in_callback;
+
+/*
+ * Queues a forward pass of model, on input when it is not NULL, and
+ * returns at once. callback, if given, is called on the worker thread
+ * when the pass has finished; without one the handle gets an eventfd
+ * that becomes readable instead.
+ */
+
+FigForward *
+fig_model_forward_async(FigModel *model, FigBuffer *input,
+                        FigForwardCallback callback, void *data)
+{
+    struct FigAsync *async;
+    FigForward *forward;
+
+    pthread_mutex_lock(&start_lock);
+    if (!model->async)
+        model->async = async_start(model);
+    async = model->async;
+    pthread_mutex_unlock(&start_lock);
+
+    forward = malloc(sizeof *forward);
+    if (!forward)
+        fig_panic("failed allocating memory");
+
+    forward->model = model;
+    forward->async = async;
+    forward->input = input;
+    forward->callback = callback;
+    forward->data = data;
+    forward->state = FORWARD_QUEUED;
+    forward->released = false;
+    forward->next = NULL;
+    forward->event_fd = -1;
+
+    if (!callback) {
+        forward->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (forward->event_fd < 0)
+            fig_panic("failed creating eventfd");
+    }
+
+    pthread_mutex_lock(&async->lock);
+    async->refs++;
+    if (async->tail)
+        async->tail->next = forward;
+    else
+        async->head = forward;
+    async->tail = forward;
+    pthread_cond_signal(&async->wake);
+    pthread_mutex_unlock(&async->lock);
+
+    return forward;
+}
+
+/* The eventfd of a request submitted without a callback, -1 otherwise */
+
+int
+fig_forward_fd(FigForward *forward)
+{
+    return forward->event_fd;
+}
+
+bool
+fig_forward_done(FigForward *forward)
+{
+    struct FigAsync *async = forward->async;
+    bool done;
+
+    pthread_mutex_lock(&async->lock);
+    done = forward->state == FORWARD_DONE;
+    pthread_mutex_unlock(&async->lock);
+
+    return done;
+}
+
+void
+fig_forward_wait(FigForward *forward)
+{
+    struct FigAsync *async = forward->async;
+
+    if (in_callback == forward)
+        return;
+
+    pthread_mutex_lock(&async->lock);
+    while (forward->state != FORWARD_DONE)
+        pthread_cond_wait(&async->done, &async->lock);
+    pthread_mutex_unlock(&async->lock);
+}
+
+FigBuffer *
+fig_forward_output(FigForward *forward)
+{
+    return fig_model_output(forward->model);
+}
+
+/*
+ * Hands the model output back and frees the handle, waiting for the
+ * request to finish first if it has not. Handles may be released after
+ * fig_model_stop_async(), even once the model is destroyed.
+ */
+
+void
+fig_forward_release(FigForward *forward)
+{
+    struct FigAsync *async = forward->async;
+
+    pthread_mutex_lock(&async->lock);
+
+    /* the worker frees it once the callback returns */
+    if (in_callback == forward) {
+        forward->released = true;
+        pthread_mutex_unlock(&async->lock);
+        return;
+    }
+
+    while (forward->state != FORWARD_DONE)
+        pthread_cond_wait(&async->done, &async->lock);
+
+    if (async->outstanding == forward) {
+        async->outstanding = NULL;
+        pthread_cond_signal(&async->wake);
+    }
+    pthread_mutex_unlock(&async->lock);
+
+    forward_free(forward);
+}
+
+/*
+ * Runs what is still queued and stops the worker. Outputs that are not
+ * released no longer hold back the queue once stopping, and the state
+ * their handles share is freed with the last of them.
+ */
+
+void
+fig_model_stop_async(FigModel *model)
+{
+    struct FigAsync *async = model->async;
+
+    if (!async)
+        return;
+
+    pthread_mutex_lock(&async->lock);
+    async->quit = 1;
+    pthread_cond_signal(&async->wake);
+    pthread_mutex_unlock(&async->lock);
+
+    pthread_join(async->thread, NULL);
+
+    model->async = NULL;
+    async_unref(async);
+}
+
+static struct FigAsync *
+async_start(FigModel *model)
+{
+    struct FigAsync *async;
+
+    async = malloc(sizeof *async);
+    if (!async)
+        fig_panic("failed allocating memory");
+
+    async->model = model;
+    async->head = async->tail = NULL;
+    async->outstanding = NULL;
+    async->quit = 0;
+    async->refs = 1;
+
+    pthread_mutex_init(&async->lock, NULL);
+    pthread_cond_init(&async->wake, NULL);
+    pthread_cond_init(&async->done, NULL);
+
+    if (pthread_create(&async->thread, NULL, &async_main, async))
+        fig_panic("failed creating thread");
+
+    return async;
+}
+
+static void *
+async_main(void *data)
+{
+    struct FigAsync *async = data;
+    FigModel *model = async->model;
+    FigForward *forward;
+    const uint64_t one = 1;
+    bool released;
+
+    pthread_mutex_lock(&async->lock);
+    for (;;) {
+        while (!async->head && !async->quit)
+            pthread_cond_wait(&async->wake, &async->lock);
+        while (async->head && async->outstanding && !async->quit)
+            pthread_cond_wait(&async->wake, &async->lock);
+        if (!async->head) {
+            if (async->quit)
+                break;
+            continue;
+        }
+
+        forward = async->head;
+        async->head = forward->next;
+        if (!async->head)
+            async->tail = NULL;
+        forward->state = FORWARD_RUNNING;
+        pthread_mutex_unlock(&async->lock);
+
+        if (forward->input)
+            fig_model_set_input(model, forward->input);
+        fig_model_forward(model);
+
+        pthread_mutex_lock(&async->lock);
+        async->outstanding = forward;
+        pthread_mutex_unlock(&async->lock);
+
+        if (forward->callback) {
+            in_callback = forward;
+            (*forward->callback)(forward, forward->data);
+            in_callback = NULL;
+        } else if (write(forward->event_fd, &one, sizeof one) != sizeof one) {
+            fig_warn("failed signalling forward completion");
+        }
+
+        pthread_mutex_lock(&async->lock);
+        forward->state = FORWARD_DONE;
+        released = forward->released;
+        if (released)
+            async->outstanding = NULL;
+        pthread_cond_broadcast(&async->done);
+
+        if (released) {
+            pthread_mutex_unlock(&async->lock);
+            forward_free(forward);
+            pthread_mutex_lock(&async->lock);
+        }
+    }
+    pthread_mutex_unlock(&async->lock);
+
+    return NULL;
+}
+
+static void
+forward_free(FigForward *forward)
+{
+    struct FigAsync *async = forward->async;
+
+    if (forward->event_fd >= 0)
+        close(forward->event_fd);
+    free(forward);
+
+    async_unref(async);
+}
+
+static void
+async_unref(struct FigAsync *async)
+{
+    uint32_t refs;
+
+    pthread_mutex_lock(&async->lock);
+    refs = --async->refs;
+    pthread_mutex_unlock(&async->lock);
+    if (refs)
+        return;
+
+    pthread_mutex_destroy(&async->lock);
+    pthread_cond_destroy(&async->wake);
+    pthread_cond_destroy(&async->done);
+    free(async);
+}
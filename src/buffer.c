@@ -4,6 +4,13 @@
 
 FigBuffer *
 fig_buffer_new(uint32_t width, uint32_t height, uint32_t channels)
+{
+    return fig_buffer_new_batch(1, width, height, channels);
+}
+
+FigBuffer *
+fig_buffer_new_batch(uint32_t batch, uint32_t width, uint32_t height,
+                     uint32_t channels)
 {
     FigBuffer *buffer;
 
@@ -14,11 +21,50 @@ fig_buffer_new(uint32_t width, uint32_t height, uint32_t channels)
     buffer->width = width;
     buffer->height = height;
     buffer->channels = channels;
-    buffer->data = malloc(width * height * channels * sizeof(float));
+    buffer->stride = channels;
+    buffer->layout = FIG_LAYOUT_HWC;
+    buffer->batch = batch ? batch : 1;
+    buffer->capacity = buffer->batch;
+    buffer->data = malloc(fig_buffer_capacity_len(buffer) * sizeof(float));
 
     return buffer;
 }
 
+/* Changes the layout of a buffer. Its contents are not preserved. */
+
+void
+fig_buffer_set_layout(FigBuffer *buffer, int layout)
+{
+    uint32_t stride = buffer->channels;
+
+    if (layout == FIG_LAYOUT_HWC8)
+        stride = (stride + 7) & ~7u;
+
+    buffer->layout = layout;
+    if (stride == buffer->stride)
+        return;
+
+    free(buffer->data);
+    buffer->stride = stride;
+    buffer->data = calloc(fig_buffer_capacity_len(buffer), sizeof(float));
+    if (!buffer->data)
+        fig_panic("failed allocating memory");
+}
+
+/*
+ * Makes kernels see only the first batch images, between one and the
+ * capacity the buffer was allocated with. The rest stay allocated.
+ */
+
+void
+fig_buffer_set_batch(FigBuffer *buffer, uint32_t batch)
+{
+    if (!batch || batch > buffer->capacity)
+        fig_panic("batch is outside the buffer capacity");
+
+    buffer->batch = batch;
+}
+
 void
 fig_buffer_destroy(FigBuffer *buffer)
 {
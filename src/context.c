@@ -0,0 +1,80 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include "misc.h"
+#include "numa.h"
+#include "context.h"
+
+FigContext *
+fig_context_new(const struct ContextDesc *desc)
+{
+    const FigTopology *topology = fig_topology();
+    FigContext *context;
+    uint32_t first, last, n = 0;
+
+    if (desc->node >= (int) topology->n_nodes)
+        fig_panic("context node out of range");
+
+    context = malloc(sizeof *context);
+    if (!context)
+        fig_panic("failed allocating memory");
+
+    context->node = desc->node < 0 ? -1 : desc->node;
+    context->pin = desc->pin;
+    context->local = desc->local && context->node >= 0;
+    context->replicate_weights = desc->replicate_weights && context->node < 0 &&
+                                 topology->n_nodes > 1;
+
+    first = context->node < 0 ? 0 : (uint32_t) context->node;
+    last = context->node < 0 ? topology->n_nodes : first + 1;
+    for (uint32_t i = first; i < last; i++)
+        n += topology->nodes[i].n_cpus;
+
+    context->cpus = malloc(n * sizeof(int));
+    if (!context->cpus)
+        fig_panic("failed allocating memory");
+
+    for (uint32_t i = first, k = 0; i < last; i++) {
+        memcpy(context->cpus + k, topology->nodes[i].cpus,
+               topology->nodes[i].n_cpus * sizeof(int));
+        k += topology->nodes[i].n_cpus;
+    }
+
+    context->n_cpus = desc->n_threads && desc->n_threads < n ? desc->n_threads : n;
+    context->pool = context->pin ?
+        fig_thread_pool_new_pinned(context->cpus, context->n_cpus) :
+        fig_thread_pool_new(context->n_cpus);
+
+    return context;
+}
+
+/*
+ * Pins the calling thread to the CPU the context keeps for it. Threads
+ * that run fig_model_forward() on a pinned context should call this
+ * once, since they take part in every parallel loop.
+ */
+
+void
+fig_context_enter(FigContext *context)
+{
+    cpu_set_t set;
+
+    if (!context->pin)
+        return;
+
+    CPU_ZERO(&set);
+    CPU_SET(context->cpus[0], &set);
+    if (pthread_setaffinity_np(pthread_self(), sizeof set, &set))
+        fig_warn("failed pinning thread");
+}
+
+void
+fig_context_destroy(FigContext *context)
+{
+    fig_thread_pool_destroy(context->pool);
+    free(context->cpus);
+    free(context);
+}
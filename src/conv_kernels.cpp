@@ -0,0 +1,153 @@
+/*
+ * Direct convolution with the kernel size and stride fixed at compile
+ * time. Weights are laid out [out][ky][kx][in] and buffers are HWC, so
+ * for one output pixel the taps of a kernel row that fall inside the
+ * input are a single run of floats in both the input and the weights.
+ * Each kernel row is then one dot product in 8 wide vectors, with the
+ * padding handled by clipping the run instead of testing every tap, and
+ * BLOCK output channels share every input load. Inputs with padded
+ * channels take one dot product per tap instead.
+ */
+
+#include <stdint.h>
+#include "conv_kernels.h"
+#include "simd.h"
+
+namespace {
+
+template <uint32_t BLOCK>
+inline void
+dot(const float *in, const float *const *weight, uint32_t n, fig_v8f *accum)
+{
+    uint32_t i = 0;
+
+    for (; i + FIG_V8_WIDTH <= n; i += FIG_V8_WIDTH) {
+        fig_v8f v = fig_v8_load(in + i);
+
+        for (uint32_t b = 0; b < BLOCK; b++)
+            accum[b] += v * fig_v8_load(weight[b] + i);
+    }
+
+    if (i < n) {
+        fig_v8f v = fig_v8_load_partial(in + i, n - i, 0);
+
+        for (uint32_t b = 0; b < BLOCK; b++)
+            accum[b] += v * fig_v8_load_partial(weight[b] + i, n - i, 0);
+    }
+}
+
+/* BLOCK channels from out_c of the output pixel whose window is at (left, top) */
+
+template <uint32_t KH, uint32_t KW, uint32_t BLOCK>
+inline void
+pixel(const FigConv *conv, const float *weight, const float *in_data, uint32_t out_c,
+      int32_t left, int32_t top, float *out)
+{
+    const FigLayer *layer = &conv->base;
+    const FigBuffer *in = layer->in_buffer;
+    const uint32_t channels = in->channels, stride = in->stride;
+    const int32_t width = in->width, height = in->height;
+    const int32_t kx0 = left < 0 ? -left : 0,
+                  kx1 = left + (int32_t) KW > width ? width - left : KW,
+                  ky0 = top < 0 ? -top : 0,
+                  ky1 = top + (int32_t) KH > height ? height - top : KH;
+    const float *rows[BLOCK];
+    fig_v8f accum[BLOCK];
+
+    for (uint32_t b = 0; b < BLOCK; b++)
+        accum[b] = fig_v8_set1(0);
+
+    if (kx1 > kx0) {
+        uint32_t n = (kx1 - kx0) * channels;
+
+        for (int32_t ky = ky0; ky < ky1; ky++) {
+            const float *src = in_data +
+                ((size_t) (top + ky) * width + left + kx0) * stride;
+
+            for (uint32_t b = 0; b < BLOCK; b++)
+                rows[b] = weight + ((size_t) (out_c + b) * KH * KW +
+                                    ky * KW + kx0) * channels;
+
+            if (stride == channels) {
+                dot<BLOCK>(src, rows, n, accum);
+                continue;
+            }
+
+            for (int32_t kx = kx0; kx < kx1; kx++, src += stride) {
+                dot<BLOCK>(src, rows, channels, accum);
+                for (uint32_t b = 0; b < BLOCK; b++)
+                    rows[b] += channels;
+            }
+        }
+    }
+
+    for (uint32_t b = 0; b < BLOCK; b++) {
+        float v = fig_v8_hsum(accum[b]) + conv->bias[out_c + b];
+
+        out[out_c + b] = fig_conv_epilogue(layer, out_c + b, v);
+    }
+}
+
+template <uint32_t KH, uint32_t KW, uint32_t SY, uint32_t SX, uint32_t BLOCK>
+void
+conv_rows(FigLayer *layer, const float *in, const float *weight, const float *packed,
+          uint32_t image, uint32_t y0, uint32_t y1)
+{
+    const FigConv *conv = (const FigConv *) layer;
+    const FigBuffer *out_buffer = layer->out_buffer;
+    const uint32_t out_channels = out_buffer->channels;
+
+    for (uint32_t y = y0; y < y1; y++) {
+        int32_t top = (int32_t) (y * SY) - (int32_t) conv->padding_top;
+
+        for (uint32_t x = 0; x < out_buffer->width; x++) {
+            int32_t left = (int32_t) (x * SX) - (int32_t) conv->padding_left;
+            float *out = fig_buffer_image(out_buffer, image) +
+                ((size_t) y * out_buffer->width + x) * out_buffer->stride;
+            uint32_t c = 0;
+
+            for (; c + BLOCK <= out_channels; c += BLOCK)
+                pixel<KH, KW, BLOCK>(conv, weight, in, c, left, top, out);
+            for (; c < out_channels; c++)
+                pixel<KH, KW, 1>(conv, weight, in, c, left, top, out);
+        }
+    }
+}
+
+struct KernelEntry
+{
+    uint32_t kernel_h,
+             kernel_w;
+
+    uint32_t stride_y,
+             stride_x;
+
+    FigConvRows rows;
+    const char *name;
+};
+
+/* Four output channels keep four accumulators and a shared input live */
+
+const KernelEntry kernels[] = {
+    { 1, 1, 1, 1, &conv_rows<1, 1, 1, 1, 4>, "conv_1x1" },
+    { 3, 3, 1, 1, &conv_rows<3, 3, 1, 1, 4>, "conv_3x3s1" },
+    { 3, 3, 2, 2, &conv_rows<3, 3, 2, 2, 4>, "conv_3x3s2" },
+    { 5, 5, 1, 1, &conv_rows<5, 5, 1, 1, 4>, "conv_5x5" },
+    { 7, 7, 2, 2, &conv_rows<7, 7, 2, 2, 4>, "conv_7x7s2" },
+};
+
+} /* namespace */
+
+FigConvRows
+fig_conv_kernel_select(const FigConv *conv, const char **name)
+{
+    for (const KernelEntry &entry : kernels) {
+        if (entry.kernel_h == conv->kernel_h && entry.kernel_w == conv->kernel_w &&
+            entry.stride_y == conv->stride_y && entry.stride_x == conv->stride_x) {
+            *name = entry.name;
+            return entry.rows;
+        }
+    }
+
+    return NULL;
+}
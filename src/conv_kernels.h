@@ -0,0 +1,62 @@
+/*
+ * File: conv_kernels.h
+ * Desc: Convolution kernels specialized at compile time on the kernel
+ *       size and stride, built from the templates in conv_kernels.cpp.
+ */
+
+#ifndef _FIG_CONV_KERNELS_H_
+#define _FIG_CONV_KERNELS_H_
+
+#include <math.h>
+#include "layer.h"
+#include "misc.h"
+
+#define FIG_BATCHNORM_EPSILON 1e-5
+
+/*
+ * Computes output rows [y0, y1) of one image of the batch. in is that
+ * image's input, laid out as in_buffer, of which only the rows under
+ * the output rows are read. packed is the generated kernel's packed
+ * copy of weight, read only by JIT kernels.
+ */
+typedef void (*FigConvRows) (FigLayer *layer, const float *in, const float *weight,
+                             const float *packed, uint32_t image,
+                             uint32_t y0, uint32_t y1);
+
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
+/* Kernel for the shape of conv, or NULL when none is specialized for it */
+FigConvRows fig_conv_kernel_select (const FigConv *conv, const char **name);
+
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
+/* Batch normalization and activation of a convolution output */
+
+static inline float
+fig_conv_epilogue(const FigLayer *layer, uint32_t c, float v)
+{
+    if (layer->batchnorm) {
+        v = (v - layer->running_mean[c]) /
+            sqrtf(layer->running_var[c] + FIG_BATCHNORM_EPSILON);
+        v = v * layer->gamma[c] + layer->beta[c];
+    }
+
+    switch (layer->activation) {
+    case FIG_ACT_NOACT:
+        break;
+    case FIG_ACT_RELU:
+        v = v > 0 ? v : 0;
+        break;
+    default:
+        fig_panic("unknown activation");
+        break;
+    }
+
+    return v;
+}
+
+#endif /* _FIG_CONV_KERNELS_H_ */
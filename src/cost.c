@@ -0,0 +1,224 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "misc.h"
+#include "simd.h"
+#include "cost.h"
+
+/* 32 MiB per bandwidth task, well past any last level cache */
+#define PEAK_BYTES_PER_TASK (32u << 20)
+#define PEAK_FLOP_ITERATIONS (1u << 21)
+#define PEAK_REPEATS 5
+
+struct PeakRun
+{
+    float *data;
+    size_t floats_per_task;
+    float *sink;
+};
+
+static double now();
+static void flops_task(void *arg, uint32_t index);
+static void bandwidth_task(void *arg, uint32_t index);
+static double best_time(FigThreadPool *pool, FigTaskFunc func,
+                        struct PeakRun *run, uint32_t n_tasks);
+
+void
+fig_layer_cost(FigLayer *layer, const FigShape *input, FigLayerCost *cost)
+{
+    uint64_t in_len, out_len, weights = 0;
+
+    memset(cost, 0, sizeof *cost);
+    cost->type = layer->type;
+    cost->input = *input;
+    fig_layer_infer_shape(layer, input, &cost->output);
+
+    in_len = fig_shape_len(cost->input);
+    out_len = fig_shape_len(cost->output);
+
+    switch (layer->type) {
+    case FIG_LAYER_CONV: {
+        FigConv *conv = (FigConv *) layer;
+
+        weights = (uint64_t) conv->kernel_w * conv->kernel_h *
+                  input->channels * conv->channels + conv->channels;
+        cost->macs = out_len * conv->kernel_w * conv->kernel_h * input->channels;
+        cost->flops = 2 * cost->macs + out_len;
+        break;
+    }
+    case FIG_LAYER_MAXPOOL: {
+        FigMaxPool *pool = (FigMaxPool *) layer;
+
+        cost->flops = out_len * pool->kernel_w * pool->kernel_h;
+        break;
+    }
+    case FIG_LAYER_FC:
+        weights = in_len * cost->output.channels + cost->output.channels;
+        cost->macs = in_len * cost->output.channels;
+        cost->flops = 2 * cost->macs + out_len;
+        break;
+    case FIG_LAYER_GLOBAL_AVGPOOL:
+        cost->flops = in_len + out_len;
+        break;
+    case FIG_LAYER_SOFTMAX:
+        /* max, exp of the difference, sum and scale, with exp as one */
+        cost->flops = 4 * in_len;
+        break;
+    default:
+        break;
+    }
+
+    if (layer->batchnorm) {
+        weights += 4 * (uint64_t) cost->output.channels;
+        cost->flops += 2 * out_len;
+    }
+    if (layer->activation != FIG_ACT_NOACT)
+        cost->flops += out_len;
+
+    cost->weight_bytes = weights * sizeof(float);
+    cost->bytes_read = in_len * sizeof(float);
+    cost->bytes_written = out_len * sizeof(float);
+}
+
+/*
+ * Returns one cost per layer, in order, for an input of the given shape
+ * or of the model's input buffer when input is NULL. The array is
+ * allocated with malloc() and owned by the caller.
+ */
+
+FigLayerCost *
+fig_model_cost(FigModel *model, const FigShape *input, uint32_t *n_layers)
+{
+    FigLayerCost *costs;
+    FigShape shape;
+    uint32_t i = 0;
+
+    shape = input ? *input : fig_buffer_shape(model->input_buffer);
+
+    costs = malloc((fig_list_length(model->layers) + 1) * sizeof *costs);
+    if (!costs)
+        fig_panic("failed allocating memory");
+
+    fig_list_for_each(model->layers) {
+        fig_layer_cost((FigLayer *) item->data, &shape, costs + i);
+        shape = costs[i++].output;
+    }
+
+    *n_layers = i;
+    return costs;
+}
+
+/*
+ * Measures the arithmetic throughput reachable with the vector code this
+ * library was built with, and the read bandwidth to memory, using every
+ * thread of pool or only the calling thread when pool is NULL.
+ */
+
+void
+fig_measure_peak(FigThreadPool *pool, FigPeak *peak)
+{
+    struct PeakRun run;
+    uint32_t n_tasks = pool ? fig_thread_pool_size(pool) : 1;
+    size_t len;
+
+    run.sink = calloc(n_tasks, sizeof(float));
+    if (!run.sink)
+        fig_panic("failed allocating memory");
+
+    peak->flops = (double) n_tasks * PEAK_FLOP_ITERATIONS * 8 * FIG_V8_WIDTH * 2 /
+                  best_time(pool, flops_task, &run, n_tasks);
+
+    run.floats_per_task = PEAK_BYTES_PER_TASK / sizeof(float);
+    len = run.floats_per_task * n_tasks * sizeof(float);
+    run.data = aligned_alloc(64, len);
+    if (!run.data)
+        fig_panic("failed allocating memory");
+    memset(run.data, 0, len);
+
+    peak->bandwidth = len / best_time(pool, bandwidth_task, &run, n_tasks);
+
+    free(run.data);
+    free(run.sink);
+}
+
+/* Roofline time: the layer is limited by whichever of work or traffic is slower */
+
+double
+fig_cost_predict(const FigLayerCost *cost, const FigPeak *peak)
+{
+    double compute = cost->flops / peak->flops,
+           memory = fig_cost_bytes(cost) / peak->bandwidth;
+
+    return compute > memory ? compute : memory;
+}
+
+static double
+best_time(FigThreadPool *pool, FigTaskFunc func, struct PeakRun *run,
+          uint32_t n_tasks)
+{
+    double best = 0, start, elapsed;
+
+    for (int i = 0; i < PEAK_REPEATS; i++) {
+        start = now();
+        if (pool)
+            fig_thread_pool_run(pool, func, run, n_tasks);
+        else
+            func(run, 0);
+        elapsed = now() - start;
+
+        if (!i || elapsed < best)
+            best = elapsed;
+    }
+
+    return best;
+}
+
+/* Eight independent multiply-add chains keep the vector units busy */
+
+static void
+flops_task(void *arg, uint32_t index)
+{
+    struct PeakRun *run = arg;
+    fig_v8f m = fig_v8_set1(0.999999f), b = fig_v8_set1(1e-7f);
+    fig_v8f a0 = fig_v8_set1(index), a1 = a0 + 1, a2 = a0 + 2, a3 = a0 + 3,
+            a4 = a0 + 4, a5 = a0 + 5, a6 = a0 + 6, a7 = a0 + 7;
+
+    for (uint32_t i = 0; i < PEAK_FLOP_ITERATIONS; i++) {
+        a0 = a0 * m + b;
+        a1 = a1 * m + b;
+        a2 = a2 * m + b;
+        a3 = a3 * m + b;
+        a4 = a4 * m + b;
+        a5 = a5 * m + b;
+        a6 = a6 * m + b;
+        a7 = a7 * m + b;
+    }
+
+    run->sink[index] = fig_v8_hsum(((a0 + a1) + (a2 + a3)) + ((a4 + a5) + (a6 + a7)));
+}
+
+static void
+bandwidth_task(void *arg, uint32_t index)
+{
+    struct PeakRun *run = arg;
+    const float *p = run->data + index * run->floats_per_task;
+    fig_v8f s0 = fig_v8_set1(0), s1 = s0, s2 = s0, s3 = s0;
+
+    for (size_t i = 0; i < run->floats_per_task; i += 4 * FIG_V8_WIDTH) {
+        s0 += fig_v8_load(p + i);
+        s1 += fig_v8_load(p + i + FIG_V8_WIDTH);
+        s2 += fig_v8_load(p + i + 2 * FIG_V8_WIDTH);
+        s3 += fig_v8_load(p + i + 3 * FIG_V8_WIDTH);
+    }
+
+    run->sink[index] = fig_v8_hsum((s0 + s1) + (s2 + s3));
+}
+
+static double
+now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
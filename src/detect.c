@@ -0,0 +1,323 @@
+#include <stdlib.h>
+#include <string.h>
+#include <float.h>
+#include "misc.h"
+#include "simd.h"
+#include "detect.h"
+
+/* Number of parallel arrays kept per surviving box during NMS */
+#define KEEP_FIELDS 6
+
+static uint32_t decode(FigDetector *detector, FigBuffer *output);
+static void     select_top_k(FigDetection *d, uint32_t n, uint32_t k);
+static uint32_t nms(FigDetector *detector, uint32_t n);
+static int      compare(const void *p, const void *q);
+static void     reserve(FigDetector *detector, uint32_t n);
+
+FigDetector *
+fig_detector_new(struct DetectDesc *desc)
+{
+    FigDetector *detector;
+
+    if (!desc->n_anchors || !desc->n_classes)
+        fig_panic("detector needs at least one anchor and one class");
+
+    if (desc->score == FIG_DETECT_SOFTMAX && desc->n_classes < 2)
+        fig_panic("softmax scores need a background and a foreground class");
+
+    detector = malloc(sizeof *detector);
+    if (!detector)
+        fig_panic("failed allocating memory");
+
+    detector->desc = *desc;
+
+    detector->anchors = malloc(2 * desc->n_anchors * sizeof(float));
+    detector->scores = aligned_alloc(sizeof(fig_v8f), desc->n_classes * sizeof(fig_v8f));
+    if (!detector->anchors || !detector->scores)
+        fig_panic("failed allocating memory");
+    memcpy(detector->anchors, desc->anchors, 2 * desc->n_anchors * sizeof(float));
+    detector->desc.anchors = detector->anchors;
+
+    detector->detections = NULL;
+    detector->capacity = 0;
+    detector->keep = NULL;
+    detector->keep_capacity = 0;
+
+    return detector;
+}
+
+/*
+ * Decodes the head, filters by threshold, keeps the top_k candidates and
+ * runs NMS on them. The returned array is sorted by confidence and stays
+ * owned by the detector until the next call.
+ */
+
+uint32_t
+fig_detect(FigDetector *detector, FigBuffer *output, FigDetection **detections)
+{
+    uint32_t n, top_k = detector->desc.top_k;
+
+    if (output->channels != detector->desc.n_anchors * (4 + detector->desc.n_classes))
+        fig_panic("output channels do not match the detector");
+
+    n = decode(detector, output);
+
+    if (top_k && n > top_k) {
+        select_top_k(detector->detections, n, top_k);
+        n = top_k;
+    }
+    qsort(detector->detections, n, sizeof(FigDetection), compare);
+
+    n = nms(detector, n);
+
+    if (detector->desc.max_detections && n > detector->desc.max_detections)
+        n = detector->desc.max_detections;
+
+    *detections = detector->detections;
+    return n;
+}
+
+void
+fig_detector_destroy(FigDetector *detector)
+{
+    free(detector->anchors);
+    free(detector->scores);
+    free(detector->detections);
+    free(detector->keep);
+    free(detector);
+}
+
+/*
+ * Works on eight cells at a time. Scores are computed for every cell,
+ * boxes (and their exp calls) only for groups with a cell above the
+ * threshold, which is the rare case for a trained head.
+ */
+
+static uint32_t
+decode(FigDetector *detector, FigBuffer *output)
+{
+    struct DetectDesc *desc = &detector->desc;
+    fig_v8f *scores = (fig_v8f *) detector->scores;
+    uint32_t cells = output->width * output->height;
+    uint32_t stride = output->channels;
+    uint32_t group = 4 + desc->n_classes;
+    uint32_t first = desc->score == FIG_DETECT_SOFTMAX ? 1 : 0;
+    float inv_w = 1.0f / output->width, inv_h = 1.0f / output->height;
+    uint32_t count = 0;
+
+    reserve(detector, cells * desc->n_anchors);
+
+    for (uint32_t a = 0; a < desc->n_anchors; a++) {
+        float anchor_w = detector->anchors[2 * a];
+        float anchor_h = detector->anchors[2 * a + 1];
+
+        for (uint32_t i = 0; i < cells; i += FIG_V8_WIDTH) {
+            uint32_t lanes = cells - i < FIG_V8_WIDTH ? cells - i : FIG_V8_WIDTH;
+            const float *base = output->data + (size_t) i * stride + a * group;
+            fig_v8f best, best_class, conf, max, sum;
+            fig_v8i mask;
+            int any = 0;
+
+            /* gather the class scores of the eight cells */
+            for (uint32_t c = 0; c < desc->n_classes; c++) {
+                scores[c] = fig_v8_set1(-FLT_MAX);
+                for (uint32_t l = 0; l < lanes; l++)
+                    scores[c][l] = base[l * stride + 4 + c];
+            }
+
+            best = scores[first];
+            best_class = fig_v8_set1(first);
+            for (uint32_t c = first + 1; c < desc->n_classes; c++) {
+                mask = scores[c] > best;
+                best = fig_v8_select(mask, scores[c], best);
+                best_class = fig_v8_select(mask, fig_v8_set1(c), best_class);
+            }
+
+            if (desc->score == FIG_DETECT_SOFTMAX) {
+                max = fig_v8_max(best, scores[0]);
+                sum = fig_v8_set1(0);
+                for (uint32_t c = 0; c < desc->n_classes; c++)
+                    sum += fig_v8_exp(scores[c] - max);
+                conf = fig_v8_exp(best - max) / sum;
+            } else {
+                conf = fig_v8_logistic(best);
+            }
+
+            mask = conf >= desc->conf_threshold;
+            for (uint32_t l = 0; l < lanes; l++)
+                any |= mask[l];
+            if (!any)
+                continue;
+
+            fig_v8f dx, dy, dw, dh, cx, cy;
+            for (uint32_t l = 0; l < FIG_V8_WIDTH; l++) {
+                uint32_t cell = l < lanes ? i + l : i;
+                const float *p = base + (cell - i) * stride;
+
+                dx[l] = p[0];
+                dy[l] = p[1];
+                dw[l] = p[2];
+                dh[l] = p[3];
+                cx[l] = cell % output->width;
+                cy[l] = cell / output->width;
+            }
+
+            fig_v8f xc = (cx + 0.5f) * inv_w + desc->center_scale * anchor_w * dx;
+            fig_v8f yc = (cy + 0.5f) * inv_h + desc->center_scale * anchor_h * dy;
+            fig_v8f w = anchor_w * fig_v8_exp(desc->size_scale * dw);
+            fig_v8f h = anchor_h * fig_v8_exp(desc->size_scale * dh);
+
+            for (uint32_t l = 0; l < lanes; l++) {
+                if (!mask[l])
+                    continue;
+
+                FigDetection *d = detector->detections + count++;
+                d->xc = xc[l];
+                d->yc = yc[l];
+                d->width = w[l];
+                d->height = h[l];
+                d->conf = conf[l];
+                d->class_id = (uint32_t) best_class[l];
+            }
+        }
+    }
+
+    return count;
+}
+
+/*
+ * Partially orders d so that its first k entries are the k most
+ * confident ones, in linear expected time.
+ */
+
+static void
+select_top_k(FigDetection *d, uint32_t n, uint32_t k)
+{
+    int64_t lo = 0, hi = (int64_t) n - 1, target = (int64_t) k - 1;
+    FigDetection t;
+
+    while (lo < hi) {
+        float pivot = d[lo + (hi - lo) / 2].conf;
+        int64_t i = lo, j = hi;
+
+        while (i <= j) {
+            while (d[i].conf > pivot)
+                i++;
+            while (d[j].conf < pivot)
+                j--;
+            if (i <= j) {
+                t = d[i]; d[i] = d[j]; d[j] = t;
+                i++;
+                j--;
+            }
+        }
+
+        /* [lo, j] is at least pivot, [i, hi] at most, anything between equals it */
+        if (target <= j)
+            hi = j;
+        else if (target >= i)
+            lo = i;
+        else
+            break;
+    }
+}
+
+/*
+ * Greedy NMS over detections sorted by confidence. Survivors are kept as
+ * parallel corner arrays so each candidate is tested against eight of
+ * them per step. Boxes of different classes never suppress each other.
+ */
+
+static uint32_t
+nms(FigDetector *detector, uint32_t n)
+{
+    FigDetection *d = detector->detections;
+    float threshold = detector->desc.nms_threshold;
+    uint32_t limit = detector->desc.max_detections;
+    uint32_t kept = 0;
+    float *kx1, *ky1, *kx2, *ky2, *karea, *kclass;
+
+    if (threshold <= 0 || threshold >= 1 || !n)
+        return n;
+
+    if (detector->keep_capacity < n) {
+        detector->keep_capacity = (n + FIG_V8_WIDTH - 1) & ~(FIG_V8_WIDTH - 1);
+        free(detector->keep);
+        detector->keep = malloc(KEEP_FIELDS * detector->keep_capacity * sizeof(float));
+        if (!detector->keep)
+            fig_panic("failed allocating memory");
+    }
+
+    kx1 = detector->keep;
+    ky1 = kx1 + detector->keep_capacity;
+    kx2 = ky1 + detector->keep_capacity;
+    ky2 = kx2 + detector->keep_capacity;
+    karea = ky2 + detector->keep_capacity;
+    kclass = karea + detector->keep_capacity;
+
+    for (uint32_t i = 0; i < n && (!limit || kept < limit); i++) {
+        float x1 = d[i].xc - 0.5f * d[i].width, x2 = x1 + d[i].width;
+        float y1 = d[i].yc - 0.5f * d[i].height, y2 = y1 + d[i].height;
+        float area = d[i].width * d[i].height;
+        float cls = d[i].class_id;
+        int suppressed = 0;
+
+        for (uint32_t j = 0; j < kept && !suppressed; j += FIG_V8_WIDTH) {
+            uint32_t lanes = kept - j < FIG_V8_WIDTH ? kept - j : FIG_V8_WIDTH;
+            fig_v8f iw, ih, inter, uni;
+            fig_v8i hit;
+
+            iw = fig_v8_min(fig_v8_load_partial(kx2 + j, lanes, 0), fig_v8_set1(x2)) -
+                 fig_v8_max(fig_v8_load_partial(kx1 + j, lanes, 0), fig_v8_set1(x1));
+            ih = fig_v8_min(fig_v8_load_partial(ky2 + j, lanes, 0), fig_v8_set1(y2)) -
+                 fig_v8_max(fig_v8_load_partial(ky1 + j, lanes, 0), fig_v8_set1(y1));
+            inter = fig_v8_max(iw, fig_v8_set1(0)) * fig_v8_max(ih, fig_v8_set1(0));
+            uni = fig_v8_load_partial(karea + j, lanes, 0) + area - inter;
+
+            /* padding lanes carry class -1 and never match */
+            hit = (inter > threshold * uni) &
+                  (fig_v8_load_partial(kclass + j, lanes, -1) == cls);
+            for (uint32_t l = 0; l < lanes; l++)
+                suppressed |= hit[l];
+        }
+
+        if (suppressed)
+            continue;
+
+        kx1[kept] = x1;
+        ky1[kept] = y1;
+        kx2[kept] = x2;
+        ky2[kept] = y2;
+        karea[kept] = area;
+        kclass[kept] = cls;
+        d[kept++] = d[i];
+    }
+
+    return kept;
+}
+
+static int
+compare(const void *p, const void *q)
+{
+    const FigDetection *a = (const FigDetection *) p;
+    const FigDetection *b = (const FigDetection *) q;
+
+    if (a->conf > b->conf)
+        return -1;
+    if (a->conf < b->conf)
+        return 1;
+    return 0;
+}
+
+static void
+reserve(FigDetector *detector, uint32_t n)
+{
+    if (detector->capacity >= n)
+        return;
+
+    free(detector->detections);
+    detector->detections = malloc(n * sizeof(FigDetection));
+    if (!detector->detections)
+        fig_panic("failed allocating memory");
+    detector->capacity = n;
+}
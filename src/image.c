@@ -1,12 +1,52 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
+#include <pthread.h>
 #include <jpeglib.h>
 #include "image.h"
 #include "misc.h"
+#include "simd.h"
+#include "resize.h"
+
+/*
+ * Resizers of the luma and chroma planes of the last frame and buffer
+ * shape converted by a thread, and its horizontally resized rows, two
+ * per plane, tagged with the source row each holds.
+ */
+
+typedef struct
+{
+    FigResizer *luma,
+               *chroma;
+
+    uint16_t *rows[6];
+    int64_t tags[6];
+} YuvConverter;
 
 static void read_jpeg_image(const char *file_path, FigImage *image);
 static void write_jpeg_image(const char *file_path, FigImage *image);
+static void set_jpeg_scale(struct jpeg_decompress_struct *cinfo,
+                           uint32_t width, uint32_t height);
+static void create_resizer_key();
+static void destroy_resizer(void *data);
+static void resize_row(const unsigned char *src, uint32_t *x_index,
+                       float *x_weight, const uint32_t *map,
+                       uint32_t width, float *dst);
+static void bilinear_axis(uint32_t src_size, uint32_t dst_size,
+                          uint32_t *index, float *weight);
+static YuvConverter *yuv_converter(uint32_t src_w, uint32_t src_h,
+                                   uint32_t dst_w, uint32_t dst_h);
+static void destroy_yuv_converter(void *data);
+static const uint16_t *yuv_row(YuvConverter *converter, uint32_t slot,
+                               FigResizer *resizer, const uint8_t *plane,
+                               size_t stride, uint32_t step, uint32_t row);
+static inline fig_v8f lerp_rows(const uint16_t *top, const uint16_t *bottom,
+                                uint32_t weight);
+static inline float lerp_sample(uint16_t top, uint16_t bottom, uint32_t weight);
+
+static pthread_key_t resizer_key,
+                     yuv_key;
+static pthread_once_t resizer_once = PTHREAD_ONCE_INIT;
 
 FigImage *
 fig_image_new(uint32_t width, uint32_t height)
@@ -43,6 +83,247 @@ fig_image_read(const char *file_path)
     return image;
 }
 
+/*
+ * Decodes a JPEG straight into a model input buffer. The DCT is scaled
+ * down to the smallest size that still covers the buffer, the remaining
+ * bilinear resize works on two scanlines at a time and each output row
+ * is normalized as it is produced, so no full size image is ever held.
+ */
+
+void
+fig_image_read_into(const char *file_path, FigBuffer *buffer,
+                    struct PreprocessDesc *desc)
+{
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    struct PreprocessDesc plain = { FIG_CHANNELS_RGB, { 0, 0, 0 }, { 1, 1, 1 } };
+    uint32_t width = buffer->width, height = buffer->height;
+    uint32_t row_len = width * 3, row_v = row_len & ~(FIG_V8_WIDTH - 1);
+    uint32_t src_w, src_h, map[3], *x_index;
+    float *scratch, *x_weight, *mul, *add, *rows[2];
+    int64_t row_tag[2] = { -1, -1 };
+    unsigned char *scanline;
+    FILE *fp;
+
+    if (buffer->channels != 3 || buffer->layout != FIG_LAYOUT_HWC)
+        fig_panic("image buffers need 3 channels in HWC layout");
+    if (buffer->batch != 1)
+        fig_panic("images decode into single image buffers");
+
+    if (!desc)
+        desc = &plain;
+
+    fp = fopen(file_path, "rb");
+    if (!fp)
+        fig_panic("unable to open file");
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_stdio_src(&cinfo, fp);
+    jpeg_read_header(&cinfo, TRUE);
+
+    cinfo.out_color_space = JCS_RGB;
+    set_jpeg_scale(&cinfo, width, height);
+    jpeg_start_decompress(&cinfo);
+
+    src_w = cinfo.output_width;
+    src_h = cinfo.output_height;
+    assert(cinfo.output_components == 3);
+
+    scratch = malloc((4 * row_len + width) * sizeof(float) +
+                     width * sizeof(uint32_t) + src_w * 3);
+    if (!scratch) {
+        fclose(fp);
+        fig_panic("failed allocating memeory");
+    }
+
+    rows[0] = scratch;
+    rows[1] = rows[0] + row_len;
+    mul = rows[1] + row_len;
+    add = mul + row_len;
+    x_weight = add + row_len;
+    x_index = (uint32_t *) (x_weight + width);
+    scanline = (unsigned char *) (x_index + width);
+
+    /* channel c of the decoded RGB pixel lands at map[c] */
+    for (uint32_t c = 0; c < 3; c++) {
+        map[c] = desc->channel_order == FIG_CHANNELS_BGR ? 2 - c : c;
+
+        float std = desc->std[c] ? desc->std[c] : 1.0f;
+        for (uint32_t x = 0; x < width; x++) {
+            mul[3 * x + map[c]] = 1.0f / (255.0f * std);
+            add[3 * x + map[c]] = -desc->mean[c] / std;
+        }
+    }
+
+    /* pixel centres are aligned, as in OpenCV's INTER_LINEAR */
+    bilinear_axis(src_w, width, x_index, x_weight);
+
+    for (uint32_t y = 0; y < height; y++) {
+        float fy = (y + 0.5f) * src_h / height - 0.5f;
+        uint32_t y0, y1;
+        float wy;
+
+        fy = fy < 0 ? 0 : fy;
+        fy = fy > src_h - 1 ? src_h - 1 : fy;
+        y0 = (uint32_t) fy;
+        y1 = y0 + 1 < src_h ? y0 + 1 : y0;
+        wy = fy - y0;
+
+        /* rows between the ones we need are decoded and dropped */
+        while (row_tag[y1 & 1] != y1 || row_tag[y0 & 1] != y0) {
+            uint32_t r = cinfo.output_scanline;
+
+            jpeg_read_scanlines(&cinfo, &scanline, 1);
+            if (r == y0 || r == y1) {
+                resize_row(scanline, x_index, x_weight, map, width, rows[r & 1]);
+                row_tag[r & 1] = r;
+            }
+        }
+
+        const float *top = rows[y0 & 1], *bottom = rows[y1 & 1];
+        float *dst = fig_buffer_image(buffer, 0) + fig_buffer_offset_of(buffer, 0, y, 0);
+        fig_v8f v, t;
+        uint32_t i;
+
+        for (i = 0; i < row_v; i += FIG_V8_WIDTH) {
+            t = fig_v8_load(top + i);
+            v = t + wy * (fig_v8_load(bottom + i) - t);
+            fig_v8_store(dst + i, v * fig_v8_load(mul + i) + fig_v8_load(add + i));
+        }
+        for (; i < row_len; i++)
+            dst[i] = (top[i] + wy * (bottom[i] - top[i])) * mul[i] + add[i];
+    }
+
+    jpeg_abort_decompress(&cinfo);
+    jpeg_destroy_decompress(&cinfo);
+    free(scratch);
+    fclose(fp);
+}
+
+/*
+ * Converts a 4:2:0 frame straight into a model input buffer. Since the
+ * colour conversion and the normalization are both affine they fold into
+ * one 3x4 matrix per output channel, applied to Y, U and V once each has
+ * been resized on its own plane with the fixed point tables of resize.c.
+ * Each output row takes one vector pass: the vertical taps, the matrix
+ * and the interleaving into HWC. Every source row is resized
+ * horizontally once, and no RGB image is ever produced. Chroma is
+ * interpolated at its own resolution rather than replicated over 2x2
+ * blocks. The tables are kept per thread, as in fig_image_resize().
+ */
+
+void
+fig_image_yuv_into(const FigYuvFrame *frame, FigBuffer *buffer,
+                   struct PreprocessDesc *desc)
+{
+    struct PreprocessDesc plain = { FIG_CHANNELS_RGB, { 0, 0, 0 }, { 1, 1, 1 } };
+    uint32_t width = buffer->width, height = buffer->height;
+    uint32_t width_v = width & ~(FIG_V8_WIDTH - 1), step;
+    const uint8_t *u_plane, *v_plane;
+    size_t u_stride, v_stride;
+    float y_scale, y_offset, u_coef[3], v_coef[3], coef[3][4];
+    fig_v8f coef_v[3][4];
+    YuvConverter *converter;
+
+    if (buffer->channels != 3 || buffer->layout != FIG_LAYOUT_HWC)
+        fig_panic("image buffers need 3 channels in HWC layout");
+    if (buffer->batch != 1)
+        fig_panic("yuv frames convert into single image buffers");
+    if (frame->width < 2 || frame->height < 2)
+        fig_panic("yuv frame is too small");
+
+    if (!desc)
+        desc = &plain;
+
+    if (frame->format == FIG_YUV_NV12) {
+        u_plane = frame->planes[1];
+        v_plane = frame->planes[1] + 1;
+        u_stride = v_stride = frame->strides[1];
+        step = 2;
+    } else {
+        u_plane = frame->planes[1];
+        v_plane = frame->planes[2];
+        u_stride = frame->strides[1];
+        v_stride = frame->strides[2];
+        step = 1;
+    }
+
+    /* R, G and B as y_scale * Y + u_coef * U + v_coef * V + offset */
+    if (frame->full_range) {
+        y_scale = 1.0f;
+        y_offset = 0.0f;
+        u_coef[0] = 0.0f, u_coef[1] = -0.344136f, u_coef[2] = 1.772f;
+        v_coef[0] = 1.402f, v_coef[1] = -0.714136f, v_coef[2] = 0.0f;
+    } else {
+        y_scale = 255.0f / 219.0f;
+        y_offset = -16.0f * y_scale;
+        u_coef[0] = 0.0f, u_coef[1] = -0.391762f, u_coef[2] = 2.017232f;
+        v_coef[0] = 1.596027f, v_coef[1] = -0.812968f, v_coef[2] = 0.0f;
+    }
+
+    /*
+     * Channel c of the buffer holds RGB channel rgb, normalized. Samples
+     * come out of the two passes with twice the fractional bits.
+     */
+    for (uint32_t c = 0; c < 3; c++) {
+        uint32_t rgb = desc->channel_order == FIG_CHANNELS_BGR ? 2 - c : c;
+        float std = desc->std[rgb] ? desc->std[rgb] : 1.0f;
+        float mul = 1.0f / (255.0f * std);
+        float sample = mul / (1 << (2 * FIG_RESIZE_BILINEAR_BITS));
+        float offset = y_offset - 128.0f * (u_coef[rgb] + v_coef[rgb]);
+
+        coef[c][0] = y_scale * sample;
+        coef[c][1] = u_coef[rgb] * sample;
+        coef[c][2] = v_coef[rgb] * sample;
+        coef[c][3] = offset * mul - desc->mean[rgb] / std;
+        for (uint32_t i = 0; i < 4; i++)
+            coef_v[c][i] = fig_v8_set1(coef[c][i]);
+    }
+
+    converter = yuv_converter(frame->width, frame->height, width, height);
+
+    for (uint32_t y = 0; y < height; y++) {
+        FigResizer *luma = converter->luma, *chroma = converter->chroma;
+        uint32_t luma_wy = luma->y_weight[y], chroma_wy = chroma->y_weight[y];
+        const uint16_t *rows[6];
+        float *dst = fig_buffer_image(buffer, 0) + fig_buffer_offset_of(buffer, 0, y, 0);
+        uint32_t x;
+
+        rows[0] = yuv_row(converter, 0, luma, frame->planes[0], frame->strides[0], 1,
+                          luma->y0[y]);
+        rows[1] = yuv_row(converter, 0, luma, frame->planes[0], frame->strides[0], 1,
+                          luma->y1[y]);
+        rows[2] = yuv_row(converter, 2, chroma, u_plane, u_stride, step, chroma->y0[y]);
+        rows[3] = yuv_row(converter, 2, chroma, u_plane, u_stride, step, chroma->y1[y]);
+        rows[4] = yuv_row(converter, 4, chroma, v_plane, v_stride, step, chroma->y0[y]);
+        rows[5] = yuv_row(converter, 4, chroma, v_plane, v_stride, step, chroma->y1[y]);
+
+        for (x = 0; x < width_v; x += FIG_V8_WIDTH) {
+            fig_v8f luma_v, u, v, out[3];
+
+            luma_v = lerp_rows(rows[0] + x, rows[1] + x, luma_wy);
+            u = lerp_rows(rows[2] + x, rows[3] + x, chroma_wy);
+            v = lerp_rows(rows[4] + x, rows[5] + x, chroma_wy);
+
+            for (uint32_t c = 0; c < 3; c++)
+                out[c] = luma_v * coef_v[c][0] + u * coef_v[c][1] + v * coef_v[c][2] +
+                         coef_v[c][3];
+            fig_v8_store_interleave3(dst + 3 * x, out[0], out[1], out[2]);
+        }
+
+        for (; x < width; x++) {
+            float luma_s = lerp_sample(rows[0][x], rows[1][x], luma_wy);
+            float u = lerp_sample(rows[2][x], rows[3][x], chroma_wy);
+            float v = lerp_sample(rows[4][x], rows[5][x], chroma_wy);
+
+            for (uint32_t c = 0; c < 3; c++)
+                dst[3 * x + c] = luma_s * coef[c][0] + u * coef[c][1] + v * coef[c][2] +
+                                 coef[c][3];
+        }
+    }
+}
+
 void
 fig_image_write(FigImage *image, const char *file_path)
 {
@@ -131,48 +412,176 @@ write_jpeg_image(const char *file_path, FigImage *image)
     fclose(fp); 
 }
 
-FigImage *
-fig_image_resize(FigImage *image, uint32_t width, uint32_t height)
+/*
+ * Picks the smallest DCT scaling that keeps the decoded image at least as
+ * large as the target. libjpeg-turbo and libjpeg 7+ scale in steps of
+ * 1/8, older libjpeg only by powers of two.
+ */
+
+static void
+set_jpeg_scale(struct jpeg_decompress_struct *cinfo, uint32_t width, uint32_t height)
 {
-    FigImage *output;
-    float scale_x = width / (float) image->width;
-    float scale_y = height / (float) image->height;
-    float float_src_x, float_src_y, EW_weight, NS_weight;
-    uint32_t src_x, src_y, src_offset, dest_offset;;
-    float NW, NE, SW, SE, top, bottom, value;;
-   
-    output = fig_image_new(width, height);
+    uint32_t num = 8;
+
+#if JPEG_LIB_VERSION >= 70 || defined(LIBJPEG_TURBO_VERSION)
+    while (num > 1 &&
+           (cinfo->image_width * (num - 1) + 7) / 8 >= width &&
+           (cinfo->image_height * (num - 1) + 7) / 8 >= height)
+        num--;
+#else
+    while (num > 1 &&
+           (cinfo->image_width * (num / 2) + 7) / 8 >= width &&
+           (cinfo->image_height * (num / 2) + 7) / 8 >= height)
+        num /= 2;
+#endif
+
+    cinfo->scale_num = num;
+    cinfo->scale_denom = 8;
+    jpeg_calc_output_dimensions(cinfo);
+}
 
-    for (uint32_t dest_y = 0; dest_y < output->height; dest_y++) {
-        for (uint32_t dest_x = 0; dest_x < output->width; dest_x++) {
-            dest_offset = 3 * (dest_y * width + dest_x);
+static void
+resize_row(const unsigned char *src, uint32_t *x_index, float *x_weight,
+           const uint32_t *map, uint32_t width, float *dst)
+{
+    for (uint32_t x = 0; x < width; x++) {
+        const unsigned char *p = src + 3 * x_index[x];
+        const unsigned char *q = x_weight[x] > 0 ? p + 3 : p;
 
-            float_src_x = dest_x / scale_x;
-            float_src_y = dest_y / scale_y;
+        for (uint32_t c = 0; c < 3; c++)
+            dst[3 * x + map[c]] = p[c] + x_weight[x] * (q[c] - p[c]);
+    }
+}
 
-            src_x = (uint32_t) float_src_x;
-            src_y = (uint32_t) float_src_y;
+/* Source position of every destination pixel, with aligned pixel centres */
 
-            EW_weight = float_src_x - src_x;
-            NS_weight = float_src_y - src_y;
+static void
+bilinear_axis(uint32_t src_size, uint32_t dst_size, uint32_t *index, float *weight)
+{
+    for (uint32_t i = 0; i < dst_size; i++) {
+        float f = (i + 0.5f) * src_size / dst_size - 0.5f;
 
-            src_offset = 3 * (src_y * image->width + src_x);
+        f = f < 0 ? 0 : f;
+        f = f > src_size - 1 ? src_size - 1 : f;
+        index[i] = (uint32_t) f;
+        weight[i] = f - index[i];
+    }
+}
 
-            for (uint32_t c = 0; c < 3; c++) {
-                NW = (float) image->data[src_offset + c]; 
-                NE = (float) image->data[src_offset + 3 + c]; 
-                SW = (float) image->data[src_offset + width * 3 + c]; 
-                SE = (float) image->data[src_offset + width * 3 + 3 + c]; 
+/* Converter for the shapes, with no row resized yet */
 
-                top = NW + EW_weight * (NE - NW);
-                bottom = SW + EW_weight * (SE - SW);
-                value = (unsigned char) (top + NS_weight * (bottom - top));
-                value = value > 255 ? 255: value;
-                output->data[dest_offset + c] = value;
-            }
-        }
+static YuvConverter *
+yuv_converter(uint32_t src_w, uint32_t src_h, uint32_t dst_w, uint32_t dst_h)
+{
+    YuvConverter *converter;
+
+    pthread_once(&resizer_once, &create_resizer_key);
+
+    converter = pthread_getspecific(yuv_key);
+    if (!converter || converter->luma->src_w != src_w || converter->luma->src_h != src_h ||
+        converter->luma->dst_w != dst_w || converter->luma->dst_h != dst_h) {
+        if (converter)
+            destroy_yuv_converter(converter);
+
+        converter = malloc(sizeof *converter);
+        if (!converter)
+            fig_panic("failed allocating memory");
+        converter->luma = fig_resizer_new(src_w, src_h, dst_w, dst_h, 1,
+                                          FIG_RESIZE_BILINEAR);
+        converter->chroma = fig_resizer_new((src_w + 1) / 2, (src_h + 1) / 2,
+                                            dst_w, dst_h, 1, FIG_RESIZE_BILINEAR);
+
+        converter->rows[0] = malloc(6 * dst_w * sizeof(uint16_t));
+        if (!converter->rows[0])
+            fig_panic("failed allocating memory");
+        for (uint32_t i = 1; i < 6; i++)
+            converter->rows[i] = converter->rows[0] + i * dst_w;
+
+        pthread_setspecific(yuv_key, converter);
     }
 
+    for (uint32_t i = 0; i < 6; i++)
+        converter->tags[i] = -1;
+
+    return converter;
+}
+
+static void
+destroy_yuv_converter(void *data)
+{
+    YuvConverter *converter = (YuvConverter *) data;
+
+    fig_resizer_destroy(converter->luma);
+    fig_resizer_destroy(converter->chroma);
+    free(converter->rows[0]);
+    free(converter);
+}
+
+/*
+ * Source row of a plane resized horizontally, from the slot pair at slot
+ * where consecutive rows land in different slots, resized unless the
+ * slot already holds it.
+ */
+
+static const uint16_t *
+yuv_row(YuvConverter *converter, uint32_t slot, FigResizer *resizer,
+        const uint8_t *plane, size_t stride, uint32_t step, uint32_t row)
+{
+    slot += row & 1;
+    if (converter->tags[slot] != row) {
+        fig_resizer_row(resizer, plane + row * stride, step, converter->rows[slot]);
+        converter->tags[slot] = row;
+    }
+
+    return converter->rows[slot];
+}
+
+/* Vertical tap of 8 resized samples, with 2 * FIG_RESIZE_BILINEAR_BITS fractional bits */
+
+static inline fig_v8f
+lerp_rows(const uint16_t *top, const uint16_t *bottom, uint32_t weight)
+{
+    fig_v8i a = __builtin_convertvector(fig_v8u16_load(top), fig_v8i);
+    fig_v8i b = __builtin_convertvector(fig_v8u16_load(bottom), fig_v8i);
+    int32_t w = (int32_t) weight;
+
+    return __builtin_convertvector(a * ((1 << FIG_RESIZE_BILINEAR_BITS) - w) + b * w,
+                                   fig_v8f);
+}
+
+static inline float
+lerp_sample(uint16_t top, uint16_t bottom, uint32_t weight)
+{
+    return (float) (top * ((1 << FIG_RESIZE_BILINEAR_BITS) - weight) + bottom * weight);
+}
+
+/*
+ * The coefficient tables of the last shape pair are kept per thread, so
+ * resizing a stream of same sized frames builds them only once.
+ */
+
+FigImage *
+fig_image_resize(FigImage *image, uint32_t width, uint32_t height)
+{
+    FigImage *output;
+    FigResizer *resizer;
+
+    pthread_once(&resizer_once, &create_resizer_key);
+
+    resizer = pthread_getspecific(resizer_key);
+    if (!resizer || resizer->src_w != image->width || resizer->src_h != image->height ||
+        resizer->dst_w != width || resizer->dst_h != height) {
+        if (resizer)
+            fig_resizer_destroy(resizer);
+        resizer = fig_resizer_new(image->width, image->height, width, height,
+                                  3, FIG_RESIZE_AUTO);
+        pthread_setspecific(resizer_key, resizer);
+    }
+
+    output = fig_image_new(width, height);
+    fig_resizer_run(resizer, image->data, image->width * 3,
+                    output->data, width * 3, fig_thread_pool_default());
+
     return output;
 }
 
@@ -183,3 +592,16 @@ fig_image_destroy(FigImage *image)
         free(image->data);
     free(image);
 }
+
+static void
+create_resizer_key()
+{
+    pthread_key_create(&resizer_key, &destroy_resizer);
+    pthread_key_create(&yuv_key, &destroy_yuv_converter);
+}
+
+static void
+destroy_resizer(void *data)
+{
+    fig_resizer_destroy((FigResizer *) data);
+}
@@ -0,0 +1,673 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "misc.h"
+#include "jit.h"
+
+#if defined(__x86_64__)
+
+/*
+ * A microkernel computes n consecutive output pixels of a row whose
+ * kernel windows lie entirely inside the input:
+ *
+ *     kernel(in, weight, out, epilogue, n)
+ *
+ * in points at the top left tap of the first window. Weights are packed
+ * [ky][kx][in][out] with the output channels padded to a multiple of 8,
+ * so every input value is broadcast once and multiplied into up to 12
+ * accumulators of 8 output channels. Tap offsets, strides and channel
+ * counts are immediates; the epilogue is acc * scale + shift, which
+ * folds the bias and batchnorm, then ReLU. The last 8 channels are
+ * stored through a mask kept after the code, unless the output pixels
+ * are padded to whole vectors; the padded weights and epilogue then
+ * store zeros into the padding.
+ */
+
+typedef void (*JitKernel) (const float *in, const float *weight, float *out,
+                           const float *epilogue, uint64_t n);
+
+struct JitShape
+{
+    uint32_t kernel_w,
+             kernel_h;
+
+    uint32_t stride_x,
+             stride_y;
+
+    uint32_t in_width,
+             in_channels,
+             out_channels;
+
+    /* floats between pixels of the input and output */
+    uint32_t in_stride,
+             out_stride;
+
+    int activation;
+};
+
+struct JitEntry
+{
+    struct JitShape shape;
+    JitKernel kernel;
+    char name[96];
+    struct JitEntry *next;
+};
+
+struct FigConvJit
+{
+    const struct JitEntry *entry;
+
+    /*
+     * [ky][kx][in][out padded] from packed, then scale and shift per
+     * padded channel from epilogue floats in. The block moves with the
+     * other layer arrays, so the epilogue is found by its offset.
+     */
+    float *packed;
+    size_t epilogue,
+           size;
+};
+
+struct Asm
+{
+    uint8_t *code;
+    size_t length,
+           capacity;
+};
+
+enum
+{
+    RAX, RCX, RDX, RBX, RSP, RBP, RSI, RDI,
+    R8, R9, R10, R11, R12, R13, R14, R15
+};
+
+#define RIP (-1)
+#define ACCUMULATORS 12
+#define YMM_INPUT 15
+#define YMM_ZERO 14
+#define YMM_MASK 13
+
+static void jit_rows(FigLayer *layer, const float *in_data, const float *weight,
+                     const float *packed, uint32_t image, uint32_t y0, uint32_t y1);
+static void border_pixel(FigConv *conv, const float *weight, const float *in_data,
+                         float *out_data, uint32_t x, uint32_t y);
+static bool jit_available();
+static void detect();
+static const struct JitEntry *lookup(const struct JitShape *shape);
+static JitKernel generate(const struct JitShape *shape, size_t *size);
+static void write_perf_map(const void *code, size_t size, const char *name);
+
+static struct JitEntry *cache;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t perf_map_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t detect_once = PTHREAD_ONCE_INIT;
+static bool available;
+
+/*
+ * Generates, or finds in the cache, the kernel for conv and packs its
+ * weights, unless a kernel generated before for the layer already did.
+ * Returns the rows function driving it, NULL when the JIT is not
+ * available.
+ */
+
+FigConvRows
+fig_jit_conv_new(FigConv *conv, const char **name)
+{
+    FigLayer *base = (FigLayer *) conv;
+    struct JitShape shape;
+    struct FigConvJit *jit;
+    const struct JitEntry *entry;
+    float *epilogue;
+    uint32_t in_c = base->in_buffer->channels, out_c = base->out_buffer->channels;
+    uint32_t padded = (out_c + 7) & ~7u;
+    size_t taps = (size_t) conv->kernel_h * conv->kernel_w * in_c;
+
+    if (!jit_available() ||
+        (base->activation != FIG_ACT_NOACT && base->activation != FIG_ACT_RELU)) {
+        fig_jit_conv_destroy(conv);
+        return NULL;
+    }
+
+    memset(&shape, 0, sizeof shape);
+    shape.kernel_w = conv->kernel_w;
+    shape.kernel_h = conv->kernel_h;
+    shape.stride_x = conv->stride_x;
+    shape.stride_y = conv->stride_y;
+    shape.in_width = base->in_buffer->width;
+    shape.in_channels = in_c;
+    shape.out_channels = out_c;
+    shape.in_stride = base->in_buffer->stride;
+    shape.out_stride = base->out_buffer->stride;
+    shape.activation = base->activation;
+
+    entry = lookup(&shape);
+    if (!entry) {
+        fig_jit_conv_destroy(conv);
+        return NULL;
+    }
+
+    /* a new layout changes the strides the kernel is built for, not the weights */
+    if (conv->jit) {
+        conv->jit->entry = entry;
+        *name = entry->name;
+        return &jit_rows;
+    }
+
+    jit = malloc(sizeof *jit);
+    if (!jit)
+        fig_panic("failed allocating memory");
+
+    jit->entry = entry;
+    jit->epilogue = taps * padded;
+    jit->size = (taps + 2) * padded * sizeof(float);
+    if (posix_memalign((void **) &jit->packed, 64, jit->size))
+        fig_panic("failed allocating memory");
+    memset(jit->packed, 0, jit->size);
+    epilogue = jit->packed + jit->epilogue;
+
+    for (uint32_t o = 0; o < out_c; o++) {
+        float scale = 1.0f, shift = conv->bias[o];
+
+        for (size_t t = 0; t < taps; t++)
+            jit->packed[t * padded + o] = conv->weight[o * taps + t];
+
+        if (base->batchnorm) {
+            scale = base->gamma[o] /
+                sqrtf(base->running_var[o] + FIG_BATCHNORM_EPSILON);
+            shift = (conv->bias[o] - base->running_mean[o]) * scale + base->beta[o];
+        }
+        epilogue[o] = scale;
+        epilogue[padded + o] = shift;
+    }
+
+    conv->jit = jit;
+    *name = jit->entry->name;
+    return &jit_rows;
+}
+
+/*
+ * The packed weights and epilogue of conv's generated kernel, as one
+ * array of size bytes listed with the other layer arrays. NULL when the
+ * layer has no generated kernel.
+ */
+
+float **
+fig_jit_conv_packed(FigConv *conv, size_t *size)
+{
+    if (!conv->jit)
+        return NULL;
+
+    if (size)
+        *size = conv->jit->size;
+    return &conv->jit->packed;
+}
+
+void
+fig_jit_conv_destroy(FigConv *conv)
+{
+    if (!conv->jit)
+        return;
+
+    /* kernels stay in the cache for other layers of the same shape */
+    if (!((FigLayer *) conv)->external_memory)
+        free(conv->jit->packed);
+    free(conv->jit);
+    conv->jit = NULL;
+}
+
+/*
+ * Rows whose windows are inside the input run through the kernel, except
+ * for the pixels at either end that reach into the padding. Those and
+ * the rows at the top and bottom are computed here from the unpacked
+ * weights; the kernel reads packed, either copy possibly a replica.
+ */
+
+static void
+jit_rows(FigLayer *layer, const float *in_data, const float *weight,
+         const float *packed, uint32_t image, uint32_t y0, uint32_t y1)
+{
+    FigConv *conv = (FigConv *) layer;
+    const struct FigConvJit *jit = conv->jit;
+    FigBuffer *in = layer->in_buffer, *out = layer->out_buffer;
+    float *out_data = fig_buffer_image(out, image);
+    uint32_t x_lo, x_hi;
+
+    /* first and one past the last x whose window is inside the input */
+    x_lo = (conv->padding_left + conv->stride_x - 1) / conv->stride_x;
+    x_hi = in->width + conv->padding_left >= conv->kernel_w ?
+        (in->width + conv->padding_left - conv->kernel_w) / conv->stride_x + 1 : 0;
+    if (x_hi > out->width)
+        x_hi = out->width;
+    if (x_lo > x_hi)
+        x_lo = x_hi;
+
+    for (uint32_t y = y0; y < y1; y++) {
+        int64_t top = (int64_t) y * conv->stride_y - conv->padding_top;
+
+        if (top < 0 || top + conv->kernel_h > in->height) {
+            for (uint32_t x = 0; x < out->width; x++)
+                border_pixel(conv, weight, in_data, out_data, x, y);
+            continue;
+        }
+
+        for (uint32_t x = 0; x < x_lo; x++)
+            border_pixel(conv, weight, in_data, out_data, x, y);
+
+        if (x_hi > x_lo) {
+            size_t left = (size_t) x_lo * conv->stride_x - conv->padding_left;
+
+            (*jit->entry->kernel)(in_data + ((size_t) top * in->width + left) * in->stride,
+                                  packed,
+                                  out_data + ((size_t) y * out->width + x_lo) * out->stride,
+                                  packed + jit->epilogue, x_hi - x_lo);
+        }
+
+        for (uint32_t x = x_hi; x < out->width; x++)
+            border_pixel(conv, weight, in_data, out_data, x, y);
+    }
+}
+
+static void
+border_pixel(FigConv *conv, const float *weight, const float *in_data,
+             float *out_data, uint32_t x, uint32_t y)
+{
+    FigLayer *layer = (FigLayer *) conv;
+    FigBuffer *in = layer->in_buffer, *out = layer->out_buffer;
+    size_t taps = (size_t) conv->kernel_h * conv->kernel_w * in->channels;
+    uint32_t src_x, src_y;
+
+    for (uint32_t o = 0; o < out->channels; o++) {
+        const float *kernel = weight + o * taps;
+        float accum = conv->bias[o];
+
+        for (uint32_t ky = 0; ky < conv->kernel_h; ky++) {
+            src_y = y * conv->stride_y + ky - conv->padding_top;
+            if (src_y >= in->height)
+                continue;
+
+            for (uint32_t kx = 0; kx < conv->kernel_w; kx++) {
+                src_x = x * conv->stride_x + kx - conv->padding_left;
+                if (src_x >= in->width)
+                    continue;
+
+                for (uint32_t c = 0; c < in->channels; c++)
+                    accum += in_data[fig_buffer_offset_of(in, src_x, src_y, c)] *
+                             kernel[(ky * conv->kernel_w + kx) * in->channels + c];
+            }
+        }
+
+        out_data[fig_buffer_offset_of(out, x, y, o)] = fig_conv_epilogue(layer, o, accum);
+    }
+}
+
+static bool
+jit_available()
+{
+    pthread_once(&detect_once, &detect);
+    return available;
+}
+
+static void
+detect()
+{
+    const char *env = getenv("FIG_JIT");
+
+    __builtin_cpu_init();
+    available = (!env || strcmp(env, "0")) &&
+                __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+}
+
+static const struct JitEntry *
+lookup(const struct JitShape *shape)
+{
+    struct JitEntry *entry;
+    size_t size;
+
+    pthread_mutex_lock(&cache_mutex);
+
+    for (entry = cache; entry; entry = entry->next)
+        if (!memcmp(&entry->shape, shape, sizeof *shape))
+            break;
+
+    if (!entry) {
+        entry = malloc(sizeof *entry);
+        if (!entry)
+            fig_panic("failed allocating memory");
+
+        entry->shape = *shape;
+        entry->kernel = generate(shape, &size);
+        if (!entry->kernel) {
+            free(entry);
+            pthread_mutex_unlock(&cache_mutex);
+            return NULL;
+        }
+
+        snprintf(entry->name, sizeof entry->name, "fig_jit_conv_%ux%us%ux%u_w%u_c%u_o%u%s%s%s",
+                 shape->kernel_h, shape->kernel_w, shape->stride_y, shape->stride_x,
+                 shape->in_width, shape->in_channels, shape->out_channels,
+                 shape->in_stride != shape->in_channels ? "_in8" : "",
+                 shape->out_stride != shape->out_channels ? "_out8" : "",
+                 shape->activation == FIG_ACT_RELU ? "_relu" : "");
+        write_perf_map((const void *) entry->kernel, size, entry->name);
+
+        entry->next = cache;
+        cache = entry;
+    }
+
+    pthread_mutex_unlock(&cache_mutex);
+    return entry;
+}
+
+/* Encoding */
+
+static void
+emit(struct Asm *a, uint8_t byte)
+{
+    if (a->length == a->capacity) {
+        a->capacity = a->capacity ? 2 * a->capacity : 4096;
+        a->code = realloc(a->code, a->capacity);
+        if (!a->code)
+            fig_panic("failed allocating memory");
+    }
+    a->code[a->length++] = byte;
+}
+
+static void
+emit32(struct Asm *a, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+        emit(a, value >> (8 * i));
+}
+
+/* ModRM and displacement of [base + disp], RIP relative when base is RIP */
+
+static void
+modrm(struct Asm *a, int reg, int base, int32_t disp)
+{
+    if (base == RIP) {
+        emit(a, 0x05 | (reg & 7) << 3);
+        emit32(a, disp);
+    } else if (disp == 0 && (base & 7) != RBP) {
+        emit(a, (reg & 7) << 3 | (base & 7));
+    } else if (disp >= -128 && disp < 128) {
+        emit(a, 0x40 | (reg & 7) << 3 | (base & 7));
+        emit(a, disp);
+    } else {
+        emit(a, 0x80 | (reg & 7) << 3 | (base & 7));
+        emit32(a, disp);
+    }
+}
+
+/*
+ * Three byte VEX prefix, 256 bit. map is 1 for 0F and 2 for 0F38, pp 0
+ * for no prefix and 1 for 66. Bases are never RSP or R12, which would
+ * need a SIB byte.
+ */
+
+static void
+vex(struct Asm *a, int map, int pp, int opcode, int reg, int vvvv, int base)
+{
+    int b = base == RIP ? 0 : base >> 3;
+
+    emit(a, 0xc4);
+    emit(a, (~reg & 8) << 4 | 0x40 | (~b & 1) << 5 | map);
+    emit(a, (~vvvv & 15) << 3 | 0x04 | pp);
+    emit(a, opcode);
+}
+
+static void
+vex_rr(struct Asm *a, int map, int pp, int opcode, int reg, int vvvv, int rm)
+{
+    vex(a, map, pp, opcode, reg, vvvv, rm);
+    emit(a, 0xc0 | (reg & 7) << 3 | (rm & 7));
+}
+
+static void
+vex_rm(struct Asm *a, int map, int pp, int opcode, int reg, int vvvv,
+       int base, int32_t disp)
+{
+    vex(a, map, pp, opcode, reg, vvvv, base);
+    modrm(a, reg, base, disp);
+}
+
+#define vxorps(a, d, s1, s2)          vex_rr(a, 1, 0, 0x57, d, s1, s2)
+#define vmaxps(a, d, s1, s2)          vex_rr(a, 1, 0, 0x5f, d, s1, s2)
+#define vmovups_load(a, d, b, disp)   vex_rm(a, 1, 0, 0x10, d, 0, b, disp)
+#define vmovups_store(a, b, disp, s)  vex_rm(a, 1, 0, 0x11, s, 0, b, disp)
+#define vbroadcastss(a, d, b, disp)   vex_rm(a, 2, 1, 0x18, d, 0, b, disp)
+#define vfmadd231ps(a, d, s1, b, disp) vex_rm(a, 2, 1, 0xb8, d, s1, b, disp)
+#define vfmadd213ps(a, d, s1, b, disp) vex_rm(a, 2, 1, 0xa8, d, s1, b, disp)
+#define vmaskmovps_store(a, b, disp, m, s) vex_rm(a, 2, 1, 0x2e, s, m, b, disp)
+
+static void
+rex_w(struct Asm *a, int reg, int rm)
+{
+    emit(a, 0x48 | (reg & 8) >> 1 | (rm & 8) >> 3);
+}
+
+static void
+lea(struct Asm *a, int d, int base, int32_t disp)
+{
+    rex_w(a, d, base);
+    emit(a, 0x8d);
+    modrm(a, d, base, disp);
+}
+
+static void
+add_imm(struct Asm *a, int d, int32_t imm)
+{
+    rex_w(a, 0, d);
+    emit(a, 0x81);
+    emit(a, 0xc0 | (d & 7));
+    emit32(a, imm);
+}
+
+static void
+mov_imm(struct Asm *a, int d, uint32_t imm)
+{
+    if (d & 8)
+        emit(a, 0x41);
+    emit(a, 0xb8 | (d & 7));
+    emit32(a, imm);
+}
+
+static void
+dec(struct Asm *a, int d)
+{
+    rex_w(a, 0, d);
+    emit(a, 0xff);
+    emit(a, 0xc8 | (d & 7));
+}
+
+static void
+test(struct Asm *a, int d)
+{
+    rex_w(a, d, d);
+    emit(a, 0x85);
+    emit(a, 0xc0 | (d & 7) << 3 | (d & 7));
+}
+
+/* Conditional jump, 0x84 jz or 0x85 jnz, to target or patched later */
+
+static size_t
+jcc(struct Asm *a, int cc, size_t target)
+{
+    emit(a, 0x0f);
+    emit(a, cc);
+    emit32(a, (uint32_t) (target - (a->length + 4)));
+    return a->length - 4;
+}
+
+static void
+patch(struct Asm *a, size_t at, size_t target)
+{
+    uint32_t rel = (uint32_t) (target - (at + 4));
+
+    memcpy(a->code + at, &rel, 4);
+}
+
+/* Code generation */
+
+static void
+emit_taps(struct Asm *a, const struct JitShape *s, uint32_t block0, uint32_t n_blocks)
+{
+    uint32_t in_c = s->in_channels;
+    int32_t padded = ((s->out_channels + 7) & ~7u) * sizeof(float);
+    uint32_t unroll = in_c <= 8 ? in_c : in_c % 4 == 0 ? 4 : in_c % 2 == 0 ? 2 : 1;
+
+    for (uint32_t ky = 0; ky < s->kernel_h; ky++) {
+        for (uint32_t kx = 0; kx < s->kernel_w; kx++) {
+            int32_t in_off = ((ky * s->in_width + kx) * s->in_stride) * sizeof(float);
+            int32_t w_off = (ky * s->kernel_w + kx) * in_c * padded + block0 * 32;
+            int in_base = RDI, w_base = RSI;
+            size_t top = 0;
+
+            if (unroll < in_c) {
+                lea(a, R9, RDI, in_off);
+                lea(a, R10, RSI, w_off);
+                mov_imm(a, R11, in_c / unroll);
+                in_base = R9, w_base = R10;
+                in_off = w_off = 0;
+                top = a->length;
+            }
+
+            for (uint32_t u = 0; u < unroll; u++) {
+                vbroadcastss(a, YMM_INPUT, in_base, in_off + u * sizeof(float));
+                for (uint32_t b = 0; b < n_blocks; b++)
+                    vfmadd231ps(a, b, YMM_INPUT, w_base, w_off + u * padded + b * 32);
+            }
+
+            if (unroll < in_c) {
+                add_imm(a, R9, unroll * sizeof(float));
+                add_imm(a, R10, unroll * padded);
+                dec(a, R11);
+                jcc(a, 0x85, top);
+            }
+        }
+    }
+}
+
+static JitKernel
+generate(const struct JitShape *s, size_t *size)
+{
+    struct Asm a = { NULL, 0, 0 };
+    uint32_t n_blocks = (s->out_channels + 7) / 8, tail = s->out_channels % 8;
+    int32_t padded = n_blocks * 32;
+
+    if (s->out_stride >= 8 * n_blocks)
+        tail = 0;
+    size_t mask_load = 0, skip, top, page = sysconf(_SC_PAGESIZE);
+    void *code;
+
+    if (tail)
+        vmovups_load(&a, YMM_MASK, RIP, 0), mask_load = a.length - 4;
+    if (s->activation == FIG_ACT_RELU)
+        vxorps(&a, YMM_ZERO, YMM_ZERO, YMM_ZERO);
+
+    test(&a, R8);
+    skip = jcc(&a, 0x84, 0);
+    top = a.length;
+
+    for (uint32_t block0 = 0; block0 < n_blocks; block0 += ACCUMULATORS) {
+        uint32_t count = n_blocks - block0 < ACCUMULATORS ? n_blocks - block0 : ACCUMULATORS;
+
+        for (uint32_t b = 0; b < count; b++)
+            vxorps(&a, b, b, b);
+
+        emit_taps(&a, s, block0, count);
+
+        for (uint32_t b = 0; b < count; b++) {
+            int32_t off = (block0 + b) * 32;
+
+            vmovups_load(&a, YMM_INPUT, RCX, off);
+            vfmadd213ps(&a, b, YMM_INPUT, RCX, padded + off);
+            if (s->activation == FIG_ACT_RELU)
+                vmaxps(&a, b, b, YMM_ZERO);
+
+            if (tail && block0 + b == n_blocks - 1)
+                vmaskmovps_store(&a, RDX, off, YMM_MASK, b);
+            else
+                vmovups_store(&a, RDX, off, b);
+        }
+    }
+
+    add_imm(&a, RDI, s->stride_x * s->in_stride * sizeof(float));
+    add_imm(&a, RDX, s->out_stride * sizeof(float));
+    dec(&a, R8);
+    jcc(&a, 0x85, top);
+
+    patch(&a, skip, a.length);
+    emit(&a, 0xc5), emit(&a, 0xf8), emit(&a, 0x77); /* vzeroupper */
+    emit(&a, 0xc3);                                /* ret */
+
+    if (tail) {
+        while (a.length % 32)
+            emit(&a, 0xcc);
+        patch(&a, mask_load, a.length);
+        for (uint32_t i = 0; i < 8; i++)
+            emit32(&a, i < tail ? 0xffffffffu : 0);
+    }
+
+    /* written while writable, then made executable and read only */
+    *size = a.length;
+    code = mmap(NULL, (a.length + page - 1) & ~(page - 1), PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED) {
+        free(a.code);
+        fig_warn("unable to map memory for generated code");
+        return NULL;
+    }
+
+    memcpy(code, a.code, a.length);
+    free(a.code);
+
+    if (mprotect(code, (*size + page - 1) & ~(page - 1), PROT_READ | PROT_EXEC)) {
+        munmap(code, (*size + page - 1) & ~(page - 1));
+        fig_warn("unable to make generated code executable");
+        return NULL;
+    }
+
+    return (JitKernel) code;
+}
+
+static void
+write_perf_map(const void *code, size_t size, const char *name)
+{
+    char path[64];
+    FILE *fp;
+
+    snprintf(path, sizeof path, "/tmp/perf-%d.map", (int) getpid());
+
+    pthread_mutex_lock(&perf_map_mutex);
+    fp = fopen(path, "a");
+    if (fp) {
+        fprintf(fp, "%lx %zx %s\n", (unsigned long) code, size, name);
+        fclose(fp);
+    }
+    pthread_mutex_unlock(&perf_map_mutex);
+}
+
+#else /* !__x86_64__ */
+
+FigConvRows
+fig_jit_conv_new(FigConv *conv, const char **name)
+{
+    return NULL;
+}
+
+float **
+fig_jit_conv_packed(FigConv *conv, size_t *size)
+{
+    return NULL;
+}
+
+void
+fig_jit_conv_destroy(FigConv *conv)
+{
+}
+
+#endif /* __x86_64__ */
@@ -0,0 +1,22 @@
+/*
+ * File: jit.h
+ * Desc: x86-64 code generation of convolution microkernels with AVX2
+ *       and FMA, one per layer shape, without any outside assembler.
+ *
+ * Kernels are generated when a convolution is created and shared by
+ * every layer of the same shape for the life of the process. Each one is
+ * listed in /tmp/perf-PID.map so perf can name it. Setting FIG_JIT=0, a
+ * CPU without AVX2 and FMA, or a build for another architecture leaves
+ * convolutions on the compiled kernels.
+ */
+
+#ifndef _FIG_JIT_H_
+#define _FIG_JIT_H_
+
+#include "conv_kernels.h"
+
+FigConvRows fig_jit_conv_new     (FigConv *conv, const char **name);
+float     **fig_jit_conv_packed  (FigConv *conv, size_t *size);
+void        fig_jit_conv_destroy (FigConv *conv);
+
+#endif /* _FIG_JIT_H_ */
@@ -5,10 +5,15 @@
 #include <float.h>
 #include <math.h>
 #include <assert.h>
+#include <string.h>
 #include "misc.h"
+#include "simd.h"
+#include "numa.h"
+#include "image.h"
 #include "layer.h"
-
-#define EPSILON 1e-5
+#include "conv_kernels.h"
+#include "jit.h"
+#include "plan.h"
 
 
 /*
@@ -22,10 +27,70 @@
 #define OFFSET_OF(width, channels, x, y, c) \
     ((y * width + x) * channels + c)
 
+/* Bytes of normalized input a band of a uint8 input convolution keeps in cache */
+#define INPUT_TILE_SIZE (64 * 1024)
+
+/*
+ * uint8 HWC pixels a convolution reads in place of its input buffer.
+ * Each band of output rows goes a few rows at a time: it normalizes the
+ * input rows under them into a float tile of its own, laid out as the
+ * input buffer, and runs the layer's kernel on the tile while it is
+ * still in cache.
+ */
+
+struct FigConvInput
+{
+    const uint8_t *data;
+    size_t stride;
+
+    int source_order;
+    struct PreprocessDesc desc;
+
+    /* channel c of the layer is byte source[c] of a pixel * scale[c] + shift[c] */
+    uint32_t source[3];
+    float scale[3],
+          shift[3];
+    /* the same for the 24 values of 8 packed pixels, once channels are in order */
+    float mul[24],
+          add[24];
+
+    /* tile_len floats per band, for up to tile_bands bands, filled for tile_rows output rows */
+    float *tile;
+    size_t tile_len;
+    uint32_t tile_bands,
+             tile_rows;
+};
+
 /* Forward propogration functions */
 
 static void conv_forward_direct(FigLayer *layer);
 static void maxpool_forward(FigLayer *layer);
+static void fc_forward(FigLayer *layer);
+static void global_avgpool_forward(FigLayer *layer);
+static void softmax_forward(FigLayer *layer);
+
+/* Kernels */
+
+static void conv_item(void *arg, uint32_t index);
+static void conv_item_replicated(void *arg, uint32_t index);
+static void conv_item_u8(void *arg, uint32_t index);
+static void layer_item(void *arg, uint32_t index);
+static void conv_rows(FigLayer *layer, const float *in, const float *weight,
+                      const float *packed, uint32_t image, uint32_t y0, uint32_t y1);
+static void conv_input_rows(const FigConv *conv, uint32_t y0, uint32_t y1,
+                            uint32_t *row0, uint32_t *row1);
+static void conv_input_tiles(FigConv *conv, uint32_t band, uint32_t bands);
+static void conv_load_u8(const FigConv *conv, float *tile, uint32_t row0, uint32_t row1);
+static void conv_input_coefficients(struct FigConvInput *input);
+static void conv_select_kernel(FigConv *conv);
+static float **replicate(const float *data, size_t size, uint32_t n_nodes);
+
+static void fc_gemv(const float *x, uint32_t k, const float *weight,
+                    const float *bias, uint32_t n, float *y);
+static void fc_gemm(const float *x, uint32_t m, uint32_t k, const float *weight,
+                    const float *bias, uint32_t n, float *y);
+static void softmax(const float *x, uint32_t n, float *y);
+static void activate(float *data, uint32_t n, int activation);
 
 /* Activation functions */
 
@@ -33,6 +98,7 @@ static inline float relu(float x) __attribute__((always_inline));
 static inline float logistic(float x) __attribute__((always_inline));
 
 static void conv_layer_destroy(FigLayer *layer);
+static void fc_layer_destroy(FigLayer *layer);
 
 FigLayer *
 fig_layer_conv_new(FigBuffer *in_buffer, int activation, bool batchnorm,
@@ -41,7 +107,7 @@ fig_layer_conv_new(FigBuffer *in_buffer, int activation, bool batchnorm,
 {
     FigConv *layer;
     FigLayer *base;
-    uint32_t buff_width, buff_height;
+    FigShape in_shape = fig_buffer_shape(in_buffer), out_shape;
 
     layer = malloc(sizeof *layer);
     if (!layer)
@@ -54,6 +120,8 @@ fig_layer_conv_new(FigBuffer *in_buffer, int activation, bool batchnorm,
     base->activation = activation;
     base->batchnorm = batchnorm;
     base->forward = &conv_forward_direct;
+    base->pool = NULL;
+    base->external_memory = false;
     base->destroy = &conv_layer_destroy;
 
     if (base->batchnorm) {
@@ -74,14 +142,16 @@ fig_layer_conv_new(FigBuffer *in_buffer, int activation, bool batchnorm,
     layer->padding_right = conv_desc->padding_right;
     layer->weight = conv_desc->weight;
     layer->bias = conv_desc->bias;
+    layer->replicas = NULL;
+    layer->packed_replicas = NULL;
+    layer->n_replicas = 0;
+    layer->input = NULL;
+    layer->jit = NULL;
 
-    buff_width = CONV_SIZE(in_buffer->width, layer->kernel_w,
-                          layer->padding_left, layer->padding_right, layer->stride_x);
-
-    buff_height = CONV_SIZE(in_buffer->height, layer->kernel_h,
-                           layer->padding_top, layer->padding_bottom, layer->stride_y);
-
-    base->out_buffer = fig_buffer_new(buff_width, buff_height, layer->channels);
+    fig_layer_infer_shape(base, &in_shape, &out_shape);
+    base->out_buffer = fig_buffer_new_batch(in_buffer->batch, out_shape.width,
+                                            out_shape.height, out_shape.channels);
+    conv_select_kernel(layer);
 
     return base;
 }
@@ -91,7 +161,7 @@ fig_layer_maxpool_new(FigBuffer *in_buffer, struct MaxPoolDesc *maxpool_desc)
 {
     FigMaxPool *layer;
     FigLayer *base;
-    uint32_t buff_width, buff_height;
+    FigShape in_shape = fig_buffer_shape(in_buffer), out_shape;
 
     layer = malloc(sizeof *layer);
     if (!layer)
@@ -104,6 +174,9 @@ fig_layer_maxpool_new(FigBuffer *in_buffer, struct MaxPoolDesc *maxpool_desc)
     base->activation = FIG_ACT_NOACT;
     base->batchnorm = false;
     base->forward = &maxpool_forward;
+    base->kernel = "maxpool";
+    base->pool = NULL;
+    base->external_memory = false;
     base->destroy = NULL;
 
     layer->kernel_w = maxpool_desc->kernel_w;
@@ -115,20 +188,405 @@ fig_layer_maxpool_new(FigBuffer *in_buffer, struct MaxPoolDesc *maxpool_desc)
     layer->padding_bottom = maxpool_desc->padding_bottom;
     layer->padding_right = maxpool_desc->padding_right;
 
-    buff_width = CONV_SIZE(in_buffer->width, layer->kernel_w,
-                          layer->padding_left, layer->padding_right, layer->stride_x);
-    buff_height = CONV_SIZE(in_buffer->height, layer->kernel_h,
-                           layer->padding_top, layer->padding_bottom, layer->stride_y);
+    fig_layer_infer_shape(base, &in_shape, &out_shape);
+    base->out_buffer = fig_buffer_new_batch(in_buffer->batch, out_shape.width,
+                                            out_shape.height, out_shape.channels);
+
+    return base;
+}
+
+FigLayer *
+fig_layer_fc_new(FigBuffer *in_buffer, int activation, struct FCDesc *fc_desc)
+{
+    FigFullyConnected *layer;
+    FigLayer *base;
 
-    base->out_buffer = fig_buffer_new(buff_width, buff_height, in_buffer->channels);
+    layer = malloc(sizeof *layer);
+    if (!layer)
+        fig_panic("failed allocating memory");
+
+    base = (FigLayer *) layer;
+
+    base->type = FIG_LAYER_FC;
+    base->in_buffer = in_buffer;
+    base->activation = activation;
+    base->batchnorm = false;
+    base->forward = &fc_forward;
+    base->kernel = in_buffer->batch > 1 ? "fc_gemm" : "fc_gemv";
+    base->pool = NULL;
+    base->external_memory = false;
+    base->destroy = &fc_layer_destroy;
+
+    layer->units = fc_desc->units;
+    layer->weight = fc_desc->weight;
+    layer->bias = fc_desc->bias;
+
+    base->out_buffer = fig_buffer_new_batch(in_buffer->batch, 1, 1, layer->units);
 
     return base;
 }
 
+FigLayer *
+fig_layer_global_avgpool_new(FigBuffer *in_buffer)
+{
+    FigLayer *layer;
+
+    layer = malloc(sizeof *layer);
+    if (!layer)
+        fig_panic("failed allocating memory");
+
+    layer->type = FIG_LAYER_GLOBAL_AVGPOOL;
+    layer->in_buffer = in_buffer;
+    layer->activation = FIG_ACT_NOACT;
+    layer->batchnorm = false;
+    layer->forward = &global_avgpool_forward;
+    layer->kernel = "global_avgpool";
+    layer->pool = NULL;
+    layer->external_memory = false;
+    layer->destroy = NULL;
+
+    layer->out_buffer = fig_buffer_new_batch(in_buffer->batch, 1, 1, in_buffer->channels);
+
+    return layer;
+}
+
+FigLayer *
+fig_layer_softmax_new(FigBuffer *in_buffer, struct SoftmaxDesc *softmax_desc)
+{
+    FigSoftmax *layer;
+    FigLayer *base;
+
+    layer = malloc(sizeof *layer);
+    if (!layer)
+        fig_panic("failed allocating memory");
+
+    base = (FigLayer *) layer;
+
+    base->type = FIG_LAYER_SOFTMAX;
+    base->in_buffer = in_buffer;
+    base->activation = FIG_ACT_NOACT;
+    base->batchnorm = false;
+    base->forward = &softmax_forward;
+    base->kernel = "softmax";
+    base->pool = NULL;
+    base->external_memory = false;
+    base->destroy = NULL;
+
+    layer->channel_offset = softmax_desc->channel_offset;
+    layer->channel_count = softmax_desc->channel_count;
+    if (layer->channel_offset >= in_buffer->channels)
+        fig_panic("softmax channel range out of bounds");
+    if (!layer->channel_count)
+        layer->channel_count = in_buffer->channels - layer->channel_offset;
+
+    /* written this way round so a count read from a file cannot wrap the sum */
+    if (layer->channel_count > in_buffer->channels - layer->channel_offset)
+        fig_panic("softmax channel range out of bounds");
+
+    base->out_buffer = fig_buffer_new_batch(in_buffer->batch, in_buffer->width,
+                                            in_buffer->height, in_buffer->channels);
+
+    return base;
+}
+
+const char *
+fig_layer_type_name(int type)
+{
+    switch (type) {
+    case FIG_LAYER_CONV:
+        return "conv";
+    case FIG_LAYER_MAXPOOL:
+        return "maxpool";
+    case FIG_LAYER_INPUT:
+        return "input";
+    case FIG_LAYER_FC:
+        return "fc";
+    case FIG_LAYER_GLOBAL_AVGPOOL:
+        return "global_avgpool";
+    case FIG_LAYER_SOFTMAX:
+        return "softmax";
+    default:
+        return "unknown";
+    }
+}
+
+/*
+ * Computes the output shape a layer produces for an input of in_shape
+ * from its parameters alone, without touching its buffers.
+ */
+
 void
-fig_layer_destroy(FigLayer *layer)
+fig_layer_infer_shape(FigLayer *layer, const FigShape *in_shape, FigShape *out_shape)
 {
+    switch (layer->type) {
+    case FIG_LAYER_CONV: {
+        FigConv *conv = (FigConv *) layer;
+
+        out_shape->width = CONV_SIZE(in_shape->width, conv->kernel_w,
+                                     conv->padding_left, conv->padding_right,
+                                     conv->stride_x);
+        out_shape->height = CONV_SIZE(in_shape->height, conv->kernel_h,
+                                      conv->padding_top, conv->padding_bottom,
+                                      conv->stride_y);
+        out_shape->channels = conv->channels;
+        break;
+    }
+    case FIG_LAYER_MAXPOOL: {
+        FigMaxPool *pool = (FigMaxPool *) layer;
+
+        out_shape->width = CONV_SIZE(in_shape->width, pool->kernel_w,
+                                     pool->padding_left, pool->padding_right,
+                                     pool->stride_x);
+        out_shape->height = CONV_SIZE(in_shape->height, pool->kernel_h,
+                                      pool->padding_top, pool->padding_bottom,
+                                      pool->stride_y);
+        out_shape->channels = in_shape->channels;
+        break;
+    }
+    case FIG_LAYER_FC:
+        out_shape->width = out_shape->height = 1;
+        out_shape->channels = ((FigFullyConnected *) layer)->units;
+        break;
+    case FIG_LAYER_GLOBAL_AVGPOOL:
+        out_shape->width = out_shape->height = 1;
+        out_shape->channels = in_shape->channels;
+        break;
+    default:
+        *out_shape = *in_shape;
+        break;
+    }
+}
+
+/*
+ * Lists the float arrays a layer owns, its output data first, with their
+ * sizes in bytes. Returns how many were stored, at most
+ * FIG_LAYER_MAX_ARRAYS. The input buffer belongs to the previous layer
+ * or to the caller and is not listed.
+ */
+
+uint32_t
+fig_layer_arrays(FigLayer *layer, float **arrays[], size_t sizes[])
+{
+    FigBuffer *in = layer->in_buffer, *out = layer->out_buffer;
+    size_t channels = out->channels * sizeof(float);
+    uint32_t n = 0;
+
+    arrays[n] = &out->data;
+    sizes[n++] = fig_buffer_capacity_len(out) * sizeof(float);
+
     if (layer->batchnorm) {
+        arrays[n] = &layer->gamma;
+        sizes[n++] = channels;
+        arrays[n] = &layer->beta;
+        sizes[n++] = channels;
+        arrays[n] = &layer->running_mean;
+        sizes[n++] = channels;
+        arrays[n] = &layer->running_var;
+        sizes[n++] = channels;
+    }
+
+    switch (layer->type) {
+    case FIG_LAYER_CONV: {
+        FigConv *conv = (FigConv *) layer;
+
+        arrays[n] = &conv->weight;
+        sizes[n++] = (size_t) conv->kernel_w * conv->kernel_h * in->channels * channels;
+        arrays[n] = &conv->bias;
+        sizes[n++] = channels;
+        if (conv->jit) {
+            arrays[n] = fig_jit_conv_packed(conv, &sizes[n]);
+            n++;
+        }
+        break;
+    }
+    case FIG_LAYER_FC: {
+        FigFullyConnected *fc = (FigFullyConnected *) layer;
+
+        arrays[n] = &fc->weight;
+        sizes[n++] = (size_t) fig_buffer_image_len(in) * channels;
+        arrays[n] = &fc->bias;
+        sizes[n++] = channels;
+        break;
+    }
+    default:
+        break;
+    }
+
+    return n;
+}
+
+/* Moves the arrays of a layer onto a NUMA node */
+
+void
+fig_layer_bind(FigLayer *layer, int node)
+{
+    float **arrays[FIG_LAYER_MAX_ARRAYS];
+    size_t sizes[FIG_LAYER_MAX_ARRAYS];
+    uint32_t n = fig_layer_arrays(layer, arrays, sizes);
+
+    for (uint32_t i = 0; i < n; i++)
+        fig_numa_bind(*arrays[i], sizes[i], node);
+}
+
+/*
+ * Gives every NUMA node a copy of the weights of a convolution, and of
+ * the packed weights of its generated kernel, which the parallel kernel
+ * then reads from the node each task runs on. Other layer types keep
+ * their single copy.
+ */
+
+void
+fig_layer_replicate_weights(FigLayer *layer)
+{
+    const FigTopology *topology = fig_topology();
+    FigConv *conv = (FigConv *) layer;
+    float **packed;
+    size_t size;
+
+    if (layer->type != FIG_LAYER_CONV || conv->replicas || topology->n_nodes < 2)
+        return;
+
+    size = (size_t) conv->kernel_w * conv->kernel_h * layer->in_buffer->channels *
+           layer->out_buffer->channels * sizeof(float);
+    conv->replicas = replicate(conv->weight, size, topology->n_nodes);
+
+    packed = conv->jit ? fig_jit_conv_packed(conv, &size) : NULL;
+    if (packed)
+        conv->packed_replicas = replicate(*packed, size, topology->n_nodes);
+
+    conv->n_replicas = topology->n_nodes;
+}
+
+/* One copy of data on each of the first n_nodes NUMA nodes */
+
+static float **
+replicate(const float *data, size_t size, uint32_t n_nodes)
+{
+    float **copies;
+
+    copies = malloc(n_nodes * sizeof(float *));
+    if (!copies)
+        fig_panic("failed allocating memory");
+
+    for (uint32_t i = 0; i < n_nodes; i++) {
+        /* aligned for the vector loads of generated kernels */
+        if (posix_memalign((void **) &copies[i], 64, size))
+            fig_panic("failed allocating memory");
+
+        /* bound before the copy first touches the pages */
+        fig_numa_bind(copies[i], size, i);
+        memcpy(copies[i], data, size);
+    }
+
+    return copies;
+}
+
+/*
+ * Makes a convolution over a 3 channel input read uint8 HWC pixels, rows
+ * stride bytes apart, instead of its input buffer, whose size they must
+ * match. source_order is the channel order of the pixels; desc gives the
+ * normalization and the order the layer was trained on, NULL meaning RGB
+ * in [0, 1]. The pixels are read by every forward pass until the layer
+ * is unbound with NULL data, and are normalized band by band as the
+ * layer's own kernel reads them. Rebinding only swaps the pointer and
+ * coefficients.
+ */
+
+void
+fig_layer_conv_bind_u8(FigLayer *layer, const uint8_t *data, size_t stride,
+                       int source_order, const struct PreprocessDesc *desc)
+{
+    FigConv *conv = (FigConv *) layer;
+    struct FigConvInput *input = conv->input;
+    struct PreprocessDesc plain = { .channel_order = FIG_CHANNELS_RGB };
+
+    if (layer->type != FIG_LAYER_CONV)
+        fig_panic("only convolutions can read uint8 input");
+
+    if (!data) {
+        if (input) {
+            free(input->tile);
+            free(input);
+            conv->input = NULL;
+        }
+        return;
+    }
+
+    if (layer->in_buffer->channels != 3)
+        fig_panic("uint8 input needs a 3 channel convolution");
+    if (layer->in_buffer->batch != 1)
+        fig_panic("uint8 input is a single image");
+    if (stride < 3 * (size_t) layer->in_buffer->width)
+        fig_panic("uint8 input rows are shorter than the input buffer");
+
+    if (!desc)
+        desc = &plain;
+
+    /* tiles are sized by the plan, which binding drops */
+    if (!input) {
+        input = malloc(sizeof *input);
+        if (!input)
+            fig_panic("failed allocating memory");
+        input->tile = NULL;
+        input->tile_len = 0;
+        input->tile_bands = 0;
+        input->tile_rows = 0;
+        conv->input = input;
+    }
+
+    input->data = data;
+    input->stride = stride;
+    input->source_order = source_order;
+    input->desc = *desc;
+    conv_input_coefficients(input);
+}
+
+/*
+ * Layout assignment for the buffer consumer reads from producer. It is
+ * made channel blocked when the channel count is not a multiple of 8
+ * and both layers do well on it: convolutions and max pooling write it,
+ * those and global average pooling read it, except that only generated
+ * convolution kernels read it as fast as HWC; the compiled ones take a
+ * dot product per tap instead of one per kernel row. Fully connected
+ * and softmax layers, which see their input as plain HWC, keep it, as
+ * does a buffer already moved into a model arena. Both convolutions
+ * get kernels for the new strides. Returns the layout of the buffer.
+ */
+
+int
+fig_layer_assign_layout(FigLayer *producer, FigLayer *consumer)
+{
+    FigBuffer *buffer = producer->out_buffer;
+
+    if (consumer->in_buffer != buffer || buffer->channels % 8 == 0 ||
+        producer->external_memory)
+        return buffer->layout;
+
+    if (producer->type != FIG_LAYER_CONV && producer->type != FIG_LAYER_MAXPOOL)
+        return buffer->layout;
+    if (consumer->type != FIG_LAYER_CONV && consumer->type != FIG_LAYER_MAXPOOL &&
+        consumer->type != FIG_LAYER_GLOBAL_AVGPOOL)
+        return buffer->layout;
+    if (consumer->type == FIG_LAYER_CONV && !((FigConv *) consumer)->jit)
+        return buffer->layout;
+
+    fig_buffer_set_layout(buffer, FIG_LAYOUT_HWC8);
+    if (producer->type == FIG_LAYER_CONV)
+        conv_select_kernel((FigConv *) producer);
+    if (consumer->type == FIG_LAYER_CONV)
+        conv_select_kernel((FigConv *) consumer);
+
+    return buffer->layout;
+}
+
+void
+fig_layer_destroy(FigLayer *layer)
+{
+    /* the arena holding the arrays is freed with the model */
+    if (layer->external_memory)
+        layer->out_buffer->data = NULL;
+
+    if (layer->batchnorm && !layer->external_memory) {
         free(layer->gamma);
         free(layer->beta);
         free(layer->running_mean);
@@ -152,6 +610,9 @@ fig_input_new(uint32_t width, uint32_t height)
         fig_panic("failed to allocate memeory");
 
     layer->type = FIG_LAYER_INPUT;
+    layer->kernel = NULL;
+    layer->pool = NULL;
+    layer->external_memory = false;
 
     layer->activation = FIG_ACT_NOACT;
     layer->batchnorm = false;
@@ -159,21 +620,179 @@ fig_input_new(uint32_t width, uint32_t height)
     return layer;
 }
 
+/*
+ * Fills the step a plan runs for the layer, on its pool or as jobs of
+ * scheduler when given, and names the kernel the current batch selects,
+ * since every batch change drops the plan. Convolutions split the output
+ * rows of the batch into a few bands per thread, so threads that finish
+ * early pick up more work, and have their kernel and weights resolved
+ * here; other layers are a single item calling their forward function.
+ */
+
+void
+fig_layer_plan(FigLayer *layer, FigScheduler *scheduler, int priority,
+               FigPlanStep *step)
+{
+    FigConv *conv_layer = (FigConv *) layer;
+    uint32_t height = layer->out_buffer->height, batch = layer->out_buffer->batch;
+    uint32_t width;
+
+    step->layer = layer;
+    step->pool = scheduler ? NULL : layer->pool;
+    step->scheduler = scheduler;
+    step->priority = priority;
+    step->item = &layer_item;
+    step->n_items = 1;
+    step->band = height;
+    step->bands = 1;
+    step->height = height;
+    step->rows = NULL;
+    step->weight = NULL;
+    step->packed = NULL;
+
+    /* fc_gemm() drops to a GEMV for a single row, whatever batch the layer was built for */
+    if (layer->type == FIG_LAYER_FC)
+        layer->kernel = batch > 1 ? "fc_gemm" : "fc_gemv";
+
+    if (layer->type != FIG_LAYER_CONV)
+        return;
+
+    step->rows = conv_layer->rows;
+    step->weight = conv_layer->weight;
+    if (conv_layer->jit)
+        step->packed = *fig_jit_conv_packed(conv_layer, NULL);
+    if (conv_layer->input)
+        step->item = &conv_item_u8;
+    else if (conv_layer->replicas && (step->pool || scheduler))
+        step->item = &conv_item_replicated;
+    else
+        step->item = &conv_item;
+
+    step->n_items = batch;
+    width = scheduler ? fig_scheduler_size(scheduler) :
+            step->pool ? fig_thread_pool_size(step->pool) : 1;
+    if (width >= 2 && height >= 2) {
+        step->bands = (4 * width + batch - 1) / batch;
+        if (step->bands > height)
+            step->bands = height;
+        step->band = (height + step->bands - 1) / step->bands;
+        step->bands = (height + step->band - 1) / step->band;
+        step->n_items = batch * step->bands;
+    }
+
+    /* uint8 input is a single image */
+    if (conv_layer->input) {
+        conv_input_tiles(conv_layer, step->band, step->bands);
+        step->n_items = step->bands;
+    }
+}
+
+/* Sets the output rows of a convolution item, returns the image they are in */
+
+static inline uint32_t
+conv_item_rows(const FigPlanStep *step, uint32_t index, uint32_t *y0, uint32_t *y1)
+{
+    *y0 = index % step->bands * step->band;
+    *y1 = *y0 + step->band < step->height ? *y0 + step->band : step->height;
+
+    return index / step->bands;
+}
+
 static void
 conv_forward_direct(FigLayer *layer)
+{
+    FigPlanStep step;
+
+    fig_layer_plan(layer, NULL, 0, &step);
+    fig_plan_step_run(&step);
+}
+
+static void
+conv_item(void *arg, uint32_t index)
+{
+    const FigPlanStep *step = arg;
+    uint32_t y0, y1, image = conv_item_rows(step, index, &y0, &y1);
+
+    (*step->rows)(step->layer, fig_buffer_image(step->layer->in_buffer, image),
+                  step->weight, step->packed, image, y0, y1);
+}
+
+/* Reads the weights from the copies on the node the item runs on */
+
+static void
+conv_item_replicated(void *arg, uint32_t index)
+{
+    const FigPlanStep *step = arg;
+    const FigConv *conv_layer = (const FigConv *) step->layer;
+    uint32_t y0, y1, image = conv_item_rows(step, index, &y0, &y1);
+    uint32_t node = fig_numa_current_node();
+    const float *weight = step->weight, *packed = step->packed;
+
+    if (node < conv_layer->n_replicas) {
+        weight = conv_layer->replicas[node];
+        if (packed && conv_layer->packed_replicas)
+            packed = conv_layer->packed_replicas[node];
+    }
+
+    (*step->rows)(step->layer, fig_buffer_image(step->layer->in_buffer, image),
+                  weight, packed, image, y0, y1);
+}
+
+/*
+ * Normalizes the uint8 rows under a few output rows at a time into the
+ * band's tile and runs the kernel on them. The kernel addresses the
+ * tile as the whole image, so it is handed the tile offset back by the
+ * rows above it.
+ */
+
+static void
+conv_item_u8(void *arg, uint32_t index)
+{
+    const FigPlanStep *step = arg;
+    const FigConv *conv_layer = (const FigConv *) step->layer;
+    const struct FigConvInput *input = conv_layer->input;
+    const FigBuffer *in_buffer = step->layer->in_buffer;
+    size_t row_len = (size_t) in_buffer->width * in_buffer->stride;
+    float *tile = input->tile + index * input->tile_len;
+    uint32_t y0, y1, row0, row1;
+
+    conv_item_rows(step, index, &y0, &y1);
+    for (uint32_t y = y0; y < y1; y += input->tile_rows) {
+        uint32_t y_end = y + input->tile_rows < y1 ? y + input->tile_rows : y1;
+
+        conv_input_rows(conv_layer, y, y_end, &row0, &row1);
+        conv_load_u8(conv_layer, tile, row0, row1);
+        (*step->rows)(step->layer, tile - row0 * row_len, step->weight, step->packed,
+                      0, y, y_end);
+    }
+}
+
+static void
+layer_item(void *arg, uint32_t index)
+{
+    const FigPlanStep *step = arg;
+
+    fig_layer_forward(step->layer);
+}
+
+static void
+conv_rows(FigLayer *layer, const float *in, const float *weight,
+          const float *packed, uint32_t image, uint32_t y0, uint32_t y1)
 {
     FigConv *conv_layer = (FigConv *) layer;
 
     FigBuffer *in_buffer = layer->in_buffer;
     FigBuffer *out_buffer = layer->out_buffer;
 
-    float *kernel, k, v, accum;
+    float *out = fig_buffer_image(out_buffer, image);
+    const float *kernel;
+    float k, v, accum;
     uint32_t src_x, src_y;
 
     for (uint32_t out_c = 0; out_c < out_buffer->channels; out_c++) {
-        kernel = conv_layer->weight + conv_layer->kernel_h *
+        kernel = weight + conv_layer->kernel_h *
             conv_layer->kernel_w * in_buffer->channels * out_c;
-        for (uint32_t y = 0; y < out_buffer->height; y++) {
+        for (uint32_t y = y0; y < y1; y++) {
             for (uint32_t x = 0; x < out_buffer->width; x++) {
                 accum = 0;
                 for (uint32_t ky = 0; ky < conv_layer->kernel_h; ky++) {
@@ -191,33 +810,157 @@ conv_forward_direct(FigLayer *layer)
                         for (uint32_t in_c = 0; in_c < in_buffer->channels; in_c++) {
                             k = kernel[OFFSET_OF(conv_layer->kernel_w,
                                     in_buffer->channels, kx, ky, in_c)]; 
-                            v = fig_buffer_at(in_buffer, src_x, src_y, in_c);
+                            v = in[fig_buffer_offset_of(in_buffer, src_x, src_y, in_c)];
                             accum += v * k;
                         }
 
                     }
                 }
                 v  = accum + conv_layer->bias[out_c];
-                if (layer->batchnorm) {
-                    v = (v - layer->running_mean[out_c]) / 
-                        sqrtf(layer->running_var[out_c] + EPSILON);
-                    v = v * layer->gamma[out_c] + layer->beta[out_c];
-                }
+                out[fig_buffer_offset_of(out_buffer, x, y, out_c)] =
+                    fig_conv_epilogue(layer, out_c, v);
+            }
+        }
+    }
+}
 
-                switch (layer->activation) {
-                case FIG_ACT_NOACT:
-                    break;
-                case FIG_ACT_RELU:
-                    v = relu(v);
-                    break;
-                default:
-                    fig_panic("unknown activation");
-                    break;
-                }
+/* Input rows [row0, row1) under output rows [y0, y1), clipped to the image */
 
-                fig_buffer_at(out_buffer, x, y, out_c) = v;
+static void
+conv_input_rows(const FigConv *conv, uint32_t y0, uint32_t y1,
+                uint32_t *row0, uint32_t *row1)
+{
+    int64_t height = conv->base.in_buffer->height;
+    int64_t top = (int64_t) y0 * conv->stride_y - conv->padding_top;
+    int64_t bottom = (int64_t) (y1 - 1) * conv->stride_y - conv->padding_top +
+                     conv->kernel_h;
+
+    top = top < 0 ? 0 : top > height ? height : top;
+    bottom = bottom > height ? height : bottom < top ? top : bottom;
+    *row0 = (uint32_t) top;
+    *row1 = (uint32_t) bottom;
+}
+
+/*
+ * Makes room for a tile per band of band output rows, holding the input
+ * under as many of them as fit INPUT_TILE_SIZE, and at least one. Tiles
+ * start on their own cache line, and start zeroed so that the channel
+ * padding of an HWC8 input reads as zero.
+ */
+
+static void
+conv_input_tiles(FigConv *conv, uint32_t band, uint32_t bands)
+{
+    struct FigConvInput *input = conv->input;
+    const FigBuffer *in_buffer = conv->base.in_buffer;
+    size_t row_len = (size_t) in_buffer->width * in_buffer->stride, len;
+    uint32_t rows = INPUT_TILE_SIZE / (row_len * sizeof(float));
+
+    input->tile_rows = rows > conv->kernel_h ? (rows - conv->kernel_h) / conv->stride_y + 1 : 1;
+    input->tile_rows = input->tile_rows < band ? input->tile_rows : band;
+
+    rows = (input->tile_rows - 1) * conv->stride_y + conv->kernel_h;
+    rows = rows > in_buffer->height ? in_buffer->height : rows;
+    len = (rows * row_len + 15) & ~(size_t) 15;
+    if (len <= input->tile_len && bands <= input->tile_bands)
+        return;
+
+    len = len > input->tile_len ? len : input->tile_len;
+    bands = bands > input->tile_bands ? bands : input->tile_bands;
+
+    free(input->tile);
+    input->tile = aligned_alloc(64, len * bands * sizeof(float));
+    if (!input->tile)
+        fig_panic("failed allocating memory");
+    memset(input->tile, 0, len * bands * sizeof(float));
+    input->tile_len = len;
+    input->tile_bands = bands;
+}
+
+/*
+ * Normalizes uint8 input rows [row0, row1) into tile, in the channel
+ * order of the layer. An input buffer without channel padding converts
+ * 8 pixels at a time, reversing their channels with shuffles when the
+ * orders differ.
+ */
+
+static void
+conv_load_u8(const FigConv *conv, float *tile, uint32_t row0, uint32_t row1)
+{
+    const struct FigConvInput *input = conv->input;
+    const FigBuffer *in_buffer = conv->base.in_buffer;
+    uint32_t width = in_buffer->width, stride = in_buffer->stride;
+    uint32_t row_len = 3 * width, row_v = row_len - row_len % 24;
+    /* the orders are either the same or reversed */
+    bool reversed = input->source[0] != 0;
+
+    for (uint32_t y = row0; y < row1; y++) {
+        const uint8_t *src = input->data + y * input->stride;
+        float *dst = tile + (size_t) (y - row0) * width * stride;
+        uint32_t i = 0;
+
+        if (stride == 3) {
+            for (; i < row_v; i += 24) {
+                fig_v8f a = __builtin_convertvector(fig_v8u8_load(src + i), fig_v8f),
+                        b = __builtin_convertvector(fig_v8u8_load(src + i + 8), fig_v8f),
+                        c = __builtin_convertvector(fig_v8u8_load(src + i + 16), fig_v8f);
+
+                if (reversed)
+                    fig_v8_reverse3(&a, &b, &c);
+                fig_v8_store(dst + i, a * fig_v8_load(input->mul) + fig_v8_load(input->add));
+                fig_v8_store(dst + i + 8, b * fig_v8_load(input->mul + 8) +
+                                          fig_v8_load(input->add + 8));
+                fig_v8_store(dst + i + 16, c * fig_v8_load(input->mul + 16) +
+                                           fig_v8_load(input->add + 16));
             }
         }
+
+        for (uint32_t x = i / 3; x < width; x++)
+            for (uint32_t c = 0; c < 3; c++)
+                dst[x * stride + c] = src[3 * x + input->source[c]] * input->scale[c] +
+                                      input->shift[c];
+    }
+}
+
+static void
+conv_input_coefficients(struct FigConvInput *input)
+{
+    const struct PreprocessDesc *desc = &input->desc;
+
+    /* mean and std are in RGB order, c is the channel the layer expects */
+    for (uint32_t c = 0; c < 3; c++) {
+        uint32_t rgb = desc->channel_order == FIG_CHANNELS_BGR ? 2 - c : c;
+        float std = desc->std[rgb] ? desc->std[rgb] : 1.0f;
+
+        input->source[c] = input->source_order == FIG_CHANNELS_BGR ? 2 - rgb : rgb;
+        input->scale[c] = 1.0f / (255.0f * std);
+        input->shift[c] = -desc->mean[rgb] / std;
+    }
+
+    for (uint32_t i = 0; i < 24; i++) {
+        input->mul[i] = input->scale[i % 3];
+        input->add[i] = input->shift[i % 3];
+    }
+}
+
+/*
+ * Prefers a kernel generated for the exact shape of the convolution,
+ * then one compiled for its kernel size and stride, then the generic
+ * conv_rows(). A generated kernel keeps the packed weights of the one
+ * it replaces.
+ */
+
+static void
+conv_select_kernel(FigConv *conv)
+{
+    FigLayer *base = (FigLayer *) conv;
+
+    conv->rows = fig_jit_conv_new(conv, &base->kernel);
+    if (!conv->rows)
+        conv->rows = fig_conv_kernel_select(conv, &base->kernel);
+    if (!conv->rows) {
+        conv->rows = &conv_rows;
+        base->kernel = "conv_direct";
     }
 }
 
@@ -262,7 +1005,7 @@ conv_forward_gemm(FigLayer *layer)
                 v  = accum + conv_layer->bias[out_c];
                 if (layer->batchnorm) {
                     v = (v - layer->running_mean[out_c]) / 
-                        sqrt(layer->running_var[out_c] + EPSILON);
+                        sqrt(layer->running_var[out_c] + FIG_BATCHNORM_EPSILON);
                     v = v * layer->gamma[out_c] + layer->beta[out_c];
                 }
 
@@ -293,33 +1036,285 @@ maxpool_forward(FigLayer *layer)
 
     assert(in_buffer->channels == out_buffer->channels);
 
-    float v, max;
+    const float *in;
+    float *out, v, max;
     uint32_t src_x, src_y;
 
-    for (uint32_t c = 0; c < out_buffer->channels; c++) {
-        for (uint32_t y = 0; y < out_buffer->height; y++) {
-            for (uint32_t x = 0; x < out_buffer->width; x++) {
-                max = -FLT_MAX;
-                for (uint32_t ky = 0; ky < maxpool_layer->kernel_h; ky++) {
-                    for (uint32_t kx = 0; kx < maxpool_layer->kernel_w; kx++) {
-                        src_x = x * maxpool_layer->stride_x + kx;
-                        src_y = y * maxpool_layer->stride_y + ky;
+    for (uint32_t n = 0; n < out_buffer->batch; n++) {
+        in = fig_buffer_image(in_buffer, n);
+        out = fig_buffer_image(out_buffer, n);
+
+        for (uint32_t c = 0; c < out_buffer->channels; c++) {
+            for (uint32_t y = 0; y < out_buffer->height; y++) {
+                for (uint32_t x = 0; x < out_buffer->width; x++) {
+                    max = -FLT_MAX;
+                    for (uint32_t ky = 0; ky < maxpool_layer->kernel_h; ky++) {
+                        for (uint32_t kx = 0; kx < maxpool_layer->kernel_w; kx++) {
+                            src_x = x * maxpool_layer->stride_x + kx;
+                            src_y = y * maxpool_layer->stride_y + ky;
+
+                            src_x -= maxpool_layer->padding_left;
+                            src_y -= maxpool_layer->padding_top;
+
+                            if (src_x < 0 || src_y < 0 ||
+                                src_x >= in_buffer->width || src_y >= in_buffer->height)
+                                continue;
+
+                            v = in[fig_buffer_offset_of(in_buffer, src_x, src_y, c)];
+                            if (v > max)
+                                max = v;
+                        }
+                    }
+                    out[fig_buffer_offset_of(out_buffer, x, y, c)] = max;
+                }
+            }
+        }
+    }
+}
 
-                        src_x -= maxpool_layer->padding_left;
-                        src_y -= maxpool_layer->padding_top;
+static void
+fc_forward(FigLayer *layer)
+{
+    FigFullyConnected *fc_layer = (FigFullyConnected *) layer;
 
-                        if (src_x < 0 || src_y < 0 ||
-                            src_x >= in_buffer->width || src_y >= in_buffer->height)
-                            continue;
+    FigBuffer *in_buffer = layer->in_buffer;
+    FigBuffer *out_buffer = layer->out_buffer;
 
-                        v = fig_buffer_at(in_buffer, src_x, src_y, c);
-                        if (v > max)
-                            max = v;
-                    }
-                }
-                fig_buffer_at(out_buffer, x, y, c) = max;
+    fc_gemm(in_buffer->data, in_buffer->batch, fig_buffer_image_len(in_buffer),
+            fc_layer->weight, fc_layer->bias, fc_layer->units, out_buffer->data);
+    activate(out_buffer->data, fig_buffer_len(out_buffer), layer->activation);
+}
+
+static void
+global_avgpool_forward(FigLayer *layer)
+{
+    FigBuffer *in_buffer = layer->in_buffer;
+    FigBuffer *out_buffer = layer->out_buffer;
+
+    uint32_t channels = in_buffer->channels, stride = in_buffer->stride;
+    uint32_t pixels = in_buffer->width * in_buffer->height;
+    uint32_t cv = channels & ~(FIG_V8_WIDTH - 1);
+    const float *src = in_buffer->data;
+    float *dst = out_buffer->data;
+    fig_v8f scale = fig_v8_set1(1.0f / pixels);
+    uint32_t c;
+
+    /* Accumulate whole pixels into the output so the input is read once in order */
+    for (uint32_t n = 0; n < in_buffer->batch; n++, dst += out_buffer->stride) {
+        memset(dst, 0, channels * sizeof(float));
+        for (uint32_t p = 0; p < pixels; p++, src += stride) {
+            for (c = 0; c < cv; c += FIG_V8_WIDTH)
+                fig_v8_store(dst + c, fig_v8_load(dst + c) + fig_v8_load(src + c));
+            for (; c < channels; c++)
+                dst[c] += src[c];
+        }
+
+        for (c = 0; c < cv; c += FIG_V8_WIDTH)
+            fig_v8_store(dst + c, fig_v8_load(dst + c) * scale);
+        for (; c < channels; c++)
+            dst[c] *= scale[0];
+    }
+}
+
+static void
+softmax_forward(FigLayer *layer)
+{
+    FigSoftmax *softmax_layer = (FigSoftmax *) layer;
+
+    FigBuffer *in_buffer = layer->in_buffer;
+    FigBuffer *out_buffer = layer->out_buffer;
+
+    uint32_t channels = in_buffer->channels;
+    uint32_t pixels = in_buffer->batch * in_buffer->width * in_buffer->height;
+    uint32_t offset = softmax_layer->channel_offset;
+    const float *src = in_buffer->data;
+    float *dst = out_buffer->data;
+
+    if (softmax_layer->channel_count != channels)
+        memcpy(dst, src, fig_buffer_len(in_buffer) * sizeof(float));
+
+    for (uint32_t p = 0; p < pixels; p++, src += channels, dst += channels)
+        softmax(src + offset, softmax_layer->channel_count, dst + offset);
+}
+
+/*
+ * y = x W^T + b, where x holds m rows of k inputs and W holds n rows of k
+ * weights. A single row is a GEMV which streams every weight once. With
+ * more rows, such as a batch, every pair of rows passes over a block of
+ * four weight vectors while it is in cache, so the weights are still
+ * streamed from memory once whatever the number of rows.
+ */
+
+static void
+fc_gemm(const float *x, uint32_t m, uint32_t k, const float *weight,
+        const float *bias, uint32_t n, float *y)
+{
+    uint32_t kv = k & ~(FIG_V8_WIDTH - 1);
+    uint32_t i, j, p;
+
+    if (m == 1) {
+        fc_gemv(x, k, weight, bias, n, y);
+        return;
+    }
+
+    for (j = 0; j + 4 <= n; j += 4) {
+        const float *w0 = weight + j * k, *w1 = w0 + k,
+                    *w2 = w1 + k, *w3 = w2 + k;
+
+        for (i = 0; i + 2 <= m; i += 2) {
+            const float *x0 = x + i * k, *x1 = x0 + k;
+            float *y0 = y + i * n, *y1 = y0 + n;
+            fig_v8f a00 = {0}, a01 = {0}, a02 = {0}, a03 = {0},
+                    a10 = {0}, a11 = {0}, a12 = {0}, a13 = {0};
+
+            for (p = 0; p < kv; p += FIG_V8_WIDTH) {
+                fig_v8f v0 = fig_v8_load(x0 + p), v1 = fig_v8_load(x1 + p);
+                fig_v8f w;
+
+                w = fig_v8_load(w0 + p); a00 += v0 * w; a10 += v1 * w;
+                w = fig_v8_load(w1 + p); a01 += v0 * w; a11 += v1 * w;
+                w = fig_v8_load(w2 + p); a02 += v0 * w; a12 += v1 * w;
+                w = fig_v8_load(w3 + p); a03 += v0 * w; a13 += v1 * w;
             }
+
+            float s00 = fig_v8_hsum(a00), s01 = fig_v8_hsum(a01),
+                  s02 = fig_v8_hsum(a02), s03 = fig_v8_hsum(a03),
+                  s10 = fig_v8_hsum(a10), s11 = fig_v8_hsum(a11),
+                  s12 = fig_v8_hsum(a12), s13 = fig_v8_hsum(a13);
+
+            for (; p < k; p++) {
+                s00 += x0[p] * w0[p]; s10 += x1[p] * w0[p];
+                s01 += x0[p] * w1[p]; s11 += x1[p] * w1[p];
+                s02 += x0[p] * w2[p]; s12 += x1[p] * w2[p];
+                s03 += x0[p] * w3[p]; s13 += x1[p] * w3[p];
+            }
+
+            y0[j + 0] = s00 + bias[j + 0]; y1[j + 0] = s10 + bias[j + 0];
+            y0[j + 1] = s01 + bias[j + 1]; y1[j + 1] = s11 + bias[j + 1];
+            y0[j + 2] = s02 + bias[j + 2]; y1[j + 2] = s12 + bias[j + 2];
+            y0[j + 3] = s03 + bias[j + 3]; y1[j + 3] = s13 + bias[j + 3];
         }
+
+        if (i < m)
+            fc_gemv(x + i * k, k, w0, bias + j, 4, y + i * n + j);
+    }
+
+    if (j < n)
+        for (i = 0; i < m; i++)
+            fc_gemv(x + i * k, k, weight + j * k, bias + j, n - j, y + i * n + j);
+}
+
+static void
+fc_gemv(const float *x, uint32_t k, const float *weight,
+        const float *bias, uint32_t n, float *y)
+{
+    uint32_t kv = k & ~(FIG_V8_WIDTH - 1);
+    uint32_t j, p;
+
+    for (j = 0; j + 4 <= n; j += 4) {
+        const float *w0 = weight + j * k, *w1 = w0 + k,
+                    *w2 = w1 + k, *w3 = w2 + k;
+        fig_v8f a0 = {0}, a1 = {0}, a2 = {0}, a3 = {0};
+
+        for (p = 0; p < kv; p += FIG_V8_WIDTH) {
+            fig_v8f v = fig_v8_load(x + p);
+
+            a0 += v * fig_v8_load(w0 + p);
+            a1 += v * fig_v8_load(w1 + p);
+            a2 += v * fig_v8_load(w2 + p);
+            a3 += v * fig_v8_load(w3 + p);
+        }
+
+        float s0 = fig_v8_hsum(a0), s1 = fig_v8_hsum(a1),
+              s2 = fig_v8_hsum(a2), s3 = fig_v8_hsum(a3);
+
+        for (; p < k; p++) {
+            s0 += x[p] * w0[p];
+            s1 += x[p] * w1[p];
+            s2 += x[p] * w2[p];
+            s3 += x[p] * w3[p];
+        }
+
+        y[j + 0] = s0 + bias[j + 0];
+        y[j + 1] = s1 + bias[j + 1];
+        y[j + 2] = s2 + bias[j + 2];
+        y[j + 3] = s3 + bias[j + 3];
+    }
+
+    for (; j < n; j++) {
+        const float *w = weight + j * k;
+        fig_v8f a = {0};
+        float s;
+
+        for (p = 0; p < kv; p += FIG_V8_WIDTH)
+            a += fig_v8_load(x + p) * fig_v8_load(w + p);
+
+        s = fig_v8_hsum(a);
+        for (; p < k; p++)
+            s += x[p] * w[p];
+
+        y[j] = s + bias[j];
+    }
+}
+
+static void
+softmax(const float *x, uint32_t n, float *y)
+{
+    uint32_t nv = n & ~(FIG_V8_WIDTH - 1), rem = n - nv;
+    fig_v8f vmax = fig_v8_set1(-FLT_MAX), vsum = {0}, v;
+    float max, scale;
+    uint32_t i;
+
+    for (i = 0; i < nv; i += FIG_V8_WIDTH)
+        vmax = fig_v8_max(vmax, fig_v8_load(x + i));
+    if (rem)
+        vmax = fig_v8_max(vmax, fig_v8_load_partial(x + i, rem, -FLT_MAX));
+    max = fig_v8_hmax(vmax);
+
+    for (i = 0; i < nv; i += FIG_V8_WIDTH) {
+        v = fig_v8_exp(fig_v8_load(x + i) - max);
+        vsum += v;
+        fig_v8_store(y + i, v);
+    }
+    if (rem) {
+        v = fig_v8_exp(fig_v8_load_partial(x + i, rem, 0) - max);
+        for (uint32_t l = rem; l < FIG_V8_WIDTH; l++)
+            v[l] = 0;
+        vsum += v;
+        fig_v8_store_partial(y + i, v, rem);
+    }
+
+    scale = 1.0f / fig_v8_hsum(vsum);
+    for (i = 0; i < nv; i += FIG_V8_WIDTH)
+        fig_v8_store(y + i, fig_v8_load(y + i) * scale);
+    for (; i < n; i++)
+        y[i] *= scale;
+}
+
+static void
+activate(float *data, uint32_t n, int activation)
+{
+    uint32_t nv = n & ~(FIG_V8_WIDTH - 1);
+    uint32_t i;
+
+    switch (activation) {
+    case FIG_ACT_NOACT:
+        break;
+    case FIG_ACT_RELU:
+        for (i = 0; i < nv; i += FIG_V8_WIDTH)
+            fig_v8_store(data + i, fig_v8_max(fig_v8_load(data + i), fig_v8_set1(0)));
+        for (; i < n; i++)
+            data[i] = relu(data[i]);
+        break;
+    case FIG_ACT_SIGMOID:
+        for (i = 0; i < nv; i += FIG_V8_WIDTH)
+            fig_v8_store(data + i, fig_v8_logistic(fig_v8_load(data + i)));
+        for (; i < n; i++)
+            data[i] = logistic(data[i]);
+        break;
+    default:
+        fig_panic("unknown activation");
+        break;
     }
 }
 
@@ -328,9 +1323,34 @@ conv_layer_destroy(FigLayer *layer)
 {
     FigConv *conv_layer = (FigConv *) layer;
 
-    free(conv_layer->weight);
-    free(conv_layer->bias);
+    if (conv_layer->input)
+        fig_layer_conv_bind_u8(layer, NULL, 0, 0, NULL);
 
+    if (!layer->external_memory) {
+        free(conv_layer->weight);
+        free(conv_layer->bias);
+    }
+
+    for (uint32_t i = 0; i < conv_layer->n_replicas; i++) {
+        free(conv_layer->replicas[i]);
+        if (conv_layer->packed_replicas)
+            free(conv_layer->packed_replicas[i]);
+    }
+    free(conv_layer->replicas);
+    free(conv_layer->packed_replicas);
+
+    fig_jit_conv_destroy(conv_layer);
+}
+
+static void
+fc_layer_destroy(FigLayer *layer)
+{
+    FigFullyConnected *fc_layer = (FigFullyConnected *) layer;
+
+    if (!layer->external_memory) {
+        free(fc_layer->weight);
+        free(fc_layer->bias);
+    }
 }
 
 inline static float
@@ -1,7 +1,10 @@
 #include <stdio.h>
 #include <string.h>
+#include "arena.h"
+#include "async.h"
 #include "model.h"
 #include "misc.h"
+#include "plan.h"
 
 #define MAGIC "FIG"
 
@@ -50,7 +53,38 @@ struct MaxPoolRecord
              padding_right;
 };
 
+struct FCRecord
+{
+    int activation;
+
+    uint32_t in_size,
+             units;
+
+    uint32_t weight_size,
+             bias_size;
+};
+
+struct SoftmaxRecord
+{
+    uint32_t channel_offset,
+             channel_count;
+};
+
 static float *read_array(FILE *fp, size_t length);
+static void   drop_plan(FigModel *model);
+static void   run_plan(FigModel *model);
+static void   stats_forward(FigModel *model);
+static void   stats_record_forward(FigModelStats *stats, FigModel *model,
+                                   uint64_t ns);
+
+#ifdef FIG_ENABLE_PROFILING
+static void   profiled_forward(FigModel *model);
+#endif /* FIG_ENABLE_PROFILING */
+
+/*
+ * The batch size of input_buffer, see fig_buffer_new_batch(), carries
+ * through every layer, so each forward pass runs the whole batch.
+ */
 
 FigModel *
 fig_model_new(FigBuffer *input_buffer)
@@ -64,28 +98,457 @@ fig_model_new(FigBuffer *input_buffer)
     model->input_buffer = input_buffer;
     model->output_buffer = input_buffer;
     model->layers = fig_list_new();
+    model->profiler = NULL;
+    model->stats = NULL;
+    model->context = NULL;
+    model->arena = NULL;
+    model->async = NULL;
+    model->plan = NULL;
+    model->layer_output = NULL;
+    model->scheduler = NULL;
+    model->priority = FIG_PRIORITY_INTERACTIVE;
 
     return model;
 }
 
+/*
+ * Appends a layer reading the current output. The buffer between it and
+ * the previous layer is interior to the network from now on, so it gets
+ * the layout that suits both kernels; see fig_layer_assign_layout(). The
+ * model input and output stay HWC, which keeps layout conversions to
+ * the first and last layers reading and writing them.
+ */
+
 void
 fig_model_add_layer(FigModel *model, FigLayer *layer)
 {
+    if (model->layer_output)
+        fig_model_set_output(model, NULL);
+    if (fig_list_length(model->layers))
+        fig_layer_assign_layout((FigLayer *) fig_list_tail(model->layers), layer);
+
     model->output_buffer = layer->out_buffer;
+    if (model->context)
+        layer->pool = model->context->pool;
     fig_list_append(model->layers, layer);
+    drop_plan(model);
 }
 
+/*
+ * Rebinds the model to another input buffer of the same shape, so
+ * decoded inputs can be used in place instead of being copied.
+ */
+
+void
+fig_model_set_input(FigModel *model, FigBuffer *input_buffer)
+{
+    FigBuffer *current = model->input_buffer;
+    FigLayer *layer;
+
+    if (input_buffer->width != current->width ||
+        input_buffer->height != current->height ||
+        input_buffer->channels != current->channels ||
+        input_buffer->stride != current->stride ||
+        input_buffer->batch != current->batch)
+        fig_panic("input buffer does not match the model");
+
+    model->input_buffer = input_buffer;
+
+    if (!fig_list_length(model->layers)) {
+        model->output_buffer = input_buffer;
+        return;
+    }
+
+    layer = (FigLayer *) model->layers->head->data;
+    layer->in_buffer = input_buffer;
+}
+
+/*
+ * Makes the last layer write into a caller owned buffer of the model
+ * output's shape and batch instead of its own, so outputs land where the
+ * caller reads them without a copy. NULL goes back to the layer's own
+ * buffer, as do adding a layer and fig_model_set_memory().
+ */
+
+void
+fig_model_set_output(FigModel *model, FigBuffer *output_buffer)
+{
+    FigLayer *layer;
+    FigBuffer *current, *own;
+
+    if (!fig_list_length(model->layers))
+        fig_panic("model has no layer to write output");
+
+    layer = (FigLayer *) fig_list_tail(model->layers);
+    current = layer->out_buffer;
+    own = model->layer_output ? model->layer_output : current;
+
+    if (!output_buffer) {
+        fig_buffer_set_batch(own, current->batch);
+        output_buffer = own;
+    } else if (output_buffer->width != current->width ||
+               output_buffer->height != current->height ||
+               output_buffer->channels != current->channels ||
+               output_buffer->stride != current->stride ||
+               output_buffer->batch != current->batch) {
+        fig_panic("output buffer does not match the model");
+    }
+
+    layer->out_buffer = output_buffer;
+    model->output_buffer = output_buffer;
+    model->layer_output = output_buffer == own ? NULL : own;
+}
+
+/*
+ * Runs the following passes on the first batch images only, up to the
+ * batch of the input buffer the model was built with, so one model
+ * serves every batch size. The plan, whose work split depends on the
+ * batch, is dropped when it changes.
+ */
+
+void
+fig_model_set_batch(FigModel *model, uint32_t batch)
+{
+    FigLayer *layer;
+
+    if (batch == model->input_buffer->batch)
+        return;
+
+    if (fig_list_length(model->layers)) {
+        layer = (FigLayer *) model->layers->head->data;
+        if (batch != 1 && layer->type == FIG_LAYER_CONV && ((FigConv *) layer)->input)
+            fig_panic("uint8 input is a single image");
+    }
+
+    fig_buffer_set_batch(model->input_buffer, batch);
+    fig_list_for_each(model->layers) {
+        fig_buffer_set_batch(((FigLayer *) item->data)->out_buffer, batch);
+    }
+    drop_plan(model);
+}
+
+/*
+ * Feeds the model straight from caller owned uint8 HWC pixels, which
+ * must have the input buffer's width and height, instead of its float
+ * input buffer. The first layer, which has to be a convolution, converts
+ * and normalizes them as it reads them; see fig_layer_conv_bind_u8().
+ * NULL data goes back to the input buffer.
+ */
+
+void
+fig_model_bind_input_u8(FigModel *model, const uint8_t *data, size_t stride,
+                        int source_order, const struct PreprocessDesc *desc)
+{
+    FigLayer *layer;
+
+    if (!fig_list_length(model->layers))
+        fig_panic("model has no layer to read uint8 input");
+
+    layer = (FigLayer *) model->layers->head->data;
+    if (layer->type != FIG_LAYER_CONV)
+        fig_panic("uint8 input needs a convolution as the first layer");
+
+    /* the first step runs another kernel when uint8 input is bound or unbound */
+    if (!data != !((FigConv *) layer)->input)
+        drop_plan(model);
+    fig_layer_conv_bind_u8(layer, data, stride, source_order, desc);
+}
+
+/*
+ * Flattens the layers into the plan fig_model_forward() runs, which
+ * otherwise happens on the first forward pass after the model changed.
+ * Adding layers, setting a context, scheduler, memory or batch, and
+ * binding or unbinding uint8 input drop the plan; rebinding the input
+ * does not.
+ */
+
+void
+fig_model_compile(FigModel *model)
+{
+    if (!model->plan)
+        model->plan = fig_plan_new(model->layers, model->scheduler,
+                                   model->priority);
+}
+
+static void
+drop_plan(FigModel *model)
+{
+    if (model->plan) {
+        fig_plan_destroy(model->plan);
+        model->plan = NULL;
+    }
+}
+
+/*
+ * Runs one forward pass. With a scheduler the pass first waits for
+ * admission, see fig_scheduler_admit().
+ */
+
 void
 fig_model_forward(FigModel *model)
+{
+    fig_model_compile(model);
+
+    if (!model->scheduler) {
+        run_plan(model);
+        return;
+    }
+
+    fig_scheduler_admit(model->scheduler, model->priority);
+    run_plan(model);
+    fig_scheduler_leave(model->scheduler);
+}
+
+static void
+run_plan(FigModel *model)
+{
+    FigPlan *plan;
+
+#ifdef FIG_ENABLE_PROFILING
+    if (model->profiler) {
+        profiled_forward(model);
+        return;
+    }
+#endif /* FIG_ENABLE_PROFILING */
+
+    if (model->stats) {
+        stats_forward(model);
+        return;
+    }
+
+    plan = model->plan;
+    for (uint32_t i = 0; i < plan->n_steps; i++)
+        fig_plan_step_run(plan->steps + i);
+}
+
+/*
+ * Attaches a profiler to the model, or detaches it when NULL. The check
+ * is made once per forward pass, not per layer.
+ */
+
+void
+fig_model_set_profiler(FigModel *model, FigProfiler *profiler)
+{
+#ifndef FIG_ENABLE_PROFILING
+    if (profiler)
+        fig_warn("profiling was disabled at build time");
+#endif /* FIG_ENABLE_PROFILING */
+
+    model->profiler = profiler;
+}
+
+/*
+ * Runs the model's parallel layers on the context's pool and applies its
+ * placement policy: in local mode the layers' activations and weights
+ * move to the context's node, with replication every node gets its own
+ * copy of the convolution weights. Layers added later only pick up the
+ * pool. A NULL context goes back to running on the calling thread.
+ */
+
+void
+fig_model_set_context(FigModel *model, FigContext *context)
 {
     FigLayer *layer;
 
+    model->context = context;
+    drop_plan(model);
+
     fig_list_for_each(model->layers) {
         layer = (FigLayer *) item->data;
-        fig_layer_forward(layer);
+        layer->pool = context ? context->pool : NULL;
+
+        if (!context)
+            continue;
+        if (context->local)
+            fig_layer_bind(layer, context->node);
+        if (context->replicate_weights)
+            fig_layer_replicate_weights(layer);
     }
 }
 
+/*
+ * Runs the model's parallel layers as jobs of scheduler at priority, one
+ * of enum FigPriority, in place of the context's pool, and admits each
+ * forward pass through it. Placement set by the context stays. Models
+ * sharing a scheduler share its threads and its cap on inferences. A
+ * NULL scheduler goes back to the context's pool.
+ */
+
+void
+fig_model_set_scheduler(FigModel *model, FigScheduler *scheduler, int priority)
+{
+    if (priority < 0 || priority >= FIG_PRIORITY_CLASSES)
+        fig_panic("invalid scheduler priority");
+
+    model->scheduler = scheduler;
+    model->priority = priority;
+    drop_plan(model);
+}
+
+/*
+ * Moves the output buffers, weights and batchnorm parameters of every
+ * layer into one arena mapped for the model, so the first inference
+ * after load does not page fault its way through fresh allocations.
+ * Call it once all layers are added and before fig_model_set_context().
+ * Returns 0 when every option was applied and -1 when some fell back.
+ */
+
+int
+fig_model_set_memory(FigModel *model, const struct MemoryDesc *desc)
+{
+    float **arrays[FIG_LAYER_MAX_ARRAYS];
+    size_t sizes[FIG_LAYER_MAX_ARRAYS], total = 0;
+    FigLayer *layer;
+    uint32_t n;
+    int flags = 0;
+
+    if (model->arena) {
+        fig_warn("model memory is already set");
+        return -1;
+    }
+
+    if (model->layer_output)
+        fig_model_set_output(model, NULL);
+
+    if (desc->huge_pages)
+        flags |= FIG_ARENA_HUGEPAGE;
+    if (desc->hugetlbfs)
+        flags |= FIG_ARENA_HUGETLB;
+    if (desc->prefault)
+        flags |= FIG_ARENA_PREFAULT;
+    if (desc->lock)
+        flags |= FIG_ARENA_LOCK;
+
+    fig_list_for_each(model->layers) {
+        n = fig_layer_arrays((FigLayer *) item->data, arrays, sizes);
+        for (uint32_t i = 0; i < n; i++)
+            total += sizes[i] + 64;
+    }
+
+    model->arena = fig_arena_new(total, flags);
+
+    fig_list_for_each(model->layers) {
+        layer = (FigLayer *) item->data;
+        n = fig_layer_arrays(layer, arrays, sizes);
+
+        for (uint32_t i = 0; i < n; i++) {
+            float *data = fig_arena_alloc(model->arena, sizes[i]);
+
+            memcpy(data, *arrays[i], sizes[i]);
+            if (!layer->external_memory)
+                free(*arrays[i]);
+            *arrays[i] = data;
+        }
+        layer->external_memory = true;
+    }
+    drop_plan(model);
+
+    return (model->arena->flags & flags) == flags ? 0 : -1;
+}
+
+/*
+ * Runs n_runs forward passes, at least one, on whatever the input buffer
+ * holds, to warm caches, the branch predictor and lazily set up state
+ * before real traffic. Profilers and statistics do not see them.
+ */
+
+void
+fig_model_warmup(FigModel *model, uint32_t n_runs)
+{
+    FigProfiler *profiler = model->profiler;
+    FigModelStats *stats = model->stats;
+
+    model->profiler = NULL;
+    model->stats = NULL;
+
+    if (!n_runs)
+        n_runs = 1;
+    for (uint32_t i = 0; i < n_runs; i++)
+        fig_model_forward(model);
+
+    model->profiler = profiler;
+    model->stats = stats;
+}
+
+/*
+ * Starts keeping latency histograms and counters for the model, from
+ * its next forward pass on. Call it once all layers are added; the
+ * returned statistics live as long as the model.
+ */
+
+FigModelStats *
+fig_model_enable_stats(FigModel *model)
+{
+    if (!model->stats)
+        model->stats = fig_model_stats_new(fig_list_length(model->layers));
+    return model->stats;
+}
+
+static void
+stats_forward(FigModel *model)
+{
+    FigModelStats *stats = model->stats;
+    FigPlan *plan = model->plan;
+    uint64_t run_start, start, end;
+
+    run_start = end = fig_profiler_now();
+
+    for (uint32_t i = 0; i < plan->n_steps; i++) {
+        start = end;
+        fig_plan_step_run(plan->steps + i);
+        end = fig_profiler_now();
+        if (i < stats->n_layers)
+            fig_histogram_record(stats->layers + i, end - start);
+    }
+
+    stats_record_forward(stats, model, end - run_start);
+}
+
+static void
+stats_record_forward(FigModelStats *stats, FigModel *model, uint64_t ns)
+{
+    fig_histogram_record(&stats->forward, ns);
+    __atomic_fetch_add(&stats->inferences, model->input_buffer->batch, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->bytes, sizeof(float) *
+                       ((uint64_t) fig_buffer_len(model->input_buffer) +
+                        fig_buffer_len(model->output_buffer)), __ATOMIC_RELAXED);
+}
+
+#ifdef FIG_ENABLE_PROFILING
+
+static void
+profiled_forward(FigModel *model)
+{
+    FigProfiler *profiler = model->profiler;
+    FigPlan *plan = model->plan;
+    FigProfileSample samples[2], run_start;
+    int32_t index = 0;
+
+    fig_profiler_sample(profiler, &run_start);
+    samples[0] = run_start;
+
+    while ((uint32_t) index < plan->n_steps) {
+        FigProfileSample *start = samples + (index & 1),
+                         *end = samples + (~index & 1);
+        FigPlanStep *step = plan->steps + index;
+
+        fig_plan_step_run(step);
+        fig_profiler_sample(profiler, end);
+        fig_profiler_record(profiler, step->layer, index, start, end);
+        if (model->stats && (uint32_t) index < model->stats->n_layers)
+            fig_histogram_record(model->stats->layers + index, end->ns - start->ns);
+        index++;
+    }
+
+    fig_profiler_record(profiler, NULL, FIG_PROFILE_FORWARD, &run_start,
+                        samples + (index & 1));
+
+    if (model->stats)
+        stats_record_forward(model->stats, model, samples[index & 1].ns - run_start.ns);
+}
+
+#endif /* FIG_ENABLE_PROFILING */
+
 FigModel *
 fig_model_from_file(const char *path, FigBuffer *input_buffer)
 {
@@ -95,9 +558,13 @@ fig_model_from_file(const char *path, FigBuffer *input_buffer)
     struct ConvRecord conv_record;
     struct BatchNormRecord batchnorm_record;
     struct MaxPoolRecord maxpool_record;
+    struct FCRecord fc_record;
+    struct SoftmaxRecord softmax_record;
     struct ConvDesc conv_desc;
     struct BatchNormDesc batchnorm_desc;
     struct MaxPoolDesc maxpool_desc;
+    struct FCDesc fc_desc;
+    struct SoftmaxDesc softmax_desc;
     FigModel *model;
     FigLayer *layer;
 
@@ -225,6 +692,75 @@ fig_model_from_file(const char *path, FigBuffer *input_buffer)
                     &maxpool_desc);
             fig_model_add_layer(model, layer);
 
+            break;
+        case FIG_LAYER_FC: /* fully connected layer */
+            layer_count++;
+            n = fread(&fc_record, sizeof(struct FCRecord), 1, fp);
+            if (n != 1) {
+                fclose(fp);
+                fig_panic("file ended unexpectedly");
+            }
+
+            if (fc_record.in_size != fig_buffer_image_len(fig_model_output(model)) ||
+                fc_record.weight_size != (uint64_t) fc_record.in_size * fc_record.units ||
+                fc_record.bias_size != fc_record.units) {
+                fclose(fp);
+                fig_panic("fully connected layer does not match its input");
+            }
+
+            fc_desc.units = fc_record.units;
+            fc_desc.weight = read_array(fp, fc_record.weight_size);
+            fc_desc.bias = read_array(fp, fc_record.bias_size);
+
+#ifdef _FIG_DEBUG
+            fprintf(stderr, "\nfully connected layer\n");
+            fprintf(stderr, "------------------\n");
+            fprintf(stderr, "activation        : %d\n", fc_record.activation);
+            fprintf(stderr, "in size           : %d\n", fc_record.in_size);
+            fprintf(stderr, "units             : %d\n", fc_record.units);
+            fprintf(stderr, "weight size       : %d\n", fc_record.weight_size);
+            fprintf(stderr, "bias size         : %d\n", fc_record.bias_size);
+#endif /* _FIG_DEBUG */
+
+            layer = fig_layer_fc_new(fig_model_output(model),
+                    fc_record.activation, &fc_desc);
+            fig_model_add_layer(model, layer);
+
+            break;
+        case FIG_LAYER_GLOBAL_AVGPOOL: /* global average pool layer, no record */
+            layer_count++;
+
+#ifdef _FIG_DEBUG
+            fprintf(stderr, "\nglobal average pool layer\n");
+            fprintf(stderr, "------------------\n");
+#endif /* _FIG_DEBUG */
+
+            layer = fig_layer_global_avgpool_new(fig_model_output(model));
+            fig_model_add_layer(model, layer);
+
+            break;
+        case FIG_LAYER_SOFTMAX: /* softmax layer */
+            layer_count++;
+            n = fread(&softmax_record, sizeof(struct SoftmaxRecord), 1, fp);
+            if (n != 1) {
+                fclose(fp);
+                fig_panic("file ended unexpectedly");
+            }
+
+            softmax_desc.channel_offset = softmax_record.channel_offset;
+            softmax_desc.channel_count = softmax_record.channel_count;
+
+#ifdef _FIG_DEBUG
+            fprintf(stderr, "\nsoftmax layer\n");
+            fprintf(stderr, "------------------\n");
+            fprintf(stderr, "channel offset    : %d\n", softmax_record.channel_offset);
+            fprintf(stderr, "channel count     : %d\n", softmax_record.channel_count);
+#endif /* _FIG_DEBUG */
+
+            layer = fig_layer_softmax_new(fig_model_output(model),
+                    &softmax_desc);
+            fig_model_add_layer(model, layer);
+
             break;
 
         default:
@@ -260,10 +796,19 @@ fig_model_destroy(FigModel *model)
 {
     FigLayer *layer;
 
+    fig_model_stop_async(model);
+    if (model->layer_output)
+        fig_model_set_output(model, NULL);
+
     fig_list_for_each(model->layers) {
         layer = (FigLayer *) item->data;
         fig_layer_destroy(layer);
     }
     fig_list_destroy(model->layers);
+    drop_plan(model);
+    if (model->stats)
+        fig_model_stats_destroy(model->stats);
+    if (model->arena)
+        fig_arena_destroy(model->arena);
     free(model);
 }
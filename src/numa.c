@@ -0,0 +1,170 @@
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/mempolicy.h>
+#include "misc.h"
+#include "numa.h"
+
+#define NODE_PATH "/sys/devices/system/node/node%u/cpulist"
+#define ONLINE_PATH "/sys/devices/system/cpu/online"
+
+static void discover();
+static int *read_cpulist(const char *path, uint32_t *n_cpus);
+
+static FigTopology topology;
+static pthread_once_t topology_once = PTHREAD_ONCE_INIT;
+
+/* Discovered on first use and shared for the life of the process */
+
+const FigTopology *
+fig_topology()
+{
+    pthread_once(&topology_once, &discover);
+    return &topology;
+}
+
+/* Node of the CPU the calling thread runs on, 0 when unknown */
+
+int
+fig_numa_current_node()
+{
+    const FigTopology *t = fig_topology();
+    int cpu = sched_getcpu();
+
+    if (cpu < 0 || cpu > t->max_cpu || t->cpu_node[cpu] < 0)
+        return 0;
+    return t->cpu_node[cpu];
+}
+
+/*
+ * Asks the kernel to keep the pages of [ptr, ptr + size) on node, moving
+ * those already faulted in. Only whole pages inside the range are bound.
+ * Returns 0 on success and -1 when the kernel refused or lacks NUMA.
+ */
+
+int
+fig_numa_bind(void *ptr, size_t size, int node)
+{
+    const FigTopology *t = fig_topology();
+    unsigned long mask[FIG_NUMA_MAX_NODES / (8 * sizeof(unsigned long))] = { 0 };
+    uintptr_t page = (uintptr_t) sysconf(_SC_PAGESIZE);
+    uintptr_t start = ((uintptr_t) ptr + page - 1) & ~(page - 1),
+              end = ((uintptr_t) ptr + size) & ~(page - 1);
+    int id;
+
+    if (node < 0 || (uint32_t) node >= t->n_nodes)
+        return -1;
+    if (end <= start)
+        return 0;
+
+    id = t->nodes[node].id;
+    mask[id / (8 * sizeof(unsigned long))] |= 1ul << (id % (8 * sizeof(unsigned long)));
+
+    if (syscall(SYS_mbind, (void *) start, end - start, MPOL_PREFERRED, mask,
+                FIG_NUMA_MAX_NODES + 1, MPOL_MF_MOVE))
+        return -1;
+    return 0;
+}
+
+static void
+discover()
+{
+    char path[64];
+    FigNumaNode nodes[FIG_NUMA_MAX_NODES];
+    uint32_t n = 0;
+
+    for (uint32_t i = 0; i < FIG_NUMA_MAX_NODES; i++) {
+        snprintf(path, sizeof path, NODE_PATH, i);
+        nodes[n].id = i;
+        nodes[n].cpus = read_cpulist(path, &nodes[n].n_cpus);
+        /* memory only nodes have no CPUs to run on */
+        if (nodes[n].cpus && nodes[n].n_cpus)
+            n++;
+        else
+            free(nodes[n].cpus);
+    }
+
+    if (!n) {
+        nodes[0].id = 0;
+        nodes[0].cpus = read_cpulist(ONLINE_PATH, &nodes[0].n_cpus);
+        if (!nodes[0].cpus || !nodes[0].n_cpus) {
+            long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+
+            free(nodes[0].cpus);
+            nodes[0].n_cpus = n_cpus > 0 ? (uint32_t) n_cpus : 1;
+            nodes[0].cpus = malloc(nodes[0].n_cpus * sizeof(int));
+            if (!nodes[0].cpus)
+                fig_panic("failed allocating memory");
+            for (uint32_t c = 0; c < nodes[0].n_cpus; c++)
+                nodes[0].cpus[c] = c;
+        }
+        n = 1;
+    }
+
+    topology.n_nodes = n;
+    topology.nodes = malloc(n * sizeof(FigNumaNode));
+    if (!topology.nodes)
+        fig_panic("failed allocating memory");
+    memcpy(topology.nodes, nodes, n * sizeof(FigNumaNode));
+
+    topology.max_cpu = 0;
+    for (uint32_t i = 0; i < n; i++)
+        for (uint32_t c = 0; c < nodes[i].n_cpus; c++)
+            if (nodes[i].cpus[c] > topology.max_cpu)
+                topology.max_cpu = nodes[i].cpus[c];
+
+    topology.cpu_node = malloc((topology.max_cpu + 1) * sizeof(int));
+    if (!topology.cpu_node)
+        fig_panic("failed allocating memory");
+    for (int c = 0; c <= topology.max_cpu; c++)
+        topology.cpu_node[c] = -1;
+    for (uint32_t i = 0; i < n; i++)
+        for (uint32_t c = 0; c < nodes[i].n_cpus; c++)
+            topology.cpu_node[nodes[i].cpus[c]] = i;
+}
+
+/* Parses a list such as "0-3,8-11", NULL when the file does not exist */
+
+static int *
+read_cpulist(const char *path, uint32_t *n_cpus)
+{
+    FILE *fp = fopen(path, "r");
+    int *cpus = NULL, first, last;
+    uint32_t n = 0, capacity = 0;
+    char sep;
+
+    *n_cpus = 0;
+    if (!fp)
+        return NULL;
+
+    while (fscanf(fp, "%d", &first) == 1) {
+        last = first;
+        sep = '\0';
+        if (fscanf(fp, "%c", &sep) == 1 && sep == '-' &&
+            fscanf(fp, "%d%c", &last, &sep) < 1)
+            break;
+
+        for (int c = first; c <= last; c++) {
+            if (n == capacity) {
+                capacity = capacity ? 2 * capacity : 16;
+                cpus = realloc(cpus, capacity * sizeof(int));
+                if (!cpus)
+                    fig_panic("failed allocating memory");
+            }
+            cpus[n++] = c;
+        }
+
+        if (sep != ',')
+            break;
+    }
+
+    fclose(fp);
+    *n_cpus = n;
+    return cpus ? cpus : calloc(1, sizeof(int));
+}
@@ -0,0 +1,108 @@
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#include "perfcounters.h"
+
+#define CACHE_READ_MISS(cache) \
+    ((cache) | (PERF_COUNT_HW_CACHE_OP_READ << 8) | \
+     (PERF_COUNT_HW_CACHE_RESULT_MISS << 16))
+
+static const struct
+{
+    uint32_t type;
+    uint64_t config;
+} events[FIG_N_COUNTERS] = {
+    [FIG_COUNTER_CYCLES]        = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    [FIG_COUNTER_INSTRUCTIONS]  = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    [FIG_COUNTER_LLC_MISSES]    = { PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_LL) },
+    [FIG_COUNTER_L1D_MISSES]    = { PERF_TYPE_HW_CACHE, CACHE_READ_MISS(PERF_COUNT_HW_CACHE_L1D) },
+    [FIG_COUNTER_BRANCH_MISSES] = { PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+
+static int
+open_event(uint32_t counter, int group)
+{
+    struct perf_event_attr attr;
+
+    memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = events[counter].type;
+    attr.config = events[counter].config;
+    attr.read_format = PERF_FORMAT_GROUP;
+    attr.disabled = group == -1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+/*
+ * Opens whichever counters the kernel and the container allow. The
+ * first one that opens leads the group so all of them are read with a
+ * single syscall. Returns a mask of the available counters, zero when
+ * perf events are not usable at all.
+ */
+
+uint32_t
+fig_perf_open(FigPerfCounters *counters)
+{
+    uint32_t mask = 0;
+    int fd;
+
+    counters->leader = -1;
+    counters->n_open = 0;
+
+    for (uint32_t i = 0; i < FIG_N_COUNTERS; i++) {
+        counters->fds[i] = -1;
+        counters->slot[i] = -1;
+
+        fd = open_event(i, counters->leader);
+        if (fd < 0)
+            continue;
+
+        if (counters->leader == -1)
+            counters->leader = fd;
+        counters->fds[i] = fd;
+        counters->slot[i] = counters->n_open++;
+        mask |= 1u << i;
+    }
+
+    if (counters->leader != -1) {
+        ioctl(counters->leader, PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+        ioctl(counters->leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+
+    return mask;
+}
+
+/* Fills values with running totals, unavailable counters read as zero */
+
+void
+fig_perf_read(FigPerfCounters *counters, uint64_t *values)
+{
+    uint64_t data[1 + FIG_N_COUNTERS];
+
+    memset(values, 0, FIG_N_COUNTERS * sizeof(uint64_t));
+    if (counters->leader == -1)
+        return;
+
+    if (read(counters->leader, data, sizeof data) < (ssize_t) sizeof(uint64_t))
+        return;
+
+    for (uint32_t i = 0; i < FIG_N_COUNTERS; i++)
+        if (counters->slot[i] >= 0 && (uint64_t) counters->slot[i] < data[0])
+            values[i] = data[1 + counters->slot[i]];
+}
+
+void
+fig_perf_close(FigPerfCounters *counters)
+{
+    for (uint32_t i = 0; i < FIG_N_COUNTERS; i++)
+        if (counters->fds[i] >= 0)
+            close(counters->fds[i]);
+
+    counters->leader = -1;
+    counters->n_open = 0;
+}
@@ -0,0 +1,27 @@
+/*
+ * File: perfcounters.h
+ * Desc: Thin wrapper over a perf_event_open group counting the calling
+ *       thread in user space.
+ */
+
+#ifndef _FIG_PERFCOUNTERS_H_
+#define _FIG_PERFCOUNTERS_H_
+
+#include <stdint.h>
+#include "profile.h"
+
+typedef struct
+{
+    int leader;
+    int fds[FIG_N_COUNTERS];
+
+    /* position of each counter in a group read, -1 when unavailable */
+    int slot[FIG_N_COUNTERS];
+    uint32_t n_open;
+} FigPerfCounters;
+
+uint32_t fig_perf_open  (FigPerfCounters *counters);
+void     fig_perf_read  (FigPerfCounters *counters, uint64_t *values);
+void     fig_perf_close (FigPerfCounters *counters);
+
+#endif /* _FIG_PERFCOUNTERS_H_ */
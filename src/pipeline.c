@@ -0,0 +1,176 @@
+#include <stdlib.h>
+#include "misc.h"
+#include "ring.h"
+#include "pipeline.h"
+
+struct PipelineSlot
+{
+    FigBuffer *buffer;
+    uint32_t worker;
+    uint32_t index;
+};
+
+struct PipelineWorker
+{
+    FigPipeline *pipeline;
+    uint32_t id;
+    pthread_t thread;
+
+    FigRing ready,
+            free;
+};
+
+static void *worker_main(void *data);
+static void  default_decode(const char *path, FigBuffer *buffer, void *data);
+
+FigPipeline *
+fig_pipeline_new(struct PipelineDesc *desc, const char **paths, uint32_t n_paths)
+{
+    FigPipeline *pipeline;
+    struct PipelineWorker *worker;
+    struct PipelineSlot *slot;
+
+    pipeline = malloc(sizeof *pipeline);
+    if (!pipeline)
+        fig_panic("failed allocating memory");
+
+    pipeline->desc = *desc;
+    pipeline->desc.n_workers = desc->n_workers ? desc->n_workers : 1;
+    pipeline->desc.depth = desc->depth > 2 ? desc->depth : 2;
+    if (!pipeline->desc.decode) {
+        pipeline->desc.decode = &default_decode;
+        pipeline->desc.decode_data = desc->preprocess;
+    }
+
+    pipeline->paths = paths;
+    pipeline->n_paths = n_paths;
+    pipeline->consumed = 0;
+
+    pipeline->workers = malloc(pipeline->desc.n_workers * sizeof(struct PipelineWorker));
+    pipeline->slots = malloc(pipeline->desc.n_workers * pipeline->desc.depth *
+                             sizeof(struct PipelineSlot));
+    if (!pipeline->workers || !pipeline->slots)
+        fig_panic("failed allocating memory");
+
+    for (uint32_t w = 0; w < pipeline->desc.n_workers; w++) {
+        worker = pipeline->workers + w;
+        worker->pipeline = pipeline;
+        worker->id = w;
+
+        /* one spare entry in free for the stop marker */
+        fig_ring_init(&worker->ready, pipeline->desc.depth);
+        fig_ring_init(&worker->free, pipeline->desc.depth + 1);
+
+        for (uint32_t d = 0; d < pipeline->desc.depth; d++) {
+            slot = pipeline->slots + w * pipeline->desc.depth + d;
+            slot->buffer = fig_buffer_new(desc->width, desc->height, desc->channels);
+            slot->worker = w;
+            slot->index = 0;
+            fig_ring_push(&worker->free, slot);
+        }
+    }
+
+    for (uint32_t w = 0; w < pipeline->desc.n_workers; w++)
+        if (pthread_create(&pipeline->workers[w].thread, NULL,
+                           &worker_main, pipeline->workers + w))
+            fig_panic("failed creating thread");
+
+    return pipeline;
+}
+
+/*
+ * Blocks until the next item in input order is decoded. Returns NULL
+ * once every item has been handed out. The buffer stays valid, and can
+ * be bound as a model input, until it is passed to fig_pipeline_release().
+ */
+
+FigBuffer *
+fig_pipeline_next(FigPipeline *pipeline, uint32_t *index)
+{
+    struct PipelineSlot *slot;
+    uint32_t w;
+
+    if (pipeline->consumed == pipeline->n_paths)
+        return NULL;
+
+    w = pipeline->consumed++ % pipeline->desc.n_workers;
+    slot = fig_ring_pop_wait(&pipeline->workers[w].ready);
+
+    if (index)
+        *index = slot->index;
+    return slot->buffer;
+}
+
+void
+fig_pipeline_release(FigPipeline *pipeline, FigBuffer *buffer)
+{
+    uint32_t n_slots = pipeline->desc.n_workers * pipeline->desc.depth;
+
+    for (uint32_t i = 0; i < n_slots; i++) {
+        struct PipelineSlot *slot = pipeline->slots + i;
+
+        if (slot->buffer == buffer) {
+            fig_ring_push(&pipeline->workers[slot->worker].free, slot);
+            return;
+        }
+    }
+
+    fig_panic("buffer does not belong to the pipeline");
+}
+
+/* Stops the workers, items that were not consumed yet are dropped */
+
+void
+fig_pipeline_destroy(FigPipeline *pipeline)
+{
+    uint32_t n_slots = pipeline->desc.n_workers * pipeline->desc.depth;
+
+    for (uint32_t w = 0; w < pipeline->desc.n_workers; w++)
+        fig_ring_push(&pipeline->workers[w].free, NULL);
+
+    for (uint32_t w = 0; w < pipeline->desc.n_workers; w++) {
+        pthread_join(pipeline->workers[w].thread, NULL);
+        fig_ring_release(&pipeline->workers[w].ready);
+        fig_ring_release(&pipeline->workers[w].free);
+    }
+
+    for (uint32_t i = 0; i < n_slots; i++)
+        fig_buffer_destroy(pipeline->slots[i].buffer);
+
+    free(pipeline->slots);
+    free(pipeline->workers);
+    free(pipeline);
+}
+
+static void *
+worker_main(void *data)
+{
+    struct PipelineWorker *worker = (struct PipelineWorker *) data;
+    FigPipeline *pipeline = worker->pipeline;
+    struct PipelineSlot *slot;
+
+    for (uint32_t i = worker->id; i < pipeline->n_paths; i += pipeline->desc.n_workers) {
+        slot = fig_ring_pop_wait(&worker->free);
+        if (!slot)
+            return NULL;
+
+        (*pipeline->desc.decode)(pipeline->paths[i], slot->buffer,
+                                 pipeline->desc.decode_data);
+        slot->index = i;
+
+        /* ready holds depth entries and we never own more than that */
+        fig_ring_push(&worker->ready, slot);
+    }
+
+    /* stay around until destroy so the free ring is not pushed to a dead thread */
+    while (fig_ring_pop_wait(&worker->free))
+        ;
+
+    return NULL;
+}
+
+static void
+default_decode(const char *path, FigBuffer *buffer, void *data)
+{
+    fig_image_read_into(path, buffer, (struct PreprocessDesc *) data);
+}
@@ -0,0 +1,57 @@
+#include <stdlib.h>
+#include "misc.h"
+#include "plan.h"
+
+/*
+ * Plans layers on their own pools, or as jobs of the given scheduler
+ * when there is one.
+ */
+
+FigPlan *
+fig_plan_new(FigList *layers, FigScheduler *scheduler, int priority)
+{
+    FigPlan *plan;
+    uint32_t index = 0;
+
+    plan = malloc(sizeof *plan);
+    if (!plan)
+        fig_panic("failed allocating memory");
+
+    /* one spare step, so an empty model still gets an allocation */
+    plan->n_steps = fig_list_length(layers);
+    plan->steps = aligned_alloc(64, (plan->n_steps + 1) * sizeof(FigPlanStep));
+    if (!plan->steps)
+        fig_panic("failed allocating memory");
+
+    fig_list_for_each(layers) {
+        fig_layer_plan((FigLayer *) item->data, scheduler, priority,
+                       plan->steps + index++);
+    }
+
+    return plan;
+}
+
+void
+fig_plan_step_run(FigPlanStep *step)
+{
+    if (step->scheduler) {
+        fig_scheduler_run(step->scheduler, step->priority, step->item, step,
+                          step->n_items);
+        return;
+    }
+
+    if (step->pool) {
+        fig_thread_pool_run(step->pool, step->item, step, step->n_items);
+        return;
+    }
+
+    for (uint32_t i = 0; i < step->n_items; i++)
+        (*step->item)(step, i);
+}
+
+void
+fig_plan_destroy(FigPlan *plan)
+{
+    free(plan->steps);
+    free(plan);
+}
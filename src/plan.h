@@ -0,0 +1,60 @@
+/*
+ * File: plan.h
+ * Desc: A model flattened into one contiguous array of steps, each with
+ *       its kernel, weights and split into pool work items resolved
+ *       ahead of time, so a forward pass is a loop over the array.
+ *
+ * Steps reach their buffers through their layer, whose kernels read the
+ * shapes from there, so rebinding the model input keeps the plan valid.
+ * Anything that changes a resolved field (pool, scheduler, weights,
+ * kernel) needs a new plan; the model drops its plan on every such change.
+ */
+
+#ifndef _FIG_PLAN_H_
+#define _FIG_PLAN_H_
+
+#include "conv_kernels.h"
+#include "list.h"
+#include "scheduler.h"
+
+typedef struct
+{
+    /* runs work item index of n_items, with the step as its argument */
+    FigTaskFunc item;
+    uint32_t n_items;
+
+    /* convolution output rows per item, items per image, rows per image */
+    uint32_t band,
+             bands,
+             height;
+
+    /* pool the items run on, NULL for the calling thread */
+    FigThreadPool *pool;
+
+    /* scheduler the items run on instead, and at which priority */
+    FigScheduler *scheduler;
+    int priority;
+
+    FigLayer *layer;
+
+    /* convolution kernel and the weights it is passed, packed for JIT kernels */
+    FigConvRows rows;
+    const float *weight,
+                *packed;
+} __attribute__((aligned(64))) FigPlanStep;
+
+typedef struct FigPlan
+{
+    FigPlanStep *steps;
+    uint32_t n_steps;
+} FigPlan;
+
+FigPlan *fig_plan_new      (FigList *layers, FigScheduler *scheduler, int priority);
+void     fig_plan_step_run (FigPlanStep *step);
+void     fig_plan_destroy  (FigPlan *plan);
+
+/* Resolves the step of one layer, defined with the kernels in layer.c */
+void     fig_layer_plan    (FigLayer *layer, FigScheduler *scheduler, int priority,
+                            FigPlanStep *step);
+
+#endif /* _FIG_PLAN_H_ */
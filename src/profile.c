@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "misc.h"
+#include "perfcounters.h"
+#include "profile.h"
+
+static uint64_t thread_id();
+
+static __thread uint64_t cached_thread_id;
+
+static const char *counter_names[FIG_N_COUNTERS] = {
+    "cycles", "instructions", "llc_misses", "l1d_misses", "branch_misses",
+};
+
+static const char *counter_headers[FIG_N_COUNTERS] = {
+    "cycles", "inst", "LLC/ki", "L1D/ki", "br/ki",
+};
+
+FigProfiler *
+fig_profiler_new(uint32_t capacity)
+{
+    FigProfiler *profiler;
+
+    profiler = malloc(sizeof *profiler);
+    if (!profiler)
+        fig_panic("failed allocating memory");
+
+    profiler->events = malloc(capacity * sizeof(FigProfileEvent));
+    if (!profiler->events)
+        fig_panic("failed allocating memory");
+
+    profiler->capacity = capacity;
+    profiler->n_events = 0;
+    profiler->dropped = 0;
+    profiler->runs = 0;
+    profiler->counter_mask = 0;
+    profiler->perf = NULL;
+
+    return profiler;
+}
+
+/*
+ * Starts reading hardware counters on the calling thread, which has to be
+ * the one running fig_model_forward(). Returns the mask of counters that
+ * could be opened; zero means timings only.
+ */
+
+uint32_t
+fig_profiler_enable_counters(FigProfiler *profiler)
+{
+    FigPerfCounters *perf;
+
+    if (profiler->perf)
+        return profiler->counter_mask;
+
+    perf = malloc(sizeof *perf);
+    if (!perf)
+        fig_panic("failed allocating memory");
+
+    profiler->counter_mask = fig_perf_open(perf);
+    if (!profiler->counter_mask) {
+        fig_warn("hardware counters unavailable, recording timings only");
+        free(perf);
+        return 0;
+    }
+
+    profiler->perf = perf;
+    return profiler->counter_mask;
+}
+
+uint32_t
+fig_profiler_events(FigProfiler *profiler, FigProfileEvent **events)
+{
+    *events = profiler->events;
+    return profiler->n_events;
+}
+
+void
+fig_profiler_reset(FigProfiler *profiler)
+{
+    profiler->n_events = 0;
+    profiler->dropped = 0;
+    profiler->runs = 0;
+}
+
+/*
+ * Writes the events in the Trace Event Format read by chrome://tracing
+ * and ui.perfetto.dev. Returns 0 on success and -1 if the file could not
+ * be written.
+ */
+
+int
+fig_profiler_write_trace(FigProfiler *profiler, const char *file_path)
+{
+    FILE *fp;
+    uint64_t origin = profiler->n_events ? profiler->events[0].start_ns : 0;
+    int pid = getpid();
+
+    if (!(fp = fopen(file_path, "w")))
+        return -1;
+
+    for (uint32_t i = 0; i < profiler->n_events; i++)
+        if (profiler->events[i].start_ns < origin)
+            origin = profiler->events[i].start_ns;
+
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    for (uint32_t i = 0; i < profiler->n_events; i++) {
+        FigProfileEvent *e = profiler->events + i;
+        double ts = (e->start_ns - origin) * 1e-3, dur = (e->end_ns - e->start_ns) * 1e-3;
+
+        if (e->layer_index == FIG_PROFILE_FORWARD) {
+            fprintf(fp, "%s{\"name\":\"forward\",\"cat\":\"model\",\"ph\":\"X\","
+                    "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%llu}",
+                    i ? ",\n" : "", ts, dur, pid, (unsigned long long) e->thread_id);
+            continue;
+        }
+
+        fprintf(fp, "%s{\"name\":\"%s %d\",\"cat\":\"layer\",\"ph\":\"X\","
+                "\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%llu,"
+                "\"args\":{\"index\":%d,\"kernel\":\"%s\","
+                "\"input\":\"%ux%ux%u\",\"output\":\"%ux%ux%u\"",
+                i ? ",\n" : "", fig_layer_type_name(e->type), e->layer_index,
+                ts, dur, pid, (unsigned long long) e->thread_id,
+                e->layer_index, e->kernel ? e->kernel : "",
+                e->in_width, e->in_height, e->in_channels,
+                e->out_width, e->out_height, e->out_channels);
+
+        for (uint32_t c = 0; c < FIG_N_COUNTERS; c++)
+            if (profiler->counter_mask & (1u << c))
+                fprintf(fp, ",\"%s\":%llu", counter_names[c],
+                        (unsigned long long) e->counters[c]);
+        fprintf(fp, "}}");
+    }
+    fprintf(fp, "\n]}\n");
+
+    if (fclose(fp))
+        return -1;
+    return 0;
+}
+
+/*
+ * Prints one line per layer with the mean time over all recorded runs
+ * and, when counters are enabled, IPC and misses per thousand
+ * instructions. A low IPC together with high LLC misses points at a
+ * memory bound layer, a high IPC at a compute bound one.
+ */
+
+void
+fig_profiler_print_summary(FigProfiler *profiler, FILE *fp)
+{
+    FigProfileEvent **first;
+    uint64_t *ns, *counters, *n, total = 0;
+    int32_t n_layers = 0;
+    uint32_t mask = profiler->counter_mask;
+
+    for (uint32_t i = 0; i < profiler->n_events; i++)
+        if (profiler->events[i].layer_index >= n_layers)
+            n_layers = profiler->events[i].layer_index + 1;
+
+    ns = calloc(n_layers + 1, sizeof(uint64_t));
+    n = calloc(n_layers + 1, sizeof(uint64_t));
+    first = calloc(n_layers + 1, sizeof *first);
+    counters = calloc((n_layers + 1) * FIG_N_COUNTERS, sizeof(uint64_t));
+    if (!ns || !n || !first || !counters)
+        fig_panic("failed allocating memory");
+
+    for (uint32_t i = 0; i < profiler->n_events; i++) {
+        FigProfileEvent *e = profiler->events + i;
+
+        if (e->layer_index == FIG_PROFILE_FORWARD)
+            continue;
+        if (!first[e->layer_index])
+            first[e->layer_index] = e;
+        ns[e->layer_index] += e->end_ns - e->start_ns;
+        n[e->layer_index]++;
+        total += e->end_ns - e->start_ns;
+        for (uint32_t c = 0; c < FIG_N_COUNTERS; c++)
+            counters[e->layer_index * FIG_N_COUNTERS + c] += e->counters[c];
+    }
+
+    fprintf(fp, "%5s  %-14s  %-14s  %10s  %6s", "layer", "type", "kernel",
+            "mean ms", "share");
+    if (mask & (1u << FIG_COUNTER_CYCLES) && mask & (1u << FIG_COUNTER_INSTRUCTIONS))
+        fprintf(fp, "  %6s", "IPC");
+    for (uint32_t c = FIG_COUNTER_LLC_MISSES; c < FIG_N_COUNTERS; c++)
+        if (mask & (1u << c) && mask & (1u << FIG_COUNTER_INSTRUCTIONS))
+            fprintf(fp, "  %8s", counter_headers[c]);
+    fprintf(fp, "\n");
+
+    for (int32_t l = 0; l < n_layers; l++) {
+        uint64_t *lc = counters + l * FIG_N_COUNTERS;
+        double kinst = lc[FIG_COUNTER_INSTRUCTIONS] * 1e-3;
+
+        if (!n[l])
+            continue;
+
+        fprintf(fp, "%5d  %-14s  %-14s  %10.3f  %5.1f%%", l,
+                fig_layer_type_name(first[l]->type),
+                first[l]->kernel ? first[l]->kernel : "",
+                ns[l] * 1e-6 / n[l], total ? 100.0 * ns[l] / total : 0.0);
+
+        if (mask & (1u << FIG_COUNTER_CYCLES) && mask & (1u << FIG_COUNTER_INSTRUCTIONS))
+            fprintf(fp, "  %6.2f", lc[FIG_COUNTER_CYCLES] ?
+                    (double) lc[FIG_COUNTER_INSTRUCTIONS] / lc[FIG_COUNTER_CYCLES] : 0.0);
+        for (uint32_t c = FIG_COUNTER_LLC_MISSES; c < FIG_N_COUNTERS; c++)
+            if (mask & (1u << c) && mask & (1u << FIG_COUNTER_INSTRUCTIONS))
+                fprintf(fp, "  %8.2f", kinst > 0 ? lc[c] / kinst : 0.0);
+        fprintf(fp, "\n");
+    }
+
+    if (!mask)
+        fprintf(fp, "(hardware counters not enabled)\n");
+
+    free(ns);
+    free(n);
+    free(first);
+    free(counters);
+}
+
+void
+fig_profiler_destroy(FigProfiler *profiler)
+{
+    if (profiler->perf) {
+        fig_perf_close(profiler->perf);
+        free(profiler->perf);
+    }
+    free(profiler->events);
+    free(profiler);
+}
+
+uint64_t
+fig_profiler_now()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void
+fig_profiler_sample(FigProfiler *profiler, FigProfileSample *sample)
+{
+    if (profiler->perf)
+        fig_perf_read(profiler->perf, sample->counters);
+    sample->ns = fig_profiler_now();
+}
+
+/* A NULL layer records the span of a whole forward pass */
+
+void
+fig_profiler_record(FigProfiler *profiler, FigLayer *layer, int32_t layer_index,
+                    const FigProfileSample *start, const FigProfileSample *end)
+{
+    FigProfileEvent *e;
+
+    if (!layer)
+        profiler->runs++;
+
+    if (profiler->n_events == profiler->capacity) {
+        profiler->dropped++;
+        return;
+    }
+
+    e = profiler->events + profiler->n_events++;
+    e->layer_index = layer_index;
+    e->start_ns = start->ns;
+    e->end_ns = end->ns;
+    e->thread_id = thread_id();
+
+    for (uint32_t c = 0; c < FIG_N_COUNTERS; c++)
+        e->counters[c] = profiler->perf ? end->counters[c] - start->counters[c] : 0;
+
+    if (!layer) {
+        e->type = -1;
+        e->kernel = NULL;
+        e->in_width = e->in_height = e->in_channels = 0;
+        e->out_width = e->out_height = e->out_channels = 0;
+        return;
+    }
+
+    e->type = layer->type;
+    e->kernel = layer->kernel;
+    e->in_width = layer->in_buffer->width;
+    e->in_height = layer->in_buffer->height;
+    e->in_channels = layer->in_buffer->channels;
+    e->out_width = layer->out_buffer->width;
+    e->out_height = layer->out_buffer->height;
+    e->out_channels = layer->out_buffer->channels;
+}
+
+static uint64_t
+thread_id()
+{
+    if (!cached_thread_id)
+        cached_thread_id = (uint64_t) syscall(SYS_gettid);
+    return cached_thread_id;
+}
@@ -0,0 +1,439 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "misc.h"
+#include "simd.h"
+#include "resize.h"
+
+#define BILINEAR_BITS FIG_RESIZE_BILINEAR_BITS
+#define BILINEAR_ONE  (1 << BILINEAR_BITS)
+#define AREA_BITS     14
+#define AREA_ONE      (1 << AREA_BITS)
+
+/* Below this many output bytes a frame is resized on the calling thread */
+#define MIN_PARALLEL_SIZE (64 * 1024)
+
+struct ResizeJob
+{
+    FigResizer *resizer;
+
+    const uint8_t *src;
+    size_t src_stride;
+
+    uint8_t *dst;
+    size_t dst_stride;
+
+    uint32_t band_rows;
+};
+
+static void     bilinear_table(uint32_t src_size, uint32_t dst_size, uint32_t i,
+                               uint32_t *first, uint16_t *weight);
+static uint32_t area_table(uint32_t src_size, uint32_t dst_size, uint32_t *start,
+                           uint32_t *taps, uint16_t **weight);
+static uint32_t bilinear_taps(uint32_t src_size, uint32_t dst_size, uint32_t *start,
+                              uint32_t *taps, uint16_t **weight);
+static void     bilinear_band(void *arg, uint32_t band);
+static void     area_band(void *arg, uint32_t band);
+static void     bilinear_row(FigResizer *resizer, const uint8_t *src, uint32_t step,
+                             uint16_t *dst);
+static void     area_row(FigResizer *resizer, const uint8_t *src, uint16_t *dst);
+
+FigResizer *
+fig_resizer_new(uint32_t src_w, uint32_t src_h, uint32_t dst_w, uint32_t dst_h,
+                uint32_t channels, int filter)
+{
+    FigResizer *resizer;
+    int x_filter = filter, y_filter = filter;
+    uint32_t first, row_len = dst_w * channels;
+    uint16_t weight;
+
+    if (!src_w || !src_h || !dst_w || !dst_h || !channels)
+        fig_panic("resizing needs non empty images");
+
+    resizer = calloc(1, sizeof *resizer);
+    if (!resizer)
+        fig_panic("failed allocating memory");
+
+    resizer->src_w = src_w;
+    resizer->src_h = src_h;
+    resizer->dst_w = dst_w;
+    resizer->dst_h = dst_h;
+    resizer->channels = channels;
+
+    /* area on an axis that does not shrink would turn it into nearest neighbour */
+    if (filter == FIG_RESIZE_AUTO) {
+        x_filter = src_w >= 2 * dst_w ? FIG_RESIZE_AREA : FIG_RESIZE_BILINEAR;
+        y_filter = src_h >= 2 * dst_h ? FIG_RESIZE_AREA : FIG_RESIZE_BILINEAR;
+    }
+    filter = x_filter == FIG_RESIZE_AREA || y_filter == FIG_RESIZE_AREA ?
+        FIG_RESIZE_AREA : FIG_RESIZE_BILINEAR;
+    resizer->filter = filter;
+
+    /* two resized rows, or an accumulator and a resized row, rounded to cache lines */
+    resizer->band_scratch = filter == FIG_RESIZE_AREA ?
+        row_len * (sizeof(uint32_t) + sizeof(uint16_t)) : 2 * row_len * sizeof(uint16_t);
+    resizer->band_scratch = (resizer->band_scratch + 63) & ~(size_t) 63;
+
+    if (filter == FIG_RESIZE_AREA) {
+        resizer->x_start = malloc(dst_w * sizeof(uint32_t));
+        resizer->x_taps = malloc(dst_w * sizeof(uint32_t));
+        resizer->y_start = malloc(dst_h * sizeof(uint32_t));
+        resizer->y_taps = malloc(dst_h * sizeof(uint32_t));
+        if (!resizer->x_start || !resizer->x_taps ||
+            !resizer->y_start || !resizer->y_taps)
+            fig_panic("failed allocating memory");
+
+        resizer->x_max_taps = (x_filter == FIG_RESIZE_AREA ? &area_table : &bilinear_taps)
+            (src_w, dst_w, resizer->x_start, resizer->x_taps, &resizer->x_tap_weight);
+        resizer->y_max_taps = (y_filter == FIG_RESIZE_AREA ? &area_table : &bilinear_taps)
+            (src_h, dst_h, resizer->y_start, resizer->y_taps, &resizer->y_tap_weight);
+        return resizer;
+    }
+
+    resizer->x_offset = malloc(dst_w * channels * sizeof(uint32_t));
+    resizer->x_weight = malloc(dst_w * channels * sizeof(uint16_t));
+    resizer->y0 = malloc(dst_h * sizeof(uint32_t));
+    resizer->y1 = malloc(dst_h * sizeof(uint32_t));
+    resizer->y_weight = malloc(dst_h * sizeof(uint16_t));
+    if (!resizer->x_offset || !resizer->x_weight ||
+        !resizer->y0 || !resizer->y1 || !resizer->y_weight)
+        fig_panic("failed allocating memory");
+
+    /* expanded per channel so the horizontal pass is one flat loop */
+    for (uint32_t x = 0; x < dst_w; x++) {
+        bilinear_table(src_w, dst_w, x, &first, &weight);
+        for (uint32_t c = 0; c < channels; c++) {
+            resizer->x_offset[x * channels + c] = first * channels + c;
+            resizer->x_weight[x * channels + c] = weight;
+        }
+    }
+
+    for (uint32_t y = 0; y < dst_h; y++) {
+        bilinear_table(src_h, dst_h, y, &first, &weight);
+        resizer->y0[y] = first;
+        resizer->y1[y] = src_h > 1 ? first + 1 : first;
+        resizer->y_weight[y] = weight;
+    }
+
+    return resizer;
+}
+
+/*
+ * Resizes one frame. Output rows are split into bands run on pool, or on
+ * the calling thread when pool is NULL or the frame is small. Each band
+ * builds its own horizontally resized source rows in its slice of the
+ * resizer's scratch, so bands share nothing but the read only tables.
+ */
+
+void
+fig_resizer_run(FigResizer *resizer, const uint8_t *src, size_t src_stride,
+                uint8_t *dst, size_t dst_stride, FigThreadPool *pool)
+{
+    struct ResizeJob job = { resizer, src, src_stride, dst, dst_stride, resizer->dst_h };
+    uint32_t n_bands = 1;
+    FigTaskFunc func = resizer->filter == FIG_RESIZE_AREA ? &area_band : &bilinear_band;
+
+    if (pool && (size_t) resizer->dst_w * resizer->dst_h * resizer->channels >= MIN_PARALLEL_SIZE) {
+        n_bands = 4 * fig_thread_pool_size(pool);
+        n_bands = n_bands > resizer->dst_h ? resizer->dst_h : n_bands;
+        job.band_rows = (resizer->dst_h + n_bands - 1) / n_bands;
+        n_bands = (resizer->dst_h + job.band_rows - 1) / job.band_rows;
+    }
+
+    if (n_bands > resizer->scratch_bands) {
+        free(resizer->scratch);
+        resizer->scratch = aligned_alloc(64, n_bands * resizer->band_scratch);
+        if (!resizer->scratch)
+            fig_panic("failed allocating memory");
+        resizer->scratch_bands = n_bands;
+    }
+
+    if (n_bands > 1)
+        fig_thread_pool_run(pool, func, &job, n_bands);
+    else
+        (*func)(&job, 0);
+}
+
+/*
+ * Horizontal pass of a bilinear resizer over one source row, into
+ * dst_w * channels values with FIG_RESIZE_BILINEAR_BITS fractional bits,
+ * for callers running their own vertical pass. A single channel resizer
+ * can read samples step bytes apart, such as one of the interleaved
+ * planes of NV12 chroma; others take step 1.
+ */
+
+void
+fig_resizer_row(FigResizer *resizer, const uint8_t *src, uint32_t step, uint16_t *dst)
+{
+    if (resizer->filter != FIG_RESIZE_BILINEAR)
+        fig_panic("resizer rows need a bilinear resizer");
+    if (step != 1 && resizer->channels != 1)
+        fig_panic("only single channel rows can be read with a step");
+
+    bilinear_row(resizer, src, step, dst);
+}
+
+void
+fig_resizer_destroy(FigResizer *resizer)
+{
+    free(resizer->x_offset);
+    free(resizer->x_weight);
+    free(resizer->y0);
+    free(resizer->y1);
+    free(resizer->y_weight);
+    free(resizer->x_start);
+    free(resizer->x_taps);
+    free(resizer->y_start);
+    free(resizer->y_taps);
+    free(resizer->x_tap_weight);
+    free(resizer->y_tap_weight);
+    free(resizer->scratch);
+    free(resizer);
+}
+
+/*
+ * Pixel centres are aligned (OpenCV INTER_LINEAR). The last source pixel
+ * is reached as the second tap of its left neighbour with full weight,
+ * so the second tap is always inside the image.
+ */
+
+static void
+bilinear_table(uint32_t src_size, uint32_t dst_size, uint32_t i,
+               uint32_t *first, uint16_t *weight)
+{
+    float f = (i + 0.5f) * src_size / dst_size - 0.5f;
+    uint32_t w;
+
+    f = f < 0 ? 0 : f;
+    f = f > src_size - 1 ? src_size - 1 : f;
+
+    *first = (uint32_t) f;
+    w = (uint32_t) lrintf((f - *first) * BILINEAR_ONE);
+    if (w == BILINEAR_ONE) {
+        (*first)++;
+        w = 0;
+    }
+
+    if (src_size == 1) {
+        *first = 0;
+        w = 0;
+    } else if (*first == src_size - 1) {
+        (*first)--;
+        w = BILINEAR_ONE;
+    }
+
+    *weight = (uint16_t) w;
+}
+
+/*
+ * Output pixel i averages the source interval [i * s, (i + 1) * s) with
+ * s = src_size / dst_size. Each tap is weighted by its coverage, and
+ * rounding is pushed into the largest tap so every row sums to one.
+ */
+
+static uint32_t
+area_table(uint32_t src_size, uint32_t dst_size, uint32_t *start,
+           uint32_t *taps, uint16_t **weight)
+{
+    double scale = (double) src_size / dst_size;
+    uint32_t max_taps = (uint32_t) ceil(scale) + 1;
+
+    *weight = calloc((size_t) dst_size * max_taps, sizeof(uint16_t));
+    if (!*weight)
+        fig_panic("failed allocating memory");
+
+    for (uint32_t i = 0; i < dst_size; i++) {
+        double lo = i * scale, hi = (i + 1) * scale;
+        uint32_t end = (uint32_t) ceil(hi - 1e-9);
+        uint16_t *w = *weight + (size_t) i * max_taps;
+        int32_t sum = 0, largest = 0;
+
+        start[i] = (uint32_t) floor(lo);
+        end = end > src_size ? src_size : end;
+        end = end <= start[i] ? start[i] + 1 : end;
+        taps[i] = end - start[i];
+
+        for (uint32_t t = 0; t < taps[i]; t++) {
+            double a = fmax(lo, start[i] + t), b = fmin(hi, start[i] + t + 1.0);
+
+            w[t] = (uint16_t) lrint((b - a) / scale * AREA_ONE);
+            sum += w[t];
+            largest = w[t] > w[largest] ? t : largest;
+        }
+        w[largest] += AREA_ONE - sum;
+    }
+
+    return max_taps;
+}
+
+/* The bilinear weights of bilinear_table() as two taps in area tables */
+
+static uint32_t
+bilinear_taps(uint32_t src_size, uint32_t dst_size, uint32_t *start,
+              uint32_t *taps, uint16_t **weight)
+{
+    *weight = calloc((size_t) dst_size * 2, sizeof(uint16_t));
+    if (!*weight)
+        fig_panic("failed allocating memory");
+
+    for (uint32_t i = 0; i < dst_size; i++) {
+        uint16_t *w = *weight + (size_t) i * 2;
+        uint16_t w1;
+
+        bilinear_table(src_size, dst_size, i, &start[i], &w1);
+        taps[i] = src_size > 1 ? 2 : 1;
+        w[1] = src_size > 1 ? w1 << (AREA_BITS - BILINEAR_BITS) : 0;
+        w[0] = AREA_ONE - w[1];
+    }
+
+    return 2;
+}
+
+static void
+bilinear_band(void *arg, uint32_t band)
+{
+    struct ResizeJob *job = (struct ResizeJob *) arg;
+    FigResizer *resizer = job->resizer;
+    uint32_t row_len = resizer->dst_w * resizer->channels;
+    uint32_t row_v = row_len & ~(FIG_V8_WIDTH - 1);
+    uint32_t y_end = (band + 1) * job->band_rows;
+    int64_t tag[2] = { -1, -1 };
+    uint16_t *rows[2];
+
+    y_end = y_end > resizer->dst_h ? resizer->dst_h : y_end;
+
+    rows[0] = (uint16_t *) (resizer->scratch + band * resizer->band_scratch);
+    rows[1] = rows[0] + row_len;
+
+    for (uint32_t y = band * job->band_rows; y < y_end; y++) {
+        uint32_t y0 = resizer->y0[y], y1 = resizer->y1[y];
+        uint32_t wy = resizer->y_weight[y], i;
+
+        /* consecutive source rows land in different slots */
+        if (tag[y0 & 1] != y0) {
+            bilinear_row(resizer, job->src + y0 * job->src_stride, 1, rows[y0 & 1]);
+            tag[y0 & 1] = y0;
+        }
+        if (tag[y1 & 1] != y1) {
+            bilinear_row(resizer, job->src + y1 * job->src_stride, 1, rows[y1 & 1]);
+            tag[y1 & 1] = y1;
+        }
+
+        const uint16_t *top = rows[y0 & 1], *bottom = rows[y1 & 1];
+        uint8_t *dst = job->dst + y * job->dst_stride;
+        fig_v8u32 a, b;
+
+        for (i = 0; i < row_v; i += FIG_V8_WIDTH) {
+            a = __builtin_convertvector(fig_v8u16_load(top + i), fig_v8u32);
+            b = __builtin_convertvector(fig_v8u16_load(bottom + i), fig_v8u32);
+            a = (a * (BILINEAR_ONE - wy) + b * wy + (1 << (2 * BILINEAR_BITS - 1)))
+                >> (2 * BILINEAR_BITS);
+            fig_v8u8_store(dst + i, __builtin_convertvector(a, fig_v8u8));
+        }
+        for (; i < row_len; i++)
+            dst[i] = (top[i] * (BILINEAR_ONE - wy) + bottom[i] * wy +
+                      (1 << (2 * BILINEAR_BITS - 1))) >> (2 * BILINEAR_BITS);
+    }
+}
+
+static void
+area_band(void *arg, uint32_t band)
+{
+    struct ResizeJob *job = (struct ResizeJob *) arg;
+    FigResizer *resizer = job->resizer;
+    uint32_t row_len = resizer->dst_w * resizer->channels;
+    uint32_t row_v = row_len & ~(FIG_V8_WIDTH - 1);
+    uint32_t y_end = (band + 1) * job->band_rows;
+    uint16_t *row;
+    uint32_t *acc;
+
+    y_end = y_end > resizer->dst_h ? resizer->dst_h : y_end;
+
+    acc = (uint32_t *) (resizer->scratch + band * resizer->band_scratch);
+    row = (uint16_t *) (acc + row_len);
+
+    for (uint32_t y = band * job->band_rows; y < y_end; y++) {
+        const uint16_t *weight = resizer->y_tap_weight + (size_t) y * resizer->y_max_taps;
+        uint8_t *dst = job->dst + y * job->dst_stride;
+        uint32_t i;
+
+        memset(acc, 0, row_len * sizeof(uint32_t));
+        for (uint32_t t = 0; t < resizer->y_taps[y]; t++) {
+            uint32_t w = weight[t];
+
+            area_row(resizer, job->src + (resizer->y_start[y] + t) * job->src_stride, row);
+            for (i = 0; i < row_v; i += FIG_V8_WIDTH) {
+                fig_v8u32 a;
+
+                memcpy(&a, acc + i, sizeof a);
+                a += __builtin_convertvector(fig_v8u16_load(row + i), fig_v8u32) * w;
+                memcpy(acc + i, &a, sizeof a);
+            }
+            for (; i < row_len; i++)
+                acc[i] += row[i] * w;
+        }
+
+        for (i = 0; i < row_v; i += FIG_V8_WIDTH) {
+            fig_v8u32 a;
+
+            memcpy(&a, acc + i, sizeof a);
+            a = (a + (1 << (AREA_BITS + BILINEAR_BITS - 1))) >> (AREA_BITS + BILINEAR_BITS);
+            fig_v8u8_store(dst + i, __builtin_convertvector(a, fig_v8u8));
+        }
+        for (; i < row_len; i++)
+            dst[i] = (acc[i] + (1 << (AREA_BITS + BILINEAR_BITS - 1))) >>
+                (AREA_BITS + BILINEAR_BITS);
+    }
+}
+
+/*
+ * One source row to 16 bit values with BILINEAR_BITS fractional bits.
+ * Source elements are step bytes apart, 1 for packed rows.
+ */
+
+static void
+bilinear_row(FigResizer *resizer, const uint8_t *src, uint32_t step, uint16_t *dst)
+{
+    uint32_t row_len = resizer->dst_w * resizer->channels;
+    uint32_t row_v = row_len & ~(FIG_V8_WIDTH - 1);
+    uint32_t next = (resizer->src_w > 1 ? resizer->channels : 0) * step;
+    const uint32_t *offset = resizer->x_offset;
+    const uint16_t *weight = resizer->x_weight;
+    fig_v8u16 p, q, w;
+    uint32_t i;
+
+    for (i = 0; i < row_v; i += FIG_V8_WIDTH) {
+        for (uint32_t l = 0; l < FIG_V8_WIDTH; l++) {
+            p[l] = src[step * offset[i + l]];
+            q[l] = src[step * offset[i + l] + next];
+        }
+        w = fig_v8u16_load(weight + i);
+        fig_v8u16_store(dst + i, p * (BILINEAR_ONE - w) + q * w);
+    }
+    for (; i < row_len; i++)
+        dst[i] = src[step * offset[i]] * (BILINEAR_ONE - weight[i]) +
+                 src[step * offset[i] + next] * weight[i];
+}
+
+/* Same output format as bilinear_row, from AREA_BITS weights */
+
+static void
+area_row(FigResizer *resizer, const uint8_t *src, uint16_t *dst)
+{
+    uint32_t channels = resizer->channels;
+
+    for (uint32_t x = 0; x < resizer->dst_w; x++) {
+        const uint16_t *weight = resizer->x_tap_weight + (size_t) x * resizer->x_max_taps;
+        const uint8_t *p = src + resizer->x_start[x] * channels;
+        uint32_t taps = resizer->x_taps[x];
+
+        for (uint32_t c = 0; c < channels; c++) {
+            uint32_t acc = 0;
+
+            for (uint32_t t = 0; t < taps; t++)
+                acc += p[t * channels + c] * weight[t];
+            dst[x * channels + c] = (acc + (1 << (AREA_BITS - BILINEAR_BITS - 1))) >>
+                (AREA_BITS - BILINEAR_BITS);
+        }
+    }
+}
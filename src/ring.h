@@ -0,0 +1,140 @@
+/*
+ * File: ring.h
+ * Desc: Bounded single producer, single consumer ring of pointers.
+ *       Push and pop are lock free. The blocking variants spin for a
+ *       while and then sleep on a futex, so an idle side costs nothing.
+ */
+
+#ifndef _FIG_RING_H_
+#define _FIG_RING_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "misc.h"
+
+#define FIG_RING_SPIN 256
+
+#if defined(__x86_64__) || defined(__i386__)
+#   define fig_cpu_relax() __builtin_ia32_pause()
+#else
+#   define fig_cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+typedef struct
+{
+    void **slots;
+    uint32_t mask;
+
+    /* consumer and producer positions on their own cache lines */
+    uint32_t head __attribute__((aligned(64)));
+    uint32_t head_waiters;
+
+    uint32_t tail __attribute__((aligned(64)));
+    uint32_t tail_waiters;
+} FigRing;
+
+static inline void
+fig_ring_init(FigRing *ring, uint32_t capacity)
+{
+    uint32_t size = 1;
+
+    while (size < capacity)
+        size <<= 1;
+
+    ring->slots = malloc(size * sizeof(void *));
+    if (!ring->slots)
+        fig_panic("failed allocating memory");
+
+    ring->mask = size - 1;
+    ring->head = 0;
+    ring->head_waiters = 0;
+    ring->tail = 0;
+    ring->tail_waiters = 0;
+}
+
+static inline void
+fig_ring_release(FigRing *ring)
+{
+    free(ring->slots);
+}
+
+static inline bool
+fig_ring_push(FigRing *ring, void *item)
+{
+    uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+    if (tail - __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) > ring->mask)
+        return false;
+
+    ring->slots[tail & ring->mask] = item;
+    __atomic_store_n(&ring->tail, tail + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&ring->tail_waiters, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &ring->tail, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+
+    return true;
+}
+
+static inline bool
+fig_ring_pop(FigRing *ring, void **item)
+{
+    uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+
+    if (head == __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE))
+        return false;
+
+    *item = ring->slots[head & ring->mask];
+    __atomic_store_n(&ring->head, head + 1, __ATOMIC_SEQ_CST);
+
+    if (__atomic_load_n(&ring->head_waiters, __ATOMIC_SEQ_CST))
+        syscall(SYS_futex, &ring->head, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+
+    return true;
+}
+
+/*
+ * Sleeps until *position moves away from seen. The waiter count is
+ * raised before the final check, which pairs with the sequentially
+ * consistent store and load in push and pop.
+ */
+
+static inline void
+fig_ring_wait(uint32_t *position, uint32_t *waiters, uint32_t seen)
+{
+    for (int i = 0; i < FIG_RING_SPIN; i++) {
+        if (__atomic_load_n(position, __ATOMIC_ACQUIRE) != seen)
+            return;
+        fig_cpu_relax();
+    }
+
+    __atomic_add_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(position, __ATOMIC_SEQ_CST) == seen)
+        syscall(SYS_futex, position, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+    __atomic_sub_fetch(waiters, 1, __ATOMIC_SEQ_CST);
+}
+
+static inline void *
+fig_ring_pop_wait(FigRing *ring)
+{
+    void *item;
+
+    while (!fig_ring_pop(ring, &item))
+        fig_ring_wait(&ring->tail, &ring->tail_waiters,
+                      __atomic_load_n(&ring->head, __ATOMIC_RELAXED));
+    return item;
+}
+
+static inline void
+fig_ring_push_wait(FigRing *ring, void *item)
+{
+    while (!fig_ring_push(ring, item))
+        fig_ring_wait(&ring->head, &ring->head_waiters,
+                      __atomic_load_n(&ring->tail, __ATOMIC_RELAXED) - ring->mask - 1);
+}
+
+#endif /* _FIG_RING_H_ */
@@ -0,0 +1,395 @@
+#define _GNU_SOURCE
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include "misc.h"
+#include "scheduler.h"
+
+/* Tiles of a job first meant for one thread, alone on its cache line */
+struct JobRange
+{
+    uint32_t next,
+             end;
+} __attribute__((aligned(64)));
+
+struct SchedulerJob
+{
+    FigTaskFunc func;
+    void *arg;
+    uint32_t n_tasks;
+    int priority;
+
+    /* one per worker, then one shared by the callers */
+    struct JobRange *ranges;
+    uint32_t finished;
+
+    /* threads inside the job and its place in the lists, guarded by lock */
+    uint32_t active;
+    bool listed;
+    struct SchedulerJob *next;
+};
+
+static void *worker_main(void *data);
+static bool  work(FigScheduler *scheduler, struct SchedulerJob *job, uint32_t self);
+static uint32_t claim(struct SchedulerJob *job, uint32_t self, uint32_t n_ranges);
+static bool  preempted(FigScheduler *scheduler, int priority);
+static struct SchedulerJob *first_job(FigScheduler *scheduler, int below);
+static void  list_job(FigScheduler *scheduler, struct SchedulerJob *job);
+static void  unlist_job(FigScheduler *scheduler, struct SchedulerJob *job);
+static void  check_priority(int priority);
+static uint64_t now_ns();
+
+/* Set while a thread executes a tile, nested loops then run inline */
+static __thread int in_task;
+
+FigScheduler *
+fig_scheduler_new(const struct SchedulerDesc *desc)
+{
+    FigScheduler *scheduler;
+    uint32_t n_threads = desc->n_threads;
+
+    if (!n_threads) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = n > 0 ? (uint32_t) n : 1;
+    }
+    if (desc->cpus && !desc->n_cpus)
+        fig_panic("scheduler CPU list is empty");
+
+    scheduler = malloc(sizeof *scheduler);
+    if (!scheduler)
+        fig_panic("failed allocating memory");
+
+    /* the thread of each inference runs tiles of its own jobs */
+    scheduler->n_threads = n_threads;
+    scheduler->max_inferences = desc->max_inferences;
+    scheduler->threads = malloc((n_threads - 1) * sizeof(pthread_t) + 1);
+    if (!scheduler->threads)
+        fig_panic("failed allocating memory");
+    scheduler->started = 0;
+
+    pthread_mutex_init(&scheduler->lock, NULL);
+    pthread_cond_init(&scheduler->wake, NULL);
+    pthread_cond_init(&scheduler->done, NULL);
+    pthread_cond_init(&scheduler->admit, NULL);
+
+    for (int c = 0; c < FIG_PRIORITY_CLASSES; c++) {
+        scheduler->jobs[c] = NULL;
+        scheduler->listed[c] = 0;
+        scheduler->waiting[c] = 0;
+        fig_histogram_init(&scheduler->admission_wait[c]);
+    }
+    scheduler->running = 0;
+    scheduler->quit = 0;
+
+    for (uint32_t i = 0; i + 1 < n_threads; i++) {
+        pthread_attr_t attr;
+        cpu_set_t set;
+
+        pthread_attr_init(&attr);
+        if (desc->cpus) {
+            CPU_ZERO(&set);
+            CPU_SET(desc->cpus[(i + 1) % desc->n_cpus], &set);
+            pthread_attr_setaffinity_np(&attr, sizeof set, &set);
+        }
+
+        if (pthread_create(&scheduler->threads[i], &attr, &worker_main, scheduler))
+            fig_panic("failed creating thread");
+        pthread_attr_destroy(&attr);
+    }
+
+    return scheduler;
+}
+
+/* Threads a job may run on at once, the width plans split layers for */
+
+uint32_t
+fig_scheduler_size(FigScheduler *scheduler)
+{
+    return scheduler->n_threads;
+}
+
+/*
+ * Waits until the calling inference may run: fewer than max_inferences
+ * are running and no inference of a higher class is waiting. Pair with
+ * fig_scheduler_leave() once the inference is done.
+ */
+
+void
+fig_scheduler_admit(FigScheduler *scheduler, int priority)
+{
+    uint64_t start = now_ns();
+
+    check_priority(priority);
+
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->waiting[priority]++;
+    for (;;) {
+        bool ahead = false;
+
+        for (int c = 0; c < priority; c++)
+            ahead |= scheduler->waiting[c] > 0;
+        if (!scheduler->max_inferences ||
+            (scheduler->running < scheduler->max_inferences && !ahead))
+            break;
+        pthread_cond_wait(&scheduler->admit, &scheduler->lock);
+    }
+    scheduler->waiting[priority]--;
+    scheduler->running++;
+    pthread_mutex_unlock(&scheduler->lock);
+
+    fig_histogram_record(&scheduler->admission_wait[priority], now_ns() - start);
+}
+
+void
+fig_scheduler_leave(FigScheduler *scheduler)
+{
+    pthread_mutex_lock(&scheduler->lock);
+    if (!scheduler->running)
+        fig_panic("scheduler left without being admitted");
+    scheduler->running--;
+    pthread_cond_broadcast(&scheduler->admit);
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+/*
+ * Calls func(arg, i) for every i below n_tasks on the scheduler's
+ * workers and the calling thread, and returns once all calls have
+ * finished. Any number of threads may run jobs at once. While its job
+ * waits behind higher priority work, the caller helps with that work.
+ */
+
+void
+fig_scheduler_run(FigScheduler *scheduler, int priority, FigTaskFunc func,
+                  void *arg, uint32_t n_tasks)
+{
+    uint32_t n_ranges = scheduler->n_threads;
+    struct JobRange ranges[n_ranges];
+    struct SchedulerJob job;
+
+    if (!n_tasks)
+        return;
+    check_priority(priority);
+
+    if (in_task || n_ranges == 1 || n_tasks == 1) {
+        for (uint32_t i = 0; i < n_tasks; i++)
+            (*func)(arg, i);
+        return;
+    }
+
+    for (uint32_t r = 0; r < n_ranges; r++) {
+        ranges[r].next = (uint64_t) n_tasks * r / n_ranges;
+        ranges[r].end = (uint64_t) n_tasks * (r + 1) / n_ranges;
+    }
+    job.func = func;
+    job.arg = arg;
+    job.n_tasks = n_tasks;
+    job.priority = priority;
+    job.ranges = ranges;
+    job.finished = 0;
+    job.active = 0;
+    job.listed = false;
+    job.next = NULL;
+
+    pthread_mutex_lock(&scheduler->lock);
+    list_job(scheduler, &job);
+
+    for (;;) {
+        struct SchedulerJob *target;
+
+        if (__atomic_load_n(&job.finished, __ATOMIC_ACQUIRE) == n_tasks &&
+            !job.active)
+            break;
+
+        target = first_job(scheduler, priority);
+        if (!target && job.listed)
+            target = &job;
+        if (!target) {
+            pthread_cond_wait(&scheduler->done, &scheduler->lock);
+            continue;
+        }
+
+        target->active++;
+        pthread_mutex_unlock(&scheduler->lock);
+
+        bool exhausted = work(scheduler, target, n_ranges - 1);
+
+        pthread_mutex_lock(&scheduler->lock);
+        if (exhausted && target->listed)
+            unlist_job(scheduler, target);
+        if (!--target->active)
+            pthread_cond_broadcast(&scheduler->done);
+    }
+
+    /* the last tiles may have been run by threads pre-empted right after */
+    if (job.listed)
+        unlist_job(scheduler, &job);
+    pthread_mutex_unlock(&scheduler->lock);
+}
+
+void
+fig_scheduler_destroy(FigScheduler *scheduler)
+{
+    pthread_mutex_lock(&scheduler->lock);
+    scheduler->quit = 1;
+    pthread_cond_broadcast(&scheduler->wake);
+    pthread_mutex_unlock(&scheduler->lock);
+
+    for (uint32_t i = 0; i + 1 < scheduler->n_threads; i++)
+        pthread_join(scheduler->threads[i], NULL);
+
+    pthread_mutex_destroy(&scheduler->lock);
+    pthread_cond_destroy(&scheduler->wake);
+    pthread_cond_destroy(&scheduler->done);
+    pthread_cond_destroy(&scheduler->admit);
+    free(scheduler->threads);
+    free(scheduler);
+}
+
+static void *
+worker_main(void *data)
+{
+    FigScheduler *scheduler = (FigScheduler *) data;
+    uint32_t self = __atomic_fetch_add(&scheduler->started, 1, __ATOMIC_RELAXED);
+    struct SchedulerJob *job;
+
+    pthread_mutex_lock(&scheduler->lock);
+    for (;;) {
+        while (!scheduler->quit &&
+               !(job = first_job(scheduler, FIG_PRIORITY_CLASSES)))
+            pthread_cond_wait(&scheduler->wake, &scheduler->lock);
+        if (scheduler->quit)
+            break;
+
+        job->active++;
+        pthread_mutex_unlock(&scheduler->lock);
+
+        bool exhausted = work(scheduler, job, self);
+
+        /* the job's caller returns only once every thread has left it */
+        pthread_mutex_lock(&scheduler->lock);
+        if (exhausted && job->listed)
+            unlist_job(scheduler, job);
+        if (!--job->active)
+            pthread_cond_broadcast(&scheduler->done);
+    }
+    pthread_mutex_unlock(&scheduler->lock);
+
+    return NULL;
+}
+
+/*
+ * Runs tiles of job until none is left to claim, returning true, or a
+ * higher priority job is posted, returning false.
+ */
+
+static bool
+work(FigScheduler *scheduler, struct SchedulerJob *job, uint32_t self)
+{
+    bool exhausted = true;
+    uint32_t i;
+
+    in_task = 1;
+    while ((i = claim(job, self, scheduler->n_threads)) != UINT32_MAX) {
+        (*job->func)(job->arg, i);
+        __atomic_add_fetch(&job->finished, 1, __ATOMIC_RELEASE);
+
+        if (preempted(scheduler, job->priority)) {
+            exhausted = false;
+            break;
+        }
+    }
+    in_task = 0;
+
+    return exhausted;
+}
+
+/* Takes a tile from range self, or steals one from the ranges after it */
+
+static uint32_t
+claim(struct SchedulerJob *job, uint32_t self, uint32_t n_ranges)
+{
+    for (uint32_t k = 0; k < n_ranges; k++) {
+        struct JobRange *range = job->ranges + (self + k) % n_ranges;
+        uint32_t i;
+
+        if (__atomic_load_n(&range->next, __ATOMIC_RELAXED) >= range->end)
+            continue;
+        i = __atomic_fetch_add(&range->next, 1, __ATOMIC_RELAXED);
+        if (i < range->end)
+            return i;
+    }
+
+    return UINT32_MAX;
+}
+
+static bool
+preempted(FigScheduler *scheduler, int priority)
+{
+    for (int c = 0; c < priority; c++)
+        if (__atomic_load_n(&scheduler->listed[c], __ATOMIC_RELAXED))
+            return true;
+    return false;
+}
+
+/* Oldest listed job of the highest class below the given one */
+
+static struct SchedulerJob *
+first_job(FigScheduler *scheduler, int below)
+{
+    for (int c = 0; c < below; c++)
+        if (scheduler->jobs[c])
+            return scheduler->jobs[c];
+    return NULL;
+}
+
+static void
+list_job(FigScheduler *scheduler, struct SchedulerJob *job)
+{
+    struct SchedulerJob **link = &scheduler->jobs[job->priority];
+
+    while (*link)
+        link = &(*link)->next;
+    *link = job;
+    job->listed = true;
+    __atomic_store_n(&scheduler->listed[job->priority],
+                     scheduler->listed[job->priority] + 1, __ATOMIC_RELAXED);
+
+    pthread_cond_broadcast(&scheduler->wake);
+    pthread_cond_broadcast(&scheduler->done);
+}
+
+static void
+unlist_job(FigScheduler *scheduler, struct SchedulerJob *job)
+{
+    struct SchedulerJob **link = &scheduler->jobs[job->priority];
+
+    while (*link != job)
+        link = &(*link)->next;
+    *link = job->next;
+    job->next = NULL;
+    job->listed = false;
+    __atomic_store_n(&scheduler->listed[job->priority],
+                     scheduler->listed[job->priority] - 1, __ATOMIC_RELAXED);
+
+    /* callers held back by this job may go on with their own */
+    pthread_cond_broadcast(&scheduler->done);
+}
+
+static void
+check_priority(int priority)
+{
+    if (priority < 0 || priority >= FIG_PRIORITY_CLASSES)
+        fig_panic("invalid scheduler priority");
+}
+
+static uint64_t
+now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
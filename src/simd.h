@@ -0,0 +1,200 @@
+/*
+ * File: simd.h
+ * Desc: Portable 8 wide float vectors built on GCC vector extensions.
+ *       The compiler lowers them to AVX when it is enabled and to pairs
+ *       of SSE registers otherwise, so kernels are written once.
+ */
+
+#ifndef _FIG_SIMD_H_
+#define _FIG_SIMD_H_
+
+#include <stdint.h>
+#include <string.h>
+
+#define FIG_V8_WIDTH 8
+
+typedef float    fig_v8f   __attribute__((vector_size(32)));
+typedef int32_t  fig_v8i   __attribute__((vector_size(32)));
+typedef uint32_t fig_v8u32 __attribute__((vector_size(32)));
+typedef uint16_t fig_v8u16 __attribute__((vector_size(16)));
+typedef uint8_t  fig_v8u8  __attribute__((vector_size(8)));
+
+static inline fig_v8f
+fig_v8_set1(float x)
+{
+    return (fig_v8f) { x, x, x, x, x, x, x, x };
+}
+
+static inline fig_v8f
+fig_v8_load(const float *p)
+{
+    fig_v8f v;
+
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static inline void
+fig_v8_store(float *p, fig_v8f v)
+{
+    memcpy(p, &v, sizeof v);
+}
+
+/* Loads n < 8 floats, filling the remaining lanes with fill */
+static inline fig_v8f
+fig_v8_load_partial(const float *p, uint32_t n, float fill)
+{
+    fig_v8f v = fig_v8_set1(fill);
+
+    for (uint32_t i = 0; i < n; i++)
+        v[i] = p[i];
+    return v;
+}
+
+static inline void
+fig_v8_store_partial(float *p, fig_v8f v, uint32_t n)
+{
+    for (uint32_t i = 0; i < n; i++)
+        p[i] = v[i];
+}
+
+static inline fig_v8u16
+fig_v8u16_load(const uint16_t *p)
+{
+    fig_v8u16 v;
+
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static inline void
+fig_v8u16_store(uint16_t *p, fig_v8u16 v)
+{
+    memcpy(p, &v, sizeof v);
+}
+
+static inline fig_v8u8
+fig_v8u8_load(const uint8_t *p)
+{
+    fig_v8u8 v;
+
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static inline void
+fig_v8u8_store(uint8_t *p, fig_v8u8 v)
+{
+    memcpy(p, &v, sizeof v);
+}
+
+#ifdef __clang__
+#define FIG_V8_SHUFFLE(a, b, ...) __builtin_shufflevector(a, b, __VA_ARGS__)
+#else
+#define FIG_V8_SHUFFLE(a, b, ...) __builtin_shuffle(a, b, (fig_v8i) { __VA_ARGS__ })
+#endif
+
+/* Stores a0 b0 c0 a1 b1 c1 ... a7 b7 c7, three planes into 24 pixel channels */
+static inline void
+fig_v8_store_interleave3(float *p, fig_v8f a, fig_v8f b, fig_v8f c)
+{
+    fig_v8f ab;
+
+    ab = FIG_V8_SHUFFLE(a, b, 0, 8, 1, 9, 2, 10, 3, 11);
+    fig_v8_store(p, FIG_V8_SHUFFLE(ab, c, 0, 1, 8, 2, 3, 9, 4, 5));
+    ab = FIG_V8_SHUFFLE(a, b, 3, 11, 4, 12, 5, 13, 6, 14);
+    fig_v8_store(p + 8, FIG_V8_SHUFFLE(ab, c, 10, 0, 1, 11, 2, 3, 12, 4));
+    ab = FIG_V8_SHUFFLE(a, b, 13, 6, 14, 7, 15, 0, 0, 0);
+    fig_v8_store(p + 16, FIG_V8_SHUFFLE(ab, c, 0, 13, 1, 2, 14, 3, 4, 15));
+}
+
+/* Swaps the first and last channel of 8 interleaved 3 channel pixels, RGB <-> BGR */
+static inline void
+fig_v8_reverse3(fig_v8f *a, fig_v8f *b, fig_v8f *c)
+{
+    fig_v8f x = FIG_V8_SHUFFLE(*a, *b, 2, 1, 0, 5, 4, 3, 8, 7),
+            y = FIG_V8_SHUFFLE(*a, *b, 6, 11, 10, 9, 14, 13, 12, 0),
+            z = FIG_V8_SHUFFLE(*b, *c, 8, 7, 12, 11, 10, 15, 14, 13);
+
+    *a = x;
+    *b = FIG_V8_SHUFFLE(y, *c, 0, 1, 2, 3, 4, 5, 6, 9);
+    *c = z;
+}
+
+static inline fig_v8f
+fig_v8_select(fig_v8i mask, fig_v8f a, fig_v8f b)
+{
+    fig_v8i r = (mask & (fig_v8i) a) | (~mask & (fig_v8i) b);
+
+    return (fig_v8f) r;
+}
+
+static inline fig_v8f
+fig_v8_max(fig_v8f a, fig_v8f b)
+{
+    return fig_v8_select(a > b, a, b);
+}
+
+static inline fig_v8f
+fig_v8_min(fig_v8f a, fig_v8f b)
+{
+    return fig_v8_select(a < b, a, b);
+}
+
+static inline float
+fig_v8_hsum(fig_v8f v)
+{
+    return ((v[0] + v[4]) + (v[1] + v[5])) + ((v[2] + v[6]) + (v[3] + v[7]));
+}
+
+static inline float
+fig_v8_hmax(fig_v8f v)
+{
+    float m = v[0];
+
+    for (int i = 1; i < FIG_V8_WIDTH; i++)
+        m = v[i] > m ? v[i] : m;
+    return m;
+}
+
+/*
+ * exp() with a degree 5 polynomial on the reduced range, accurate to
+ * about 2 ulp over the clamped domain (Cephes expf coefficients).
+ */
+
+static inline fig_v8f
+fig_v8_exp(fig_v8f x)
+{
+    const fig_v8f magic = fig_v8_set1(12582912.0f); /* 1.5 * 2^23 */
+    fig_v8f t, n, r, p;
+    fig_v8i e;
+
+    x = fig_v8_min(x, fig_v8_set1(88.3762626647949f));
+    x = fig_v8_max(x, fig_v8_set1(-87.3365478515625f));
+
+    /* round x / ln(2) to the nearest integer */
+    t = x * 1.44269504088896341f + magic;
+    n = t - magic;
+    e = (fig_v8i) t - (fig_v8i) magic;
+
+    r = x - n * 0.693359375f;
+    r = r + n * 2.12194440e-4f;
+
+    p = fig_v8_set1(1.9875691500e-4f);
+    p = p * r + 1.3981999507e-3f;
+    p = p * r + 8.3334519073e-3f;
+    p = p * r + 4.1665795894e-2f;
+    p = p * r + 1.6666665459e-1f;
+    p = p * r + 5.0000001201e-1f;
+    p = p * r * r + r + 1.0f;
+
+    return p * (fig_v8f) ((e + 127) << 23);
+}
+
+static inline fig_v8f
+fig_v8_logistic(fig_v8f x)
+{
+    return 1.0f / (1.0f + fig_v8_exp(-x));
+}
+
+#endif /* _FIG_SIMD_H_ */
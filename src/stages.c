@@ -0,0 +1,441 @@
+#define _GNU_SOURCE
+#include <sched.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include "misc.h"
+#include "numa.h"
+#include "plan.h"
+#include "ring.h"
+#include "stages.h"
+
+struct StageFrame
+{
+    /* model input, the output of every stage but the last, model output */
+    FigBuffer **buffers;
+    uint64_t index;
+};
+
+struct Stage
+{
+    FigStages *stages;
+    uint32_t index;
+
+    FigLayer *first,
+             *last;
+
+    /* their buffers before the split, put back by fig_stages_destroy() */
+    FigBuffer *own_input,
+              *own_output;
+
+    FigPlan *plan;
+    FigThreadPool *pool;
+    int cpu;
+    pthread_t thread;
+
+    /* frames waiting for the stage */
+    FigRing queue;
+};
+
+struct FigStages
+{
+    FigModel *model;
+    uint32_t n_stages,
+             depth;
+
+    /* first layer of every stage, then the number of layers */
+    uint32_t *first_layer;
+
+    struct Stage *stage;
+    struct StageFrame *frames;
+
+    /* frames through the last stage, and frames handed back */
+    FigRing done,
+            free;
+
+    /* frames with the caller, the first on the submitting thread */
+    struct StageFrame *filling,
+                      *reading;
+    uint64_t submitted;
+};
+
+static void  partition(const double *cost, uint32_t n, uint32_t n_parts,
+                       uint32_t *first);
+static void  stage_init(struct Stage *stage, FigLayer **layers, uint32_t n_layers,
+                        const int *cpus, uint32_t n_cpus, bool pin);
+static void *stage_main(void *data);
+static FigBuffer *buffer_like(FigBuffer *buffer);
+
+/*
+ * Splits the layers of model into stages and starts their threads.
+ * Layers are weighed by their time on the peak roofline, so memory
+ * bound layers count for the traffic they cause, and cut into the run
+ * of stages whose costliest stage is cheapest. CPUs are dealt out in
+ * order, as evenly as they divide.
+ */
+
+FigStages *
+fig_stages_new(FigModel *model, const struct StagesDesc *desc)
+{
+    const FigTopology *topology = fig_topology();
+    const FigPeak nominal = { .flops = 10, .bandwidth = 1 };
+    FigStages *stages;
+    FigLayerCost *costs;
+    FigLayer **layers, *layer;
+    double *weights;
+    int *cpus;
+    uint32_t n_layers, n_cpus = 0, cpu = 0, i = 0;
+
+    n_layers = fig_list_length(model->layers);
+    if (!n_layers)
+        fig_panic("model has no layers to split into stages");
+
+    layer = (FigLayer *) model->layers->head->data;
+    if (layer->type == FIG_LAYER_CONV && ((FigConv *) layer)->input)
+        fig_panic("stages take float input, unbind the uint8 input first");
+
+    if (desc->cpus) {
+        n_cpus = desc->n_cpus;
+        cpus = malloc(n_cpus * sizeof(int));
+        if (!cpus)
+            fig_panic("failed allocating memory");
+        for (uint32_t c = 0; c < n_cpus; c++)
+            cpus[c] = desc->cpus[c];
+    } else {
+        for (uint32_t node = 0; node < topology->n_nodes; node++)
+            n_cpus += topology->nodes[node].n_cpus;
+        cpus = malloc(n_cpus * sizeof(int));
+        if (!cpus)
+            fig_panic("failed allocating memory");
+        for (uint32_t node = 0, c = 0; node < topology->n_nodes; node++)
+            for (uint32_t k = 0; k < topology->nodes[node].n_cpus; k++)
+                cpus[c++] = topology->nodes[node].cpus[k];
+    }
+    if (!n_cpus)
+        fig_panic("stages need at least one CPU");
+
+    stages = calloc(1, sizeof *stages);
+    if (!stages)
+        fig_panic("failed allocating memory");
+
+    stages->model = model;
+    stages->n_stages = desc->n_stages ? desc->n_stages : n_cpus;
+    if (stages->n_stages > n_cpus)
+        stages->n_stages = n_cpus;
+    if (stages->n_stages > n_layers)
+        stages->n_stages = n_layers;
+    stages->depth = desc->depth ? desc->depth : 2 * stages->n_stages;
+    if (stages->depth < stages->n_stages)
+        stages->depth = stages->n_stages;
+
+    costs = fig_model_cost(model, NULL, &n_layers);
+    weights = malloc(n_layers * sizeof(double));
+    layers = malloc(n_layers * sizeof(FigLayer *));
+    stages->first_layer = malloc((stages->n_stages + 1) * sizeof(uint32_t));
+    stages->stage = calloc(stages->n_stages, sizeof(struct Stage));
+    stages->frames = calloc(stages->depth, sizeof(struct StageFrame));
+    if (!weights || !layers || !stages->first_layer || !stages->stage || !stages->frames)
+        fig_panic("failed allocating memory");
+
+    fig_list_for_each(model->layers) {
+        weights[i] = fig_cost_predict(costs + i, desc->peak ? desc->peak : &nominal);
+        layers[i++] = (FigLayer *) item->data;
+    }
+    partition(weights, n_layers, stages->n_stages, stages->first_layer);
+    stages->first_layer[stages->n_stages] = n_layers;
+
+    for (uint32_t s = 0; s < stages->n_stages; s++) {
+        struct Stage *stage = stages->stage + s;
+        uint32_t first = stages->first_layer[s], group;
+
+        group = n_cpus / stages->n_stages + (s < n_cpus % stages->n_stages);
+        stage->stages = stages;
+        stage->index = s;
+        stage_init(stage, layers + first, stages->first_layer[s + 1] - first,
+                   cpus + cpu, group, desc->pin);
+        cpu += group;
+    }
+
+    /* rings hold every frame and the stop marker, so pushes never fail */
+    fig_ring_init(&stages->done, stages->depth + 1);
+    fig_ring_init(&stages->free, stages->depth + 1);
+
+    for (uint32_t f = 0; f < stages->depth; f++) {
+        struct StageFrame *frame = stages->frames + f;
+
+        frame->buffers = malloc((stages->n_stages + 1) * sizeof(FigBuffer *));
+        if (!frame->buffers)
+            fig_panic("failed allocating memory");
+
+        frame->buffers[0] = buffer_like(stages->stage[0].own_input);
+        for (uint32_t s = 0; s < stages->n_stages; s++)
+            frame->buffers[s + 1] = buffer_like(stages->stage[s].own_output);
+        fig_ring_push(&stages->free, frame);
+    }
+
+    for (uint32_t s = 0; s < stages->n_stages; s++)
+        if (pthread_create(&stages->stage[s].thread, NULL, &stage_main,
+                           stages->stage + s))
+            fig_panic("failed creating thread");
+
+    free(costs);
+    free(weights);
+    free(layers);
+    free(cpus);
+
+    return stages;
+}
+
+uint32_t
+fig_stages_count(FigStages *stages)
+{
+    return stages->n_stages;
+}
+
+/* Index of the first layer of stage, or the layer count past the last */
+
+uint32_t
+fig_stages_first_layer(FigStages *stages, uint32_t stage)
+{
+    if (stage > stages->n_stages)
+        fig_panic("stage out of range");
+
+    return stages->first_layer[stage];
+}
+
+uint32_t
+fig_stages_depth(FigStages *stages)
+{
+    return stages->depth;
+}
+
+/*
+ * Blocks until a frame is free and returns its input buffer, of the
+ * model input's shape, to fill before fig_stages_submit().
+ */
+
+FigBuffer *
+fig_stages_input(FigStages *stages)
+{
+    if (!stages->filling)
+        stages->filling = fig_ring_pop_wait(&stages->free);
+
+    return stages->filling->buffers[0];
+}
+
+void
+fig_stages_submit(FigStages *stages)
+{
+    struct StageFrame *frame = stages->filling;
+
+    if (!frame)
+        fig_panic("no input to submit, call fig_stages_input() first");
+
+    frame->index = stages->submitted++;
+    fig_ring_push(&stages->stage[0].queue, frame);
+    stages->filling = NULL;
+}
+
+/*
+ * Blocks until the oldest submitted frame is through every stage and
+ * returns its output, which stays valid until fig_stages_release().
+ * index, if given, receives the frame's number in submission order.
+ */
+
+FigBuffer *
+fig_stages_output(FigStages *stages, uint64_t *index)
+{
+    if (stages->reading)
+        fig_panic("release the last output first");
+
+    stages->reading = fig_ring_pop_wait(&stages->done);
+    if (index)
+        *index = stages->reading->index;
+
+    return stages->reading->buffers[stages->n_stages];
+}
+
+void
+fig_stages_release(FigStages *stages)
+{
+    if (!stages->reading)
+        fig_panic("no output to release");
+
+    fig_ring_push(&stages->free, stages->reading);
+    stages->reading = NULL;
+}
+
+/*
+ * Stops the stages once the frames submitted so far are through, drops
+ * their outputs and gives the model its own buffers back. Call it from
+ * the submitting thread.
+ */
+
+void
+fig_stages_destroy(FigStages *stages)
+{
+    fig_ring_push(&stages->stage[0].queue, NULL);
+
+    for (uint32_t s = 0; s < stages->n_stages; s++) {
+        struct Stage *stage = stages->stage + s;
+
+        pthread_join(stage->thread, NULL);
+        stage->first->in_buffer = stage->own_input;
+        stage->last->out_buffer = stage->own_output;
+
+        fig_plan_destroy(stage->plan);
+        if (stage->pool)
+            fig_thread_pool_destroy(stage->pool);
+        fig_ring_release(&stage->queue);
+    }
+
+    for (uint32_t f = 0; f < stages->depth; f++) {
+        for (uint32_t s = 0; s <= stages->n_stages; s++)
+            fig_buffer_destroy(stages->frames[f].buffers[s]);
+        free(stages->frames[f].buffers);
+    }
+
+    fig_ring_release(&stages->done);
+    fig_ring_release(&stages->free);
+    free(stages->frames);
+    free(stages->stage);
+    free(stages->first_layer);
+    free(stages);
+}
+
+/*
+ * Cuts n costs into n_parts nonempty runs, starting at first[0..n_parts),
+ * so that the largest run total is as small as it can be.
+ */
+
+static void
+partition(const double *cost, uint32_t n, uint32_t n_parts, uint32_t *first)
+{
+    double *prefix, *best, run, worst;
+    uint32_t *cut, end = n;
+
+    /* best[p * (n + 1) + i]: smallest largest total of the first i costs in p + 1 runs */
+    prefix = malloc((n + 1) * sizeof(double));
+    best = malloc((size_t) n_parts * (n + 1) * sizeof(double));
+    cut = malloc((size_t) n_parts * (n + 1) * sizeof(uint32_t));
+    if (!prefix || !best || !cut)
+        fig_panic("failed allocating memory");
+
+    prefix[0] = 0;
+    for (uint32_t i = 0; i < n; i++)
+        prefix[i + 1] = prefix[i] + cost[i];
+
+    for (uint32_t i = 1; i <= n; i++) {
+        best[i] = prefix[i];
+        cut[i] = 0;
+    }
+
+    for (uint32_t p = 1; p < n_parts; p++) {
+        for (uint32_t i = p + 1; i <= n; i++) {
+            double *entry = best + p * (n + 1) + i;
+
+            *entry = -1;
+            for (uint32_t s = p; s < i; s++) {
+                run = prefix[i] - prefix[s];
+                worst = best[(p - 1) * (n + 1) + s];
+                if (run > worst)
+                    worst = run;
+                if (*entry < 0 || worst < *entry) {
+                    *entry = worst;
+                    cut[p * (n + 1) + i] = s;
+                }
+            }
+        }
+    }
+
+    for (uint32_t p = n_parts; p-- > 0;) {
+        first[p] = p ? cut[p * (n + 1) + end] : 0;
+        end = first[p];
+    }
+
+    free(prefix);
+    free(best);
+    free(cut);
+}
+
+static void
+stage_init(struct Stage *stage, FigLayer **layers, uint32_t n_layers,
+           const int *cpus, uint32_t n_cpus, bool pin)
+{
+    FigContext *context = stage->stages->model->context;
+    FigList *list;
+
+    stage->first = layers[0];
+    stage->last = layers[n_layers - 1];
+    stage->own_input = stage->first->in_buffer;
+    stage->own_output = stage->last->out_buffer;
+    stage->cpu = pin ? cpus[0] : -1;
+
+    /* a single CPU is the stage thread itself */
+    stage->pool = NULL;
+    if (n_cpus > 1)
+        stage->pool = pin ? fig_thread_pool_new_pinned(cpus, n_cpus) :
+                            fig_thread_pool_new(n_cpus);
+
+    /* the plan takes its pool from the layers, which keep the model's */
+    list = fig_list_new();
+    for (uint32_t i = 0; i < n_layers; i++) {
+        layers[i]->pool = stage->pool;
+        fig_list_append(list, layers[i]);
+    }
+    stage->plan = fig_plan_new(list, NULL, 0);
+    for (uint32_t i = 0; i < n_layers; i++)
+        layers[i]->pool = context ? context->pool : NULL;
+    fig_list_destroy(list);
+
+    fig_ring_init(&stage->queue, stage->stages->depth + 1);
+}
+
+static void *
+stage_main(void *data)
+{
+    struct Stage *stage = (struct Stage *) data;
+    FigStages *stages = stage->stages;
+    struct StageFrame *frame;
+    FigRing *next;
+    cpu_set_t set;
+
+    next = stage->index + 1 < stages->n_stages ?
+        &stages->stage[stage->index + 1].queue : &stages->done;
+
+    if (stage->cpu >= 0) {
+        CPU_ZERO(&set);
+        CPU_SET(stage->cpu, &set);
+        if (pthread_setaffinity_np(pthread_self(), sizeof set, &set))
+            fig_warn("failed pinning thread");
+    }
+
+    while ((frame = fig_ring_pop_wait(&stage->queue))) {
+        stage->first->in_buffer = frame->buffers[stage->index];
+        stage->last->out_buffer = frame->buffers[stage->index + 1];
+
+        for (uint32_t i = 0; i < stage->plan->n_steps; i++)
+            fig_plan_step_run(stage->plan->steps + i);
+
+        fig_ring_push(next, frame);
+    }
+
+    /* pass the stop marker on */
+    fig_ring_push(next, NULL);
+    return NULL;
+}
+
+/* A buffer of the same shape, batch and layout */
+
+static FigBuffer *
+buffer_like(FigBuffer *buffer)
+{
+    FigBuffer *like;
+
+    like = fig_buffer_new_batch(buffer->batch, buffer->width, buffer->height,
+                                buffer->channels);
+    if (!like->data)
+        fig_panic("failed allocating memory");
+    fig_buffer_set_layout(like, buffer->layout);
+
+    return like;
+}
@@ -0,0 +1,177 @@
+#include <stdlib.h>
+#include <string.h>
+#include "misc.h"
+#include "stats.h"
+
+#define SUB_COUNT (1u << FIG_HISTOGRAM_SUB_BITS)
+
+static uint32_t bucket_of(uint64_t ns);
+static uint64_t bucket_value(uint32_t index);
+static uint64_t take(uint64_t *counter, bool reset);
+
+void
+fig_histogram_init(FigHistogram *histogram)
+{
+    memset(histogram, 0, sizeof *histogram);
+}
+
+void
+fig_histogram_record(FigHistogram *histogram, uint64_t ns)
+{
+    uint64_t max = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&histogram->buckets[bucket_of(ns)], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&histogram->sum_ns, ns, __ATOMIC_RELAXED);
+
+    while (ns > max &&
+           !__atomic_compare_exchange_n(&histogram->max_ns, &max, ns, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+/*
+ * Copies histogram into snapshot. With reset, every counter is read and
+ * zeroed in one atomic exchange, so a value recorded concurrently lands
+ * either in this snapshot or in the next one, never in both.
+ */
+
+void
+fig_histogram_snapshot(FigHistogram *histogram, FigHistogram *snapshot, bool reset)
+{
+    snapshot->count = take(&histogram->count, reset);
+    snapshot->sum_ns = take(&histogram->sum_ns, reset);
+    snapshot->max_ns = take(&histogram->max_ns, reset);
+
+    for (uint32_t i = 0; i < FIG_HISTOGRAM_BUCKETS; i++)
+        snapshot->buckets[i] = take(&histogram->buckets[i], reset);
+}
+
+/*
+ * Returns the highest value equivalent to the bucket holding the p-th
+ * quantile, p in [0, 1]. Meant for snapshots; the total is summed from
+ * the buckets so it matches them even if count was read mid update.
+ */
+
+uint64_t
+fig_histogram_percentile(const FigHistogram *histogram, double p)
+{
+    uint64_t total = 0, rank, seen = 0;
+
+    for (uint32_t i = 0; i < FIG_HISTOGRAM_BUCKETS; i++)
+        total += histogram->buckets[i];
+    if (!total)
+        return 0;
+
+    rank = (uint64_t) (p * total + 0.5);
+    if (rank < 1)
+        rank = 1;
+    if (rank > total)
+        rank = total;
+
+    for (uint32_t i = 0; i < FIG_HISTOGRAM_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            uint64_t value = bucket_value(i);
+
+            return histogram->max_ns && value > histogram->max_ns ?
+                histogram->max_ns : value;
+        }
+    }
+
+    return histogram->max_ns;
+}
+
+void
+fig_histogram_summarize(const FigHistogram *histogram, FigLatencySummary *summary)
+{
+    summary->count = histogram->count;
+    summary->mean_ns = histogram->count ?
+        (double) histogram->sum_ns / histogram->count : 0;
+    summary->p50_ns = fig_histogram_percentile(histogram, 0.50);
+    summary->p90_ns = fig_histogram_percentile(histogram, 0.90);
+    summary->p99_ns = fig_histogram_percentile(histogram, 0.99);
+    summary->p999_ns = fig_histogram_percentile(histogram, 0.999);
+    summary->max_ns = histogram->max_ns;
+}
+
+FigModelStats *
+fig_model_stats_new(uint32_t n_layers)
+{
+    FigModelStats *stats;
+
+    stats = malloc(sizeof *stats);
+    if (!stats)
+        fig_panic("failed allocating memory");
+
+    stats->layers = malloc((n_layers + 1) * sizeof(FigHistogram));
+    if (!stats->layers)
+        fig_panic("failed allocating memory");
+
+    stats->inferences = 0;
+    stats->bytes = 0;
+    stats->n_layers = n_layers;
+    fig_histogram_init(&stats->forward);
+    for (uint32_t i = 0; i < n_layers; i++)
+        fig_histogram_init(stats->layers + i);
+
+    return stats;
+}
+
+/* snapshot has to come from fig_model_stats_new() with the same layer count */
+
+void
+fig_model_stats_snapshot(FigModelStats *stats, FigModelStats *snapshot, bool reset)
+{
+    if (snapshot->n_layers != stats->n_layers)
+        fig_panic("stats snapshot has a different number of layers");
+
+    snapshot->inferences = take(&stats->inferences, reset);
+    snapshot->bytes = take(&stats->bytes, reset);
+    fig_histogram_snapshot(&stats->forward, &snapshot->forward, reset);
+    for (uint32_t i = 0; i < stats->n_layers; i++)
+        fig_histogram_snapshot(stats->layers + i, snapshot->layers + i, reset);
+}
+
+void
+fig_model_stats_destroy(FigModelStats *stats)
+{
+    free(stats->layers);
+    free(stats);
+}
+
+static uint32_t
+bucket_of(uint64_t ns)
+{
+    uint32_t shift;
+
+    if (ns < SUB_COUNT)
+        return (uint32_t) ns;
+    if (ns >> FIG_HISTOGRAM_MAX_BITS)
+        return FIG_HISTOGRAM_BUCKETS - 1;
+
+    /* position of the top bit, less the bits kept for the sub bucket */
+    shift = 63 - __builtin_clzll(ns) - FIG_HISTOGRAM_SUB_BITS;
+    return ((shift + 1) << FIG_HISTOGRAM_SUB_BITS) + ((ns >> shift) & (SUB_COUNT - 1));
+}
+
+static uint64_t
+bucket_value(uint32_t index)
+{
+    uint32_t shift;
+
+    if (index < SUB_COUNT)
+        return index;
+
+    shift = (index >> FIG_HISTOGRAM_SUB_BITS) - 1;
+    return (((uint64_t) (index & (SUB_COUNT - 1)) | SUB_COUNT) << shift) +
+           ((1ull << shift) - 1);
+}
+
+static uint64_t
+take(uint64_t *counter, bool reset)
+{
+    if (reset)
+        return __atomic_exchange_n(counter, 0, __ATOMIC_RELAXED);
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,249 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include "misc.h"
+#include "threadpool.h"
+
+static FigThreadPool *pool_new(uint32_t n_threads, const int *cpus);
+static void *worker_main(void *data);
+static void  run_tasks(FigThreadPool *pool, FigTaskFunc func, void *arg,
+                       uint32_t n_tasks);
+static void  create_default_pool();
+static uint64_t now_ns();
+
+/* Set while a thread executes a task, nested loops then run inline */
+static __thread int in_task;
+
+static FigThreadPool *default_pool;
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
+
+FigThreadPool *
+fig_thread_pool_new(uint32_t n_threads)
+{
+    if (!n_threads) {
+        long n = sysconf(_SC_NPROCESSORS_ONLN);
+        n_threads = n > 0 ? (uint32_t) n : 1;
+    }
+
+    return pool_new(n_threads, NULL);
+}
+
+/*
+ * Creates a pool with one thread per entry of cpus. Worker i is pinned
+ * to cpus[i + 1]; cpus[0] is left for the calling thread, which takes
+ * part in every loop and is expected to pin itself.
+ */
+
+FigThreadPool *
+fig_thread_pool_new_pinned(const int *cpus, uint32_t n_cpus)
+{
+    if (!n_cpus)
+        fig_panic("pinned thread pool needs at least one CPU");
+
+    return pool_new(n_cpus, cpus);
+}
+
+/*
+ * Calls func(arg, i) for every i below n_tasks, spread over the pool,
+ * and returns once all calls have finished. Concurrent callers are
+ * serialized, and a call made from inside a task runs inline.
+ */
+
+void
+fig_thread_pool_run(FigThreadPool *pool, FigTaskFunc func, void *arg,
+                    uint32_t n_tasks)
+{
+    uint64_t queued;
+
+    if (!n_tasks)
+        return;
+
+    if (in_task || pool->n_threads == 1 || n_tasks == 1) {
+        for (uint32_t i = 0; i < n_tasks; i++)
+            (*func)(arg, i);
+        return;
+    }
+
+    queued = now_ns();
+    pthread_mutex_lock(&pool->run_lock);
+    fig_histogram_record(&pool->queue_wait, now_ns() - queued);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->func = func;
+    pool->arg = arg;
+    pool->n_tasks = n_tasks;
+    pool->next = 0;
+    pool->finished = 0;
+    pool->generation++;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    run_tasks(pool, func, arg, n_tasks);
+
+    /* workers that have not joined by now will find no loop to join */
+    pthread_mutex_lock(&pool->lock);
+    while (__atomic_load_n(&pool->finished, __ATOMIC_ACQUIRE) < n_tasks ||
+           pool->active)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pool->func = NULL;
+    pthread_mutex_unlock(&pool->lock);
+
+    pthread_mutex_unlock(&pool->run_lock);
+}
+
+uint32_t
+fig_thread_pool_size(FigThreadPool *pool)
+{
+    return pool->n_threads;
+}
+
+/*
+ * Shared pool used when callers do not provide one. Its size comes from
+ * FIG_NUM_THREADS, or the number of online CPUs.
+ */
+
+FigThreadPool *
+fig_thread_pool_default()
+{
+    pthread_once(&default_once, &create_default_pool);
+    return default_pool;
+}
+
+void
+fig_thread_pool_destroy(FigThreadPool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->quit = 1;
+    pthread_cond_broadcast(&pool->wake);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (uint32_t i = 0; i + 1 < pool->n_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_mutex_destroy(&pool->run_lock);
+    pthread_cond_destroy(&pool->wake);
+    pthread_cond_destroy(&pool->done);
+    free(pool->threads);
+    free(pool);
+}
+
+static FigThreadPool *
+pool_new(uint32_t n_threads, const int *cpus)
+{
+    FigThreadPool *pool;
+
+    pool = malloc(sizeof *pool);
+    if (!pool)
+        fig_panic("failed allocating memory");
+
+    /* the thread calling fig_thread_pool_run() is one of the workers */
+    pool->n_threads = n_threads;
+    pool->threads = malloc((n_threads - 1) * sizeof(pthread_t) + 1);
+    if (!pool->threads)
+        fig_panic("failed allocating memory");
+
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_mutex_init(&pool->run_lock, NULL);
+    pthread_cond_init(&pool->wake, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    pool->func = NULL;
+    pool->arg = NULL;
+    pool->n_tasks = 0;
+    pool->generation = 0;
+    pool->active = 0;
+    pool->quit = 0;
+    pool->next = 0;
+    pool->finished = 0;
+    fig_histogram_init(&pool->queue_wait);
+
+    for (uint32_t i = 0; i + 1 < n_threads; i++) {
+        pthread_attr_t attr;
+        cpu_set_t set;
+
+        pthread_attr_init(&attr);
+        if (cpus) {
+            CPU_ZERO(&set);
+            CPU_SET(cpus[i + 1], &set);
+            pthread_attr_setaffinity_np(&attr, sizeof set, &set);
+        }
+
+        if (pthread_create(&pool->threads[i], &attr, &worker_main, pool))
+            fig_panic("failed creating thread");
+        pthread_attr_destroy(&attr);
+    }
+
+    return pool;
+}
+
+static void *
+worker_main(void *data)
+{
+    FigThreadPool *pool = (FigThreadPool *) data;
+    uint64_t seen = 0;
+    FigTaskFunc func;
+    void *arg;
+    uint32_t n_tasks;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;) {
+        while (!pool->quit && (pool->generation == seen || !pool->func))
+            pthread_cond_wait(&pool->wake, &pool->lock);
+        if (pool->quit)
+            break;
+
+        seen = pool->generation;
+        func = pool->func;
+        arg = pool->arg;
+        n_tasks = pool->n_tasks;
+        pool->active++;
+        pthread_mutex_unlock(&pool->lock);
+
+        run_tasks(pool, func, arg, n_tasks);
+
+        pthread_mutex_lock(&pool->lock);
+        if (!--pool->active)
+            pthread_cond_broadcast(&pool->done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+static void
+run_tasks(FigThreadPool *pool, FigTaskFunc func, void *arg, uint32_t n_tasks)
+{
+    uint32_t i;
+
+    in_task = 1;
+    while ((i = __atomic_fetch_add(&pool->next, 1, __ATOMIC_RELAXED)) < n_tasks) {
+        (*func)(arg, i);
+        if (__atomic_add_fetch(&pool->finished, 1, __ATOMIC_ACQ_REL) == n_tasks) {
+            pthread_mutex_lock(&pool->lock);
+            pthread_cond_broadcast(&pool->done);
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+    in_task = 0;
+}
+
+static void
+create_default_pool()
+{
+    const char *env = getenv("FIG_NUM_THREADS");
+
+    default_pool = fig_thread_pool_new(env ? (uint32_t) atoi(env) : 0);
+}
+
+static uint64_t
+now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
@@ -0,0 +1,492 @@
+/*
+ * File: aot.c
+ * Desc: Compiles a model file for one input shape into a standalone C
+ *       translation unit with no dependency on the library.
+ *
+ * usage: fig-aot [--name NAME] [--header FILE] [-o FILE] MODEL WIDTHxHEIGHTxCHANNELS
+ *
+ * The generated file defines
+ *
+ *     void NAME_forward(const float *input, float *output);
+ *
+ * reading a HWC input and writing the model output. Every layer becomes
+ * a function with its shapes as constants, weights are 64 byte aligned
+ * static const arrays with batchnorm folded into a per channel scale and
+ * shift, and intermediate activations live at offsets of one static
+ * arena planned here, so a forward pass neither parses, dispatches nor
+ * allocates. The arena makes NAME_forward() non reentrant. Build it with
+ * something like cc -O3 -march=native -shared -fPIC -o libNAME.so NAME.c.
+ */
+
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <model.h>
+
+#define VALUES_PER_LINE 6
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [--name NAME] [--header FILE] [-o FILE] "
+                    "MODEL WIDTHxHEIGHTxCHANNELS\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+static FILE *
+open_output(const char *path)
+{
+    FILE *fp = fopen(path, "w");
+
+    if (!fp) {
+        fprintf(stderr, "unable to open %s\n", path);
+        exit(EXIT_FAILURE);
+    }
+    return fp;
+}
+
+/* Hex floats, so the weights are reproduced bit for bit */
+
+static void
+emit_array(FILE *fp, const char *name, const float *values, size_t n)
+{
+    fprintf(fp, "static const float %s[%zu] ALIGNED = {", name, n);
+    for (size_t i = 0; i < n; i++)
+        fprintf(fp, "%s%a,", i % VALUES_PER_LINE ? " " : "\n    ", values[i]);
+    fprintf(fp, "\n};\n\n");
+}
+
+static const char *
+activation_expr(int activation)
+{
+    switch (activation) {
+    case FIG_ACT_RELU:
+        return "v > 0 ? v : 0";
+    case FIG_ACT_SIGMOID:
+        return "1 / (1 + expf(-v))";
+    default:
+        return "v";
+    }
+}
+
+/* First output position whose window starts inside the input */
+
+static uint32_t
+first_inside(uint32_t padding, uint32_t stride)
+{
+    return (padding + stride - 1) / stride;
+}
+
+/* One past the last output position whose window ends inside the input */
+
+static uint32_t
+end_inside(uint32_t size, uint32_t kernel, uint32_t padding, uint32_t stride)
+{
+    return size + padding >= kernel ? (size + padding - kernel) / stride + 1 : 0;
+}
+
+/*
+ * Weights are repacked [ky][kx][in][out] with the output channels padded
+ * to a multiple of 8, so each input value is broadcast into vectors of 8
+ * accumulators whatever the channel count.
+ */
+
+static void
+emit_conv(FILE *fp, uint32_t index, FigConv *conv)
+{
+    FigLayer *layer = (FigLayer *) conv;
+    FigBuffer *in = layer->in_buffer, *out = layer->out_buffer;
+    uint32_t in_c = in->channels, out_c = out->channels;
+    uint32_t n_blocks = (out_c + 7) / 8, padded = 8 * n_blocks;
+    size_t taps = (size_t) conv->kernel_h * conv->kernel_w * in_c;
+    float *packed, *scale, *shift;
+    char name[64], scaled[64] = "";
+
+    packed = calloc((taps + 2) * padded, sizeof(float));
+    if (!packed) {
+        fprintf(stderr, "failed allocating memory\n");
+        exit(EXIT_FAILURE);
+    }
+    scale = packed + taps * padded;
+    shift = scale + out_c;
+
+    for (uint32_t o = 0; o < out_c; o++) {
+        for (size_t t = 0; t < taps; t++)
+            packed[t * padded + o] = conv->weight[o * taps + t];
+
+        scale[o] = 1.0f;
+        shift[o] = conv->bias[o];
+        if (layer->batchnorm) {
+            scale[o] = layer->gamma[o] / sqrtf(layer->running_var[o] + 1e-5);
+            shift[o] = (conv->bias[o] - layer->running_mean[o]) * scale[o] +
+                       layer->beta[o];
+        }
+    }
+
+    snprintf(name, sizeof name, "layer%u_weight", index);
+    emit_array(fp, name, packed, taps * padded);
+    if (layer->batchnorm) {
+        snprintf(name, sizeof name, "layer%u_scale", index);
+        emit_array(fp, name, scale, out_c);
+        snprintf(scaled, sizeof scaled, " * layer%u_scale[o]", index);
+    }
+    snprintf(name, sizeof name, "layer%u_shift", index);
+    emit_array(fp, name, shift, out_c);
+    free(packed);
+
+    fprintf(fp,
+            "static void\n"
+            "layer%u(const float *restrict in, float *restrict out)\n"
+            "{\n"
+            "    const v8 *weight = (const v8 *) layer%u_weight;\n"
+            "\n"
+            "    for (int y = 0; y < %u; y++) {\n"
+            "        for (int x = 0; x < %u; x++) {\n"
+            "            v8 acc[%u];\n"
+            "\n"
+            "            for (int b = 0; b < %u; b++)\n"
+            "                acc[b] = (v8) { 0 };\n"
+            "\n",
+            index, index, out->height, out->width, n_blocks, n_blocks);
+
+    /* windows inside the input skip the bounds checks, so the taps unroll */
+    fprintf(fp,
+            "            if (y >= %u && y < %u && x >= %u && x < %u) {\n"
+            "                const float *p = in + ((y * %u - %u) * %u + x * %u - %u) * %u;\n"
+            "\n"
+            "                for (int ky = 0; ky < %u; ky++)\n"
+            "                    for (int kx = 0; kx < %u; kx++)\n"
+            "                        for (int c = 0; c < %u; c++)\n"
+            "                            for (int b = 0; b < %u; b++)\n"
+            "                                acc[b] += p[(ky * %u + kx) * %u + c] *\n"
+            "                                          weight[((ky * %u + kx) * %u + c) * %u + b];\n"
+            "            } else {\n",
+            first_inside(conv->padding_top, conv->stride_y),
+            end_inside(in->height, conv->kernel_h, conv->padding_top, conv->stride_y),
+            first_inside(conv->padding_left, conv->stride_x),
+            end_inside(in->width, conv->kernel_w, conv->padding_left, conv->stride_x),
+            conv->stride_y, conv->padding_top, in->width, conv->stride_x,
+            conv->padding_left, in_c, conv->kernel_h, conv->kernel_w, in_c, n_blocks,
+            in->width, in_c, conv->kernel_w, in_c, n_blocks);
+
+    fprintf(fp,
+            "                for (int ky = 0; ky < %u; ky++) {\n"
+            "                    int sy = y * %u + ky - %u;\n"
+            "\n"
+            "                    if (sy < 0 || sy >= %u)\n"
+            "                        continue;\n"
+            "                    for (int kx = 0; kx < %u; kx++) {\n"
+            "                        int sx = x * %u + kx - %u;\n"
+            "\n"
+            "                        if (sx < 0 || sx >= %u)\n"
+            "                            continue;\n"
+            "                        for (int c = 0; c < %u; c++)\n"
+            "                            for (int b = 0; b < %u; b++)\n"
+            "                                acc[b] += in[(sy * %u + sx) * %u + c] *\n"
+            "                                          weight[((ky * %u + kx) * %u + c) * %u + b];\n"
+            "                    }\n"
+            "                }\n"
+            "            }\n"
+            "\n"
+            "            for (int o = 0; o < %u; o++) {\n"
+            "                float v = acc[o / 8][o %% 8]%s + layer%u_shift[o];\n"
+            "\n"
+            "                out[(y * %u + x) * %u + o] = %s;\n"
+            "            }\n"
+            "        }\n"
+            "    }\n"
+            "}\n\n",
+            conv->kernel_h, conv->stride_y, conv->padding_top, in->height,
+            conv->kernel_w, conv->stride_x, conv->padding_left, in->width,
+            in_c, n_blocks, in->width, in_c, conv->kernel_w, in_c, n_blocks,
+            out_c, scaled, index, out->width, out_c, activation_expr(layer->activation));
+}
+
+static void
+emit_maxpool(FILE *fp, uint32_t index, FigMaxPool *pool)
+{
+    FigBuffer *in = pool->base.in_buffer, *out = pool->base.out_buffer;
+
+    fprintf(fp,
+            "static void\n"
+            "layer%u(const float *restrict in, float *restrict out)\n"
+            "{\n"
+            "    for (int y = 0; y < %u; y++) {\n"
+            "        for (int x = 0; x < %u; x++) {\n"
+            "            float max[%u];\n"
+            "\n"
+            "            for (int c = 0; c < %u; c++)\n"
+            "                max[c] = -FLT_MAX;\n"
+            "            for (int ky = 0; ky < %u; ky++) {\n"
+            "                int sy = y * %u + ky - %u;\n"
+            "\n"
+            "                if (sy < 0 || sy >= %u)\n"
+            "                    continue;\n"
+            "                for (int kx = 0; kx < %u; kx++) {\n"
+            "                    int sx = x * %u + kx - %u;\n"
+            "                    const float *p;\n"
+            "\n"
+            "                    if (sx < 0 || sx >= %u)\n"
+            "                        continue;\n"
+            "                    p = in + (sy * %u + sx) * %u;\n"
+            "                    for (int c = 0; c < %u; c++)\n"
+            "                        max[c] = p[c] > max[c] ? p[c] : max[c];\n"
+            "                }\n"
+            "            }\n"
+            "            memcpy(out + (y * %u + x) * %u, max, sizeof max);\n"
+            "        }\n"
+            "    }\n"
+            "}\n\n",
+            index, out->height, out->width, in->channels, in->channels,
+            pool->kernel_h, pool->stride_y, pool->padding_top, in->height,
+            pool->kernel_w, pool->stride_x, pool->padding_left, in->width,
+            in->width, in->channels, in->channels, out->width, out->channels);
+}
+
+/* Eight partial sums per unit so the dot products vectorize without -ffast-math */
+
+static void
+emit_fc(FILE *fp, uint32_t index, FigFullyConnected *fc)
+{
+    FigLayer *layer = (FigLayer *) fc;
+    uint32_t k = fig_buffer_len(layer->in_buffer);
+    char name[64];
+
+    snprintf(name, sizeof name, "layer%u_weight", index);
+    emit_array(fp, name, fc->weight, (size_t) fc->units * k);
+    snprintf(name, sizeof name, "layer%u_bias", index);
+    emit_array(fp, name, fc->bias, fc->units);
+
+    fprintf(fp,
+            "static void\n"
+            "layer%u(const float *restrict in, float *restrict out)\n"
+            "{\n"
+            "    for (int j = 0; j < %u; j++) {\n"
+            "        const float *w = layer%u_weight + j * %u;\n"
+            "        float acc[8] = { 0 }, v = layer%u_bias[j];\n"
+            "        int p;\n"
+            "\n"
+            "        for (p = 0; p + 8 <= %u; p += 8)\n"
+            "            for (int l = 0; l < 8; l++)\n"
+            "                acc[l] += in[p + l] * w[p + l];\n"
+            "        for (; p < %u; p++)\n"
+            "            v += in[p] * w[p];\n"
+            "        for (int l = 0; l < 8; l++)\n"
+            "            v += acc[l];\n"
+            "        out[j] = %s;\n"
+            "    }\n"
+            "}\n\n",
+            index, fc->units, index, k, index, k, k,
+            activation_expr(layer->activation));
+}
+
+static void
+emit_global_avgpool(FILE *fp, uint32_t index, FigLayer *layer)
+{
+    FigBuffer *in = layer->in_buffer;
+    uint32_t pixels = in->width * in->height;
+
+    fprintf(fp,
+            "static void\n"
+            "layer%u(const float *restrict in, float *restrict out)\n"
+            "{\n"
+            "    memset(out, 0, %u * sizeof(float));\n"
+            "    for (int p = 0; p < %u; p++)\n"
+            "        for (int c = 0; c < %u; c++)\n"
+            "            out[c] += in[p * %u + c];\n"
+            "    for (int c = 0; c < %u; c++)\n"
+            "        out[c] *= %af;\n"
+            "}\n\n",
+            index, in->channels, pixels, in->channels, in->channels,
+            in->channels, 1.0f / pixels);
+}
+
+static void
+emit_softmax(FILE *fp, uint32_t index, FigSoftmax *softmax)
+{
+    FigBuffer *in = softmax->base.in_buffer;
+    uint32_t channels = in->channels;
+
+    fprintf(fp,
+            "static void\n"
+            "layer%u(const float *restrict in, float *restrict out)\n"
+            "{\n", index);
+    if (softmax->channel_count != channels)
+        fprintf(fp, "    memcpy(out, in, %u * sizeof(float));\n",
+                fig_buffer_len(in));
+    fprintf(fp,
+            "    for (int p = 0; p < %u; p++) {\n"
+            "        const float *x = in + p * %u + %u;\n"
+            "        float *y = out + p * %u + %u;\n"
+            "        float max = x[0], sum = 0;\n"
+            "\n"
+            "        for (int i = 1; i < %u; i++)\n"
+            "            max = x[i] > max ? x[i] : max;\n"
+            "        for (int i = 0; i < %u; i++)\n"
+            "            sum += y[i] = expf(x[i] - max);\n"
+            "        for (int i = 0; i < %u; i++)\n"
+            "            y[i] /= sum;\n"
+            "    }\n"
+            "}\n\n",
+            in->width * in->height, channels, softmax->channel_offset,
+            channels, softmax->channel_offset, softmax->channel_count,
+            softmax->channel_count, softmax->channel_count);
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *path = NULL, *shape_arg = NULL, *name = "fig_model",
+               *output_path = NULL, *header_path = NULL;
+    FigShape shape;
+    FigBuffer *input, *output;
+    FigModel *model;
+    FILE *fp;
+    uint32_t index = 0, n_layers;
+    size_t region[2] = { 0, 0 };
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--name") && i + 1 < argc)
+            name = argv[++i];
+        else if (!strcmp(argv[i], "--header") && i + 1 < argc)
+            header_path = argv[++i];
+        else if (!strcmp(argv[i], "-o") && i + 1 < argc)
+            output_path = argv[++i];
+        else if (!path)
+            path = argv[i];
+        else if (!shape_arg)
+            shape_arg = argv[i];
+        else
+            usage(argv[0]);
+    }
+
+    if (!path || !shape_arg ||
+        sscanf(shape_arg, "%ux%ux%u", &shape.width, &shape.height, &shape.channels) != 3)
+        usage(argv[0]);
+
+    input = fig_buffer_new(shape.width, shape.height, shape.channels);
+    model = fig_model_from_file(path, input);
+    output = fig_model_output(model);
+    n_layers = fig_list_length(model->layers);
+
+    if (!n_layers) {
+        fprintf(stderr, "%s has no layers\n", path);
+        return EXIT_FAILURE;
+    }
+
+    /*
+     * Every layer only reads the output of the one before it, so outputs
+     * alternate between two regions of the arena, each as large as the
+     * largest output placed in it. The last layer writes to the caller.
+     */
+    fig_list_for_each(model->layers) {
+        FigLayer *layer = (FigLayer *) item->data;
+        size_t len = fig_shape_len(fig_buffer_shape(layer->out_buffer));
+
+        if (index + 1 < n_layers && len > region[index % 2])
+            region[index % 2] = len;
+        index++;
+    }
+
+    fp = output_path ? open_output(output_path) : stdout;
+
+    fprintf(fp,
+            "/*\n"
+            " * Generated by fig-aot from %s for a %ux%ux%u input.\n"
+            " *\n"
+            " *     void %s_forward(const float *input, float *output);\n"
+            " *\n"
+            " * input holds %u floats in HWC order and output receives %u,\n"
+            " * shaped %ux%ux%u. Calls must not overlap.\n"
+            " */\n\n"
+            "#include <float.h>\n"
+            "#include <math.h>\n"
+            "#include <string.h>\n\n"
+            "#define ALIGNED __attribute__((aligned(64)))\n\n"
+            "typedef float v8 __attribute__((vector_size(32), may_alias));\n\n",
+            path, shape.width, shape.height, shape.channels, name,
+            fig_buffer_len(input), fig_buffer_len(output),
+            output->width, output->height, output->channels);
+
+    fprintf(fp, "void %s_forward(const float *input, float *output);\n\n", name);
+    if (region[0] + region[1])
+        fprintf(fp, "static float arena[%zu] ALIGNED;\n\n", region[0] + region[1]);
+
+    index = 0;
+    fig_list_for_each(model->layers) {
+        FigLayer *layer = (FigLayer *) item->data;
+
+        switch (layer->type) {
+        case FIG_LAYER_CONV:
+            emit_conv(fp, index, (FigConv *) layer);
+            break;
+        case FIG_LAYER_MAXPOOL:
+            emit_maxpool(fp, index, (FigMaxPool *) layer);
+            break;
+        case FIG_LAYER_FC:
+            emit_fc(fp, index, (FigFullyConnected *) layer);
+            break;
+        case FIG_LAYER_GLOBAL_AVGPOOL:
+            emit_global_avgpool(fp, index, layer);
+            break;
+        case FIG_LAYER_SOFTMAX:
+            emit_softmax(fp, index, (FigSoftmax *) layer);
+            break;
+        default:
+            fprintf(stderr, "layer %u: unsupported type %s\n", index,
+                    fig_layer_type_name(layer->type));
+            return EXIT_FAILURE;
+        }
+        index++;
+    }
+
+    fprintf(fp, "void\n%s_forward(const float *input, float *output)\n{\n", name);
+    for (uint32_t i = 0; i < n_layers; i++) {
+        char in[32], out[32];
+
+        if (i == 0)
+            snprintf(in, sizeof in, "input");
+        else
+            snprintf(in, sizeof in, "arena + %zu", (i - 1) % 2 ? region[0] : 0);
+
+        if (i + 1 == n_layers)
+            snprintf(out, sizeof out, "output");
+        else
+            snprintf(out, sizeof out, "arena + %zu", i % 2 ? region[0] : 0);
+
+        fprintf(fp, "    layer%u(%s, %s);\n", i, in, out);
+    }
+    fprintf(fp, "}\n");
+
+    if (output_path)
+        fclose(fp);
+
+    if (header_path) {
+        char upper[64];
+        size_t i;
+
+        for (i = 0; name[i] && i + 1 < sizeof upper; i++)
+            upper[i] = toupper((unsigned char) name[i]);
+        upper[i] = '\0';
+
+        fp = open_output(header_path);
+        fprintf(fp,
+                "/* Generated by fig-aot from %s */\n\n"
+                "#ifndef _%s_H_\n"
+                "#define _%s_H_\n\n"
+                "#define %s_INPUT_SIZE %u\n"
+                "#define %s_OUTPUT_SIZE %u\n\n"
+                "void %s_forward(const float *input, float *output);\n\n"
+                "#endif /* _%s_H_ */\n",
+                path, upper, upper, upper, fig_buffer_len(input),
+                upper, fig_buffer_len(output), name, upper);
+        fclose(fp);
+    }
+
+    fig_model_destroy(model);
+    fig_buffer_destroy(input);
+
+    return 0;
+}
@@ -0,0 +1,161 @@
+/*
+ * File: info.c
+ * Desc: Prints the shape, work and memory traffic of every layer of a
+ *       model file and, unless --runs 0 is given, where each layer sits
+ *       on a roofline built from measured machine peaks.
+ *
+ * usage: fig-info [--runs N] MODEL WIDTHxHEIGHTxCHANNELS
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <cost.h>
+#include <model.h>
+#include <profile.h>
+
+#define DEFAULT_RUNS 20
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [--runs N] MODEL WIDTHxHEIGHTxCHANNELS\n", prog);
+    exit(EXIT_FAILURE);
+}
+
+/* Mean seconds per layer over all recorded forward passes, 0 if none */
+
+static double *
+layer_times(FigModel *model, uint32_t n_layers, int runs)
+{
+    FigProfiler *profiler;
+    FigProfileEvent *events;
+    double *seconds;
+    uint32_t n_events;
+
+    seconds = calloc(n_layers + 1, sizeof(double));
+    if (!seconds) {
+        fprintf(stderr, "failed allocating memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    /* one untimed pass to fault in the output buffers */
+    fig_model_forward(model);
+
+    profiler = fig_profiler_new(runs * (n_layers + 1));
+    fig_model_set_profiler(model, profiler);
+    for (int i = 0; i < runs; i++)
+        fig_model_forward(model);
+    fig_model_set_profiler(model, NULL);
+
+    n_events = fig_profiler_events(profiler, &events);
+    for (uint32_t i = 0; i < n_events; i++)
+        if (events[i].layer_index >= 0)
+            seconds[events[i].layer_index] +=
+                (events[i].end_ns - events[i].start_ns) * 1e-9 / runs;
+
+    fig_profiler_destroy(profiler);
+    return seconds;
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *path = NULL, *shape_arg = NULL;
+    int runs = DEFAULT_RUNS;
+    FigShape shape;
+    FigBuffer *input;
+    FigModel *model;
+    FigLayerCost *costs, total;
+    FigPeak peak;
+    double *seconds = NULL, total_seconds = 0, predicted = 0, ridge = 0;
+    uint32_t n_layers;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--runs") && i + 1 < argc)
+            runs = atoi(argv[++i]);
+        else if (!path)
+            path = argv[i];
+        else if (!shape_arg)
+            shape_arg = argv[i];
+        else
+            usage(argv[0]);
+    }
+
+    if (!path || !shape_arg || runs < 0 ||
+        sscanf(shape_arg, "%ux%ux%u", &shape.width, &shape.height, &shape.channels) != 3)
+        usage(argv[0]);
+
+    input = fig_buffer_new(shape.width, shape.height, shape.channels);
+    memset(input->data, 0, fig_shape_len(shape) * sizeof(float));
+    model = fig_model_from_file(path, input);
+    costs = fig_model_cost(model, NULL, &n_layers);
+
+    if (runs) {
+        /* the layer kernels run on the calling thread */
+        fig_measure_peak(NULL, &peak);
+        ridge = peak.flops / peak.bandwidth;
+        seconds = layer_times(model, n_layers, runs);
+
+        printf("peak: %.2f GFLOP/s, %.2f GB/s, ridge point %.2f FLOP/byte\n\n",
+               peak.flops * 1e-9, peak.bandwidth * 1e-9, ridge);
+    }
+
+    printf("%5s  %-14s  %-16s  %16s  %10s  %10s  %10s  %10s  %8s",
+           "layer", "type", "kernel", "output", "MMAC", "weight KB", "read KB",
+           "write KB", "FLOP/B");
+    if (runs)
+        printf("  %9s  %9s  %6s  %7s", "ms", "GFLOP/s", "roof%", "bound");
+    printf("\n");
+
+    memset(&total, 0, sizeof total);
+
+    for (uint32_t i = 0; i < n_layers; i++) {
+        FigLayerCost *c = costs + i;
+        FigLayer *layer = fig_list_at(model->layers, i);
+        char output[48];
+
+        snprintf(output, sizeof output, "%ux%ux%u",
+                 c->output.width, c->output.height, c->output.channels);
+
+        printf("%5u  %-14s  %-16s  %16s  %10.2f  %10.1f  %10.1f  %10.1f  %8.2f", i,
+               fig_layer_type_name(c->type), layer->kernel ? layer->kernel : "",
+               output, c->macs * 1e-6, c->weight_bytes / 1024.0,
+               c->bytes_read / 1024.0, c->bytes_written / 1024.0,
+               fig_cost_intensity(c));
+
+        if (runs && seconds[i] > 0)
+            printf("  %9.3f  %9.2f  %5.1f%%  %7s", seconds[i] * 1e3,
+                   c->flops / seconds[i] * 1e-9,
+                   100 * fig_cost_predict(c, &peak) / seconds[i],
+                   fig_cost_intensity(c) < ridge ? "memory" : "compute");
+        printf("\n");
+
+        total.macs += c->macs;
+        total.flops += c->flops;
+        total.weight_bytes += c->weight_bytes;
+        total.bytes_read += c->bytes_read;
+        total.bytes_written += c->bytes_written;
+        if (runs) {
+            total_seconds += seconds[i];
+            predicted += fig_cost_predict(c, &peak);
+        }
+    }
+
+    printf("%5s  %-14s  %-16s  %16s  %10.2f  %10.1f  %10.1f  %10.1f  %8.2f",
+           "total", "", "", "", total.macs * 1e-6, total.weight_bytes / 1024.0,
+           total.bytes_read / 1024.0, total.bytes_written / 1024.0,
+           fig_cost_intensity(&total));
+    if (runs && total_seconds > 0)
+        printf("  %9.3f  %9.2f  %5.1f%%", total_seconds * 1e3,
+               total.flops / total_seconds * 1e-9,
+               100 * predicted / total_seconds);
+    printf("\n");
+
+    free(seconds);
+    free(costs);
+    fig_model_destroy(model);
+    fig_buffer_destroy(input);
+
+    return 0;
+}
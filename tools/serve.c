@@ -0,0 +1,657 @@
+/*
+ * File: serve.c
+ * Desc: A daemon answering inference requests from other processes of
+ *       the host over a Unix socket, batching concurrent requests.
+ *
+ * usage: fig-serve [--socket PATH] [--threads N] [--inferences N]
+ *                  --model NAME=MODEL,WIDTHxHEIGHTxCHANNELS[,batch=N][,delay=US][,slots=N]
+ *                                [,priority=interactive|bulk] ...
+ *
+ * Every model is built once for its largest batch and gets a batcher
+ * thread. Requests for a model queue until batch of them are waiting or
+ * the oldest has waited delay microseconds, whichever comes first; the
+ * batcher then runs one forward pass over just those images with
+ * fig_model_set_batch() and hands every connection its output. A short
+ * delay keeps latency close to that of a single image, a longer one
+ * fills batches for throughput. All models run their layers as jobs of
+ * one scheduler of N threads, by default one per CPU, so batches of
+ * different models run side by side instead of queueing for a pool. At
+ * most --inferences batches run at once, and the layers of bulk models
+ * yield to those of interactive ones at every tile. The protocol is in
+ * serve.h, and fig-serve-client drives it. SIGINT or SIGTERM prints per
+ * model statistics and exits.
+ *
+ * Requests live in a ring of slots in shared memory, by default four
+ * batches of them, which shared memory clients write and read in place
+ * and socket requests are read into and written from. The model input
+ * and output are windows of a batch of slots sliding over the rings,
+ * moved onto the longest run of consecutive queued slots around the
+ * oldest, so a batch runs where its requests are without being copied.
+ * Slots are handed out in ring order, which keeps runs long.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <model.h>
+#include <scheduler.h>
+#include <stats.h>
+#include "serve.h"
+
+#define DEFAULT_BATCH 8
+#define DEFAULT_DELAY_US 2000
+#define DEFAULT_SLOTS_PER_BATCH 4
+
+enum SlotState
+{
+    SLOT_FREE,
+    /* held by a connection writing its input */
+    SLOT_ACQUIRED,
+    SLOT_QUEUED,
+    SLOT_RUNNING,
+    /* held by a connection reading its output */
+    SLOT_DONE
+};
+
+typedef struct
+{
+    int state;
+    uint64_t arrival_ns;
+} Slot;
+
+typedef struct
+{
+    char name[FIG_SERVE_NAME_MAX];
+    const char *path;
+    FigShape shape;
+
+    /* latency and throughput policy */
+    uint32_t max_batch;
+    uint64_t max_delay_ns;
+    int priority;
+
+    FigModel *model;
+    FigModelStats *stats;
+    /* from a request being queued to its output being ready */
+    FigHistogram latency;
+
+    /* memfd holding the input ring, then the output ring from output_offset */
+    int memfd;
+    size_t output_offset;
+    float *inputs,
+          *outputs;
+    size_t in_len,
+           out_len;
+
+    /* max_batch images of the rings, moved to each batch before it runs */
+    FigBuffer *input,
+              *output;
+
+    /*
+     * queued is signalled on new requests, served on finished batches and
+     * released on freed slots. Acquiring looks for a free slot from
+     * next_slot on.
+     */
+    pthread_mutex_t lock;
+    pthread_cond_t queued,
+                   served,
+                   released;
+    Slot *slots;
+    uint32_t n_slots,
+             next_slot,
+             n_queued;
+
+    pthread_t thread;
+} Served;
+
+static Served *served_models;
+static uint32_t n_served;
+static volatile sig_atomic_t quit;
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [--socket PATH] [--threads N] [--inferences N]\n"
+            "       --model NAME=MODEL,WIDTHxHEIGHTxCHANNELS[,batch=N][,delay=US][,slots=N]\n"
+            "                     [,priority=interactive|bulk] ...\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t
+now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+parse_model(const char *prog, char *arg, Served *served)
+{
+    char *name = arg, *option, *rest;
+
+    arg = strchr(arg, '=');
+    if (!arg || arg == name || arg - name >= FIG_SERVE_NAME_MAX)
+        usage(prog);
+    *arg++ = '\0';
+
+    memset(served, 0, sizeof *served);
+    strcpy(served->name, name);
+    served->max_batch = DEFAULT_BATCH;
+    served->max_delay_ns = DEFAULT_DELAY_US * 1000ull;
+    served->priority = FIG_PRIORITY_INTERACTIVE;
+
+    served->path = strtok_r(arg, ",", &rest);
+    option = strtok_r(NULL, ",", &rest);
+    if (!served->path || !option ||
+        sscanf(option, "%ux%ux%u", &served->shape.width, &served->shape.height,
+               &served->shape.channels) != 3)
+        usage(prog);
+
+    while ((option = strtok_r(NULL, ",", &rest))) {
+        unsigned long long value;
+
+        if (sscanf(option, "batch=%llu", &value) == 1 && value)
+            served->max_batch = value;
+        else if (sscanf(option, "delay=%llu", &value) == 1)
+            served->max_delay_ns = value * 1000;
+        else if (sscanf(option, "slots=%llu", &value) == 1 && value)
+            served->n_slots = value;
+        else if (!strcmp(option, "priority=interactive"))
+            served->priority = FIG_PRIORITY_INTERACTIVE;
+        else if (!strcmp(option, "priority=bulk"))
+            served->priority = FIG_PRIORITY_BULK;
+        else
+            usage(prog);
+    }
+
+    if (!served->n_slots)
+        served->n_slots = DEFAULT_SLOTS_PER_BATCH * served->max_batch;
+    if (served->n_slots < served->max_batch) {
+        fprintf(stderr, "%s needs at least a batch of slots\n", served->name);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static Served *
+find_model(const char *name)
+{
+    for (uint32_t i = 0; i < n_served; i++)
+        if (!strncmp(served_models[i].name, name, FIG_SERVE_NAME_MAX))
+            return served_models + i;
+    return NULL;
+}
+
+/* Hands out the next free slot in ring order, waiting for one if needed */
+
+static uint32_t
+acquire(Served *served)
+{
+    uint32_t slot;
+
+    pthread_mutex_lock(&served->lock);
+    for (;;) {
+        for (uint32_t i = 0; i < served->n_slots; i++) {
+            slot = (served->next_slot + i) % served->n_slots;
+            if (served->slots[slot].state == SLOT_FREE) {
+                served->slots[slot].state = SLOT_ACQUIRED;
+                served->next_slot = (slot + 1) % served->n_slots;
+                pthread_mutex_unlock(&served->lock);
+                return slot;
+            }
+        }
+        pthread_cond_wait(&served->released, &served->lock);
+    }
+}
+
+static void
+release(Served *served, uint32_t slot)
+{
+    pthread_mutex_lock(&served->lock);
+    served->slots[slot].state = SLOT_FREE;
+    pthread_cond_signal(&served->released);
+    pthread_mutex_unlock(&served->lock);
+}
+
+/* Queues an acquired slot and waits for the batch holding it */
+
+static void
+submit(Served *served, uint32_t slot)
+{
+    Slot *entry = served->slots + slot;
+
+    pthread_mutex_lock(&served->lock);
+    entry->arrival_ns = now_ns();
+    entry->state = SLOT_QUEUED;
+    served->n_queued++;
+    pthread_cond_signal(&served->queued);
+
+    while (entry->state != SLOT_DONE)
+        pthread_cond_wait(&served->served, &served->lock);
+    pthread_mutex_unlock(&served->lock);
+}
+
+static uint32_t
+oldest_queued(Served *served)
+{
+    uint32_t oldest = served->n_slots;
+
+    for (uint32_t i = 0; i < served->n_slots; i++)
+        if (served->slots[i].state == SLOT_QUEUED &&
+            (oldest == served->n_slots ||
+             served->slots[i].arrival_ns < served->slots[oldest].arrival_ns))
+            oldest = i;
+    return oldest;
+}
+
+static void *
+batcher(void *arg)
+{
+    Served *served = (Served *) arg;
+    Slot *slots = served->slots;
+    struct timespec deadline;
+    uint64_t due;
+    uint32_t first, n;
+
+    pthread_mutex_lock(&served->lock);
+    for (;;) {
+        while (!served->n_queued)
+            pthread_cond_wait(&served->queued, &served->lock);
+
+        /* hold the batch open until it is full or its oldest request is due */
+        due = slots[oldest_queued(served)].arrival_ns + served->max_delay_ns;
+        deadline.tv_sec = due / 1000000000;
+        deadline.tv_nsec = due % 1000000000;
+        while (served->n_queued < served->max_batch &&
+               pthread_cond_timedwait(&served->queued, &served->lock,
+                                      &deadline) != ETIMEDOUT)
+            ;
+
+        /* the run of queued slots around the oldest, at most a batch long */
+        first = oldest_queued(served);
+        n = 1;
+        while (n < served->max_batch && first + n < served->n_slots &&
+               slots[first + n].state == SLOT_QUEUED)
+            n++;
+        while (n < served->max_batch && first > 0 &&
+               slots[first - 1].state == SLOT_QUEUED) {
+            first--;
+            n++;
+        }
+
+        for (uint32_t i = first; i < first + n; i++)
+            slots[i].state = SLOT_RUNNING;
+        served->n_queued -= n;
+        pthread_mutex_unlock(&served->lock);
+
+        served->input->data = served->inputs + first * served->in_len;
+        served->output->data = served->outputs + first * served->out_len;
+        fig_model_set_batch(served->model, n);
+        fig_model_forward(served->model);
+
+        pthread_mutex_lock(&served->lock);
+        for (uint32_t i = first; i < first + n; i++) {
+            fig_histogram_record(&served->latency, now_ns() - slots[i].arrival_ns);
+            slots[i].state = SLOT_DONE;
+        }
+        pthread_cond_broadcast(&served->served);
+    }
+
+    return NULL;
+}
+
+/* Sends a response with the model's memfd attached */
+
+static int
+send_memfd(int fd, Served *served, const struct FigServeResponse *response)
+{
+    struct iovec iov = { .iov_base = (void *) response, .iov_len = sizeof *response };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr message = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof control,
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+
+    memset(control, 0, sizeof control);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &served->memfd, sizeof(int));
+
+    return sendmsg(fd, &message, MSG_NOSIGNAL) == sizeof *response ? 0 : -1;
+}
+
+static void *
+connection(void *arg)
+{
+    int fd = (int) (intptr_t) arg;
+    struct FigServeRequest request;
+    struct FigServeResponse response;
+    Served *served, *holder = NULL;
+    uint32_t slot, held = 0;
+
+    while (!fig_serve_read(fd, &request, sizeof request)) {
+        memset(&response, 0, sizeof response);
+
+        served = find_model(request.model);
+        if (!served) {
+            response.status = FIG_SERVE_NO_MODEL;
+            fig_serve_write(fd, &response, sizeof response);
+            break;
+        }
+
+        response.input = served->shape;
+        response.output = fig_buffer_shape(served->output);
+        response.n_slots = served->n_slots;
+        response.output_offset = served->output_offset;
+
+        switch (request.op) {
+        case FIG_SERVE_INFO:
+            if (fig_serve_write(fd, &response, sizeof response))
+                goto done;
+            continue;
+
+        case FIG_SERVE_MAP:
+            if (send_memfd(fd, served, &response))
+                goto done;
+            continue;
+
+        case FIG_SERVE_ACQUIRE:
+            if (holder)
+                release(holder, held);
+            held = response.slot = acquire(served);
+            holder = served;
+            if (fig_serve_write(fd, &response, sizeof response))
+                goto done;
+            continue;
+
+        case FIG_SERVE_SUBMIT:
+            /* the held slot is only ever changed by this thread */
+            if (holder != served || request.slot != held ||
+                served->slots[held].state != SLOT_ACQUIRED) {
+                response.status = FIG_SERVE_BAD_SLOT;
+                fig_serve_write(fd, &response, sizeof response);
+                goto done;
+            }
+            submit(served, held);
+            response.slot = held;
+            if (fig_serve_write(fd, &response, sizeof response))
+                goto done;
+            continue;
+
+        case FIG_SERVE_INFER:
+            if (request.n_floats != served->in_len) {
+                response.status = FIG_SERVE_BAD_INPUT;
+                fig_serve_write(fd, &response, sizeof response);
+                goto done;
+            }
+
+            /* the tensors still cross the socket, but go straight to and from the ring */
+            slot = acquire(served);
+            if (fig_serve_read(fd, served->inputs + slot * served->in_len,
+                               served->in_len * sizeof(float))) {
+                release(served, slot);
+                goto done;
+            }
+            submit(served, slot);
+
+            response.n_floats = served->out_len;
+            if (fig_serve_write(fd, &response, sizeof response) ||
+                fig_serve_write(fd, served->outputs + slot * served->out_len,
+                                served->out_len * sizeof(float))) {
+                release(served, slot);
+                goto done;
+            }
+            release(served, slot);
+            continue;
+
+        default:
+            response.status = FIG_SERVE_BAD_OP;
+            fig_serve_write(fd, &response, sizeof response);
+            goto done;
+        }
+    }
+
+done:
+    if (holder)
+        release(holder, held);
+    close(fd);
+    return NULL;
+}
+
+/* Maps both rings of a model into one memfd clients can map as well */
+
+static void
+map_rings(Served *served, FigShape output_shape)
+{
+    size_t page = sysconf(_SC_PAGESIZE), size;
+    char *base;
+
+    served->in_len = fig_shape_len(served->shape);
+    served->out_len = fig_shape_len(output_shape);
+    served->output_offset = (served->n_slots * served->in_len * sizeof(float) +
+                             page - 1) / page * page;
+    size = served->output_offset + served->n_slots * served->out_len * sizeof(float);
+
+    served->memfd = memfd_create(served->name, MFD_CLOEXEC);
+    if (served->memfd < 0 || ftruncate(served->memfd, size)) {
+        perror("memfd");
+        exit(EXIT_FAILURE);
+    }
+
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, served->memfd, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap");
+        exit(EXIT_FAILURE);
+    }
+
+    served->inputs = (float *) base;
+    served->outputs = (float *) (base + served->output_offset);
+}
+
+/* Turns a buffer into a window onto a ring, at its first slot */
+
+static void
+make_window(FigBuffer *buffer, float *ring)
+{
+    free(buffer->data);
+    buffer->data = ring;
+}
+
+static void
+load_model(Served *served, FigScheduler *scheduler)
+{
+    pthread_condattr_t attr;
+    FigBuffer *own_output;
+
+    served->input = fig_buffer_new_batch(served->max_batch, served->shape.width,
+                                         served->shape.height, served->shape.channels);
+    served->model = fig_model_from_file(served->path, served->input);
+    own_output = fig_model_output(served->model);
+    served->output = fig_buffer_new_batch(served->max_batch, own_output->width,
+                                          own_output->height, own_output->channels);
+
+    map_rings(served, fig_buffer_shape(own_output));
+    make_window(served->input, served->inputs);
+    make_window(served->output, served->outputs);
+    fig_model_set_output(served->model, served->output);
+    fig_model_set_scheduler(served->model, scheduler, served->priority);
+
+    /* a full batch faults in the model and the first batch of slots */
+    fig_model_warmup(served->model, 1);
+    served->stats = fig_model_enable_stats(served->model);
+    fig_histogram_init(&served->latency);
+
+    served->slots = calloc(served->n_slots, sizeof(Slot));
+    if (!served->slots) {
+        fprintf(stderr, "failed allocating memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&served->lock, NULL);
+    pthread_cond_init(&served->queued, &attr);
+    pthread_cond_init(&served->served, NULL);
+    pthread_cond_init(&served->released, NULL);
+    pthread_condattr_destroy(&attr);
+
+    if (pthread_create(&served->thread, NULL, &batcher, served)) {
+        fprintf(stderr, "failed starting the batcher of %s\n", served->name);
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%s: %s, %ux%ux%u, batch %u, delay %.3f ms, %u slots, %s\n",
+           served->name, served->path, served->shape.width, served->shape.height,
+           served->shape.channels, served->max_batch, served->max_delay_ns * 1e-6,
+           served->n_slots,
+           served->priority == FIG_PRIORITY_BULK ? "bulk" : "interactive");
+}
+
+static void
+print_stats(Served *served)
+{
+    FigModelStats *snapshot;
+    FigHistogram latency;
+    FigLatencySummary forward, request;
+
+    snapshot = fig_model_stats_new(served->stats->n_layers);
+    fig_model_stats_snapshot(served->stats, snapshot, false);
+    fig_histogram_snapshot(&served->latency, &latency, false);
+    fig_histogram_summarize(&snapshot->forward, &forward);
+    fig_histogram_summarize(&latency, &request);
+
+    printf("%s: %llu requests in %llu batches, %.2f per batch\n", served->name,
+           (unsigned long long) snapshot->inferences,
+           (unsigned long long) forward.count,
+           forward.count ? (double) snapshot->inferences / forward.count : 0.0);
+    printf("%s: request ms p50 %.3f p99 %.3f max %.3f, batch ms p50 %.3f p99 %.3f\n",
+           served->name, request.p50_ns * 1e-6, request.p99_ns * 1e-6,
+           request.max_ns * 1e-6, forward.p50_ns * 1e-6, forward.p99_ns * 1e-6);
+
+    fig_model_stats_destroy(snapshot);
+}
+
+static void
+print_admission(FigScheduler *scheduler)
+{
+    static const char *names[FIG_PRIORITY_CLASSES] = { "interactive", "bulk" };
+    FigLatencySummary wait;
+
+    for (int c = 0; c < FIG_PRIORITY_CLASSES; c++) {
+        fig_histogram_summarize(&scheduler->admission_wait[c], &wait);
+        if (wait.count)
+            printf("%s batches waited for admission ms p50 %.3f p99 %.3f max %.3f\n",
+                   names[c], wait.p50_ns * 1e-6, wait.p99_ns * 1e-6,
+                   wait.max_ns * 1e-6);
+    }
+}
+
+static void
+on_signal(int signal)
+{
+    (void) signal;
+    quit = 1;
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *socket_path = FIG_SERVE_SOCKET;
+    struct SchedulerDesc scheduler_desc = { 0 };
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    struct sigaction action = { .sa_handler = &on_signal };
+    FigScheduler *scheduler;
+    pthread_t thread;
+    int listener, fd;
+
+    served_models = calloc(argc, sizeof(Served));
+    if (!served_models) {
+        fprintf(stderr, "failed allocating memory\n");
+        return EXIT_FAILURE;
+    }
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--socket") && i + 1 < argc)
+            socket_path = argv[++i];
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc)
+            scheduler_desc.n_threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--inferences") && i + 1 < argc)
+            scheduler_desc.max_inferences = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--model") && i + 1 < argc)
+            parse_model(argv[0], argv[++i], served_models + n_served++);
+        else
+            usage(argv[0]);
+    }
+
+    if (!n_served || strlen(socket_path) >= sizeof address.sun_path)
+        usage(argv[0]);
+
+    for (uint32_t i = 0; i < n_served; i++)
+        for (uint32_t j = 0; j < i; j++)
+            if (!strcmp(served_models[i].name, served_models[j].name)) {
+                fprintf(stderr, "model %s is given twice\n", served_models[i].name);
+                return EXIT_FAILURE;
+            }
+
+    /* accept() returns on SIGINT and SIGTERM instead of restarting */
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    scheduler = fig_scheduler_new(&scheduler_desc);
+    for (uint32_t i = 0; i < n_served; i++)
+        load_model(served_models + i, scheduler);
+
+    strcpy(address.sun_path, socket_path);
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socket_path);
+    if (listener < 0 || bind(listener, (struct sockaddr *) &address, sizeof address) ||
+        listen(listener, SOMAXCONN)) {
+        perror(socket_path);
+        return EXIT_FAILURE;
+    }
+    printf("serving %u models on %s with %u threads\n", n_served, socket_path,
+           fig_scheduler_size(scheduler));
+    fflush(stdout);
+
+    while (!quit) {
+        fd = accept(listener, NULL, NULL);
+        if (fd < 0) {
+            if (errno != EINTR)
+                perror("accept");
+            continue;
+        }
+
+        if (pthread_create(&thread, NULL, &connection, (void *) (intptr_t) fd)) {
+            close(fd);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+
+    /* batchers and connections still running are ended with the process */
+    close(listener);
+    unlink(socket_path);
+    for (uint32_t i = 0; i < n_served; i++)
+        print_stats(served_models + i);
+    print_admission(scheduler);
+
+    return 0;
+}
@@ -0,0 +1,107 @@
+/*
+ * File: serve.h
+ * Desc: Wire protocol of fig-serve, shared with fig-serve-client.
+ *
+ * A client connects to the server's Unix socket and sends requests one
+ * at a time, each answered before the next is read; concurrency comes
+ * from opening several connections. Both ends share a host, so headers
+ * and floats travel in native byte order. A response with any status
+ * other than FIG_SERVE_OK is followed by the server closing the
+ * connection.
+ *
+ * FIG_SERVE_INFER carries the tensors in the messages. The shared memory
+ * transport carries none: FIG_SERVE_MAP answers with a memfd, passed as
+ * SCM_RIGHTS with the response, holding the model's rings of n_slots
+ * input images from offset 0 and n_slots output images from
+ * output_offset, HWC floats back to back. A client maps it, acquires a
+ * slot, writes an input straight into it and submits the slot index. The
+ * answer means the output is in the same slot of the output ring, where
+ * it stays until the connection acquires its next slot or closes.
+ */
+
+#ifndef _FIG_SERVE_H_
+#define _FIG_SERVE_H_
+
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <buffer.h>
+
+#define FIG_SERVE_SOCKET "/tmp/fig-serve.sock"
+#define FIG_SERVE_NAME_MAX 32
+
+enum FigServeOp
+{
+    /* shapes of a model, with no payload either way */
+    FIG_SERVE_INFO,
+    /* one input image in, one output out */
+    FIG_SERVE_INFER,
+    /* the model's shared memory and its layout */
+    FIG_SERVE_MAP,
+    /* a free slot to write an input into, releasing the one held before */
+    FIG_SERVE_ACQUIRE,
+    /* runs the input of the acquired slot, answered once its output is in */
+    FIG_SERVE_SUBMIT
+};
+
+enum FigServeStatus
+{
+    FIG_SERVE_OK,
+    FIG_SERVE_BAD_OP,
+    FIG_SERVE_NO_MODEL,
+    FIG_SERVE_BAD_INPUT,
+    FIG_SERVE_BAD_SLOT
+};
+
+/* followed by n_floats HWC input floats for FIG_SERVE_INFER */
+struct FigServeRequest
+{
+    uint32_t op;
+    char model[FIG_SERVE_NAME_MAX];
+    uint32_t n_floats;
+    uint32_t slot;
+};
+
+/* followed by n_floats HWC output floats */
+struct FigServeResponse
+{
+    uint32_t status;
+    FigShape input,
+             output;
+    uint32_t n_floats;
+
+    /* shared memory layout and the slot acquired or submitted */
+    uint32_t slot,
+             n_slots;
+    uint64_t output_offset;
+};
+
+/* Reads or writes exactly size bytes. Returns -1 on error or end of file. */
+
+static inline int
+fig_serve_read(int fd, void *data, size_t size)
+{
+    for (ssize_t n; size; data = (char *) data + n, size -= n) {
+        n = read(fd, data, size);
+        if (n <= 0 && !(n < 0 && errno == EINTR))
+            return -1;
+        if (n < 0)
+            n = 0;
+    }
+    return 0;
+}
+
+static inline int
+fig_serve_write(int fd, const void *data, size_t size)
+{
+    for (ssize_t n; size; data = (const char *) data + n, size -= n) {
+        n = write(fd, data, size);
+        if (n < 0 && errno != EINTR)
+            return -1;
+        if (n < 0)
+            n = 0;
+    }
+    return 0;
+}
+
+#endif /* _FIG_SERVE_H_ */
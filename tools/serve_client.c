@@ -0,0 +1,289 @@
+/*
+ * File: serve_client.c
+ * Desc: Load generator for fig-serve. Opens one connection per client
+ *       thread, each sending requests back to back with random inputs,
+ *       and reports throughput and request latency.
+ *
+ * usage: fig-serve-client [--socket PATH] [--clients N] [--requests N] [--shm] MODEL
+ *
+ * Running as many clients as the model's batch shows what batching buys
+ * over the one client case, whose latency is that of a single image plus
+ * the model's delay. --shm uses the shared memory transport instead of
+ * sending tensors over the socket.
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#include <stats.h>
+#include "serve.h"
+
+#define DEFAULT_CLIENTS 8
+#define DEFAULT_REQUESTS 100
+
+typedef struct
+{
+    const char *socket_path,
+               *model;
+    uint32_t n_requests;
+    bool shm;
+    FigHistogram *latency;
+    /* first output float of the last response */
+    float first;
+    int failed;
+} Client;
+
+static void
+usage(const char *prog)
+{
+    fprintf(stderr, "usage: %s [--socket PATH] [--clients N] [--requests N] [--shm] MODEL\n",
+            prog);
+    exit(EXIT_FAILURE);
+}
+
+static uint64_t
+now_ns()
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static int
+connect_to(const char *socket_path)
+{
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    int fd;
+
+    strncpy(address.sun_path, socket_path, sizeof address.sun_path - 1);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *) &address, sizeof address)) {
+        perror(socket_path);
+        exit(EXIT_FAILURE);
+    }
+
+    return fd;
+}
+
+/* Sends one request and reads the response header, 0 on success */
+
+static int
+request(int fd, const char *model, uint32_t op, uint32_t slot, const float *input,
+        uint32_t n_floats, struct FigServeResponse *response)
+{
+    struct FigServeRequest header = { .op = op, .n_floats = n_floats, .slot = slot };
+
+    snprintf(header.model, sizeof header.model, "%s", model);
+    if (fig_serve_write(fd, &header, sizeof header) ||
+        fig_serve_write(fd, input, n_floats * sizeof(float)) ||
+        fig_serve_read(fd, response, sizeof *response))
+        return -1;
+
+    return response->status == FIG_SERVE_OK ? 0 : -1;
+}
+
+/* Maps the shared memory of a model, as laid out in response */
+
+static char *
+map_model(int fd, const char *model, struct FigServeResponse *response)
+{
+    struct FigServeRequest header = { .op = FIG_SERVE_MAP };
+    struct iovec iov = { .iov_base = response, .iov_len = sizeof *response };
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr message = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof control,
+    };
+    struct cmsghdr *cmsg;
+    size_t size;
+    void *base;
+    int memfd;
+
+    snprintf(header.model, sizeof header.model, "%s", model);
+    if (fig_serve_write(fd, &header, sizeof header) ||
+        recvmsg(fd, &message, MSG_WAITALL) != sizeof *response ||
+        response->status != FIG_SERVE_OK)
+        return NULL;
+
+    cmsg = CMSG_FIRSTHDR(&message);
+    if (!cmsg || cmsg->cmsg_type != SCM_RIGHTS)
+        return NULL;
+    memcpy(&memfd, CMSG_DATA(cmsg), sizeof(int));
+
+    size = response->output_offset +
+           response->n_slots * fig_shape_len(response->output) * sizeof(float);
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    close(memfd);
+
+    return base == MAP_FAILED ? NULL : (char *) base;
+}
+
+/* One inference through a slot of the shared rings, 0 on success */
+
+static int
+infer_shm(int fd, Client *client, char *base, const float *input,
+          const struct FigServeResponse *layout)
+{
+    struct FigServeResponse response;
+    size_t in_len = fig_shape_len(layout->input), out_len = fig_shape_len(layout->output);
+    const float *output;
+    float *slot_input;
+
+    if (request(fd, client->model, FIG_SERVE_ACQUIRE, 0, NULL, 0, &response))
+        return -1;
+
+    /* stands in for decoding a frame straight into the slot */
+    slot_input = (float *) base + response.slot * in_len;
+    memcpy(slot_input, input, in_len * sizeof(float));
+
+    if (request(fd, client->model, FIG_SERVE_SUBMIT, response.slot, NULL, 0, &response))
+        return -1;
+
+    output = (const float *) (base + layout->output_offset) + response.slot * out_len;
+    client->first = output[0];
+    return 0;
+}
+
+static void *
+client(void *arg)
+{
+    Client *client = (Client *) arg;
+    struct FigServeResponse layout, response;
+    float *input, *output;
+    char *base = NULL;
+    size_t in_len, out_len;
+    uint64_t start;
+    int fd;
+
+    fd = connect_to(client->socket_path);
+    if (client->shm)
+        base = map_model(fd, client->model, &layout);
+    if (client->shm ? !base :
+        request(fd, client->model, FIG_SERVE_INFO, 0, NULL, 0, &layout)) {
+        client->failed = 1;
+        close(fd);
+        return NULL;
+    }
+
+    in_len = fig_shape_len(layout.input);
+    out_len = fig_shape_len(layout.output);
+    input = malloc(in_len * sizeof(float));
+    output = malloc(out_len * sizeof(float));
+    if (!input || !output) {
+        fprintf(stderr, "failed allocating memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (size_t i = 0; i < in_len; i++)
+        input[i] = (float) rand() / RAND_MAX;
+
+    for (uint32_t i = 0; i < client->n_requests; i++) {
+        start = now_ns();
+        if (client->shm) {
+            if (infer_shm(fd, client, base, input, &layout)) {
+                client->failed = 1;
+                break;
+            }
+        } else {
+            if (request(fd, client->model, FIG_SERVE_INFER, 0, input, in_len, &response) ||
+                response.n_floats != out_len ||
+                fig_serve_read(fd, output, out_len * sizeof(float))) {
+                client->failed = 1;
+                break;
+            }
+            client->first = output[0];
+        }
+        fig_histogram_record(client->latency, now_ns() - start);
+    }
+
+    if (base)
+        munmap(base, layout.output_offset + layout.n_slots * out_len * sizeof(float));
+    free(input);
+    free(output);
+    close(fd);
+    return NULL;
+}
+
+int
+main(int argc, char *argv[])
+{
+    const char *socket_path = FIG_SERVE_SOCKET, *model = NULL;
+    uint32_t n_clients = DEFAULT_CLIENTS, n_requests = DEFAULT_REQUESTS;
+    FigHistogram latency;
+    FigLatencySummary summary;
+    Client *clients;
+    pthread_t *threads;
+    uint64_t start, elapsed;
+    bool shm = false;
+    int failed = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--socket") && i + 1 < argc)
+            socket_path = argv[++i];
+        else if (!strcmp(argv[i], "--clients") && i + 1 < argc)
+            n_clients = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--requests") && i + 1 < argc)
+            n_requests = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--shm"))
+            shm = true;
+        else if (!model)
+            model = argv[i];
+        else
+            usage(argv[0]);
+    }
+
+    if (!model || !n_clients)
+        usage(argv[0]);
+
+    clients = calloc(n_clients, sizeof(Client));
+    threads = malloc(n_clients * sizeof(pthread_t));
+    if (!clients || !threads) {
+        fprintf(stderr, "failed allocating memory\n");
+        return EXIT_FAILURE;
+    }
+
+    fig_histogram_init(&latency);
+    start = now_ns();
+
+    for (uint32_t i = 0; i < n_clients; i++) {
+        clients[i].socket_path = socket_path;
+        clients[i].model = model;
+        clients[i].n_requests = n_requests;
+        clients[i].shm = shm;
+        clients[i].latency = &latency;
+        pthread_create(threads + i, NULL, &client, clients + i);
+    }
+
+    for (uint32_t i = 0; i < n_clients; i++) {
+        pthread_join(threads[i], NULL);
+        failed |= clients[i].failed;
+    }
+
+    elapsed = now_ns() - start;
+    fig_histogram_summarize(&latency, &summary);
+
+    if (failed)
+        fprintf(stderr, "some requests failed\n");
+    printf("%llu requests from %u clients, %.1f per second\n",
+           (unsigned long long) summary.count, n_clients,
+           summary.count / (elapsed * 1e-9));
+    printf("Request ms p50 %.3f p90 %.3f p99 %.3f max %.3f\n",
+           summary.p50_ns * 1e-6, summary.p90_ns * 1e-6,
+           summary.p99_ns * 1e-6, summary.max_ns * 1e-6);
+    printf("First output of client 0: %f\n", clients[0].first);
+
+    free(clients);
+    free(threads);
+
+    return failed ? EXIT_FAILURE : 0;
+}